@@ -4,6 +4,7 @@
 #include <kstd/io.h>
 #include <kstd/string.h>
 #include <syncos/vmm.h>
+#include <syncos/dma.h>
 
 #define E1000_REG_CTRL     0x0000
 #define E1000_REG_STATUS   0x0008
@@ -31,13 +32,21 @@ extern pci_device_t pci_devices[];
 static uint8_t tx_buffer[8192];
 static uint8_t rx_buffer[8192];
 
-static uint8_t* tx_buffers[8];
-static uint32_t tx_buffer_indices[8];
-static struct e1000_tx_desc* tx_descs[8];
+#define E1000_NUM_TX_DESC  8
+#define E1000_NUM_RX_DESC  32
+#define E1000_BUFFER_SIZE  2048    // Matches RCTL.BSIZE = 00
 
-static uint8_t* rx_buffers[32];
-static uint32_t rx_buffer_indices[32];  
-static struct e1000_rx_desc* rx_descs[32];
+#define E1000_TXD_CMD_EOP  0x01
+#define E1000_TXD_CMD_IFCS 0x02
+#define E1000_TXD_CMD_RS   0x08
+
+static uint8_t* tx_buffers[E1000_NUM_TX_DESC];
+static uint32_t tx_buffer_indices[E1000_NUM_TX_DESC];
+static struct e1000_tx_desc* tx_descs[E1000_NUM_TX_DESC];
+
+static uint8_t* rx_buffers[E1000_NUM_RX_DESC];
+static uint32_t rx_buffer_indices[E1000_NUM_RX_DESC];  
+static struct e1000_rx_desc* rx_descs[E1000_NUM_RX_DESC];
 
 // Helper to read from E1000 registers
 static inline uint32_t e1000_read(uint16_t index) {
@@ -49,6 +58,55 @@ static inline void e1000_write(uint16_t index, uint32_t value) {
     outl(iobase + index, value);
 }
 
+// Allocate descriptor rings and packet buffers from the DMA area and
+// program their bus addresses into the controller
+static bool e1000_setup_rings(void) {
+    uintptr_t tx_ring_phys, rx_ring_phys, tx_buf_phys, rx_buf_phys;
+    
+    struct e1000_tx_desc* tx_ring = dma_alloc_coherent(
+        E1000_NUM_TX_DESC * sizeof(struct e1000_tx_desc), &tx_ring_phys);
+    struct e1000_rx_desc* rx_ring = dma_alloc_coherent(
+        E1000_NUM_RX_DESC * sizeof(struct e1000_rx_desc), &rx_ring_phys);
+    uint8_t* tx_buf = dma_alloc_coherent(E1000_NUM_TX_DESC * E1000_BUFFER_SIZE, &tx_buf_phys);
+    uint8_t* rx_buf = dma_alloc_coherent(E1000_NUM_RX_DESC * E1000_BUFFER_SIZE, &rx_buf_phys);
+    
+    if (!tx_ring || !rx_ring || !tx_buf || !rx_buf) {
+        dma_free_coherent(tx_ring, E1000_NUM_TX_DESC * sizeof(struct e1000_tx_desc));
+        dma_free_coherent(rx_ring, E1000_NUM_RX_DESC * sizeof(struct e1000_rx_desc));
+        dma_free_coherent(tx_buf, E1000_NUM_TX_DESC * E1000_BUFFER_SIZE);
+        dma_free_coherent(rx_buf, E1000_NUM_RX_DESC * E1000_BUFFER_SIZE);
+        return false;
+    }
+    
+    for (int i = 0; i < E1000_NUM_TX_DESC; i++) {
+        tx_descs[i] = &tx_ring[i];
+        tx_buffers[i] = tx_buf + i * E1000_BUFFER_SIZE;
+        tx_buffer_indices[i] = i;
+        tx_descs[i]->addr = tx_buf_phys + i * E1000_BUFFER_SIZE;
+    }
+    
+    for (int i = 0; i < E1000_NUM_RX_DESC; i++) {
+        rx_descs[i] = &rx_ring[i];
+        rx_buffers[i] = rx_buf + i * E1000_BUFFER_SIZE;
+        rx_buffer_indices[i] = i;
+        rx_descs[i]->addr = rx_buf_phys + i * E1000_BUFFER_SIZE;
+    }
+    
+    e1000_write(E1000_REG_TDBAL, (uint32_t)tx_ring_phys);
+    e1000_write(E1000_REG_TDBAH, (uint32_t)(tx_ring_phys >> 32));
+    e1000_write(E1000_REG_TDLEN, E1000_NUM_TX_DESC * sizeof(struct e1000_tx_desc));
+    e1000_write(E1000_REG_TDH, 0);
+    e1000_write(E1000_REG_TDT, 0);
+    
+    e1000_write(E1000_REG_RDBAL, (uint32_t)rx_ring_phys);
+    e1000_write(E1000_REG_RDBAH, (uint32_t)(rx_ring_phys >> 32));
+    e1000_write(E1000_REG_RDLEN, E1000_NUM_RX_DESC * sizeof(struct e1000_rx_desc));
+    e1000_write(E1000_REG_RDH, 0);
+    e1000_write(E1000_REG_RDT, E1000_NUM_RX_DESC - 1);
+    
+    return true;
+}
+
 void e1000_init(void) {
     pci_device_t* dev = pci_find_device(0x8086, 0x100E);
     if (!dev) return;
@@ -74,6 +132,9 @@ void e1000_init(void) {
     // Link up
     e1000_write(E1000_REG_CTRL, e1000_read(E1000_REG_CTRL) | E1000_CTRL_SLU);
     
+    // Descriptor rings must be in place before TX/RX are enabled
+    if (!e1000_setup_rings()) return;
+    
     // Set MAC address if needed
     // Setup transmit control
     e1000_write(E1000_REG_TCTL, 0x0003A007); // TCTL.EN, TCTL.PSP, TCTL.CT=0x0F, TCTL.COLD=0x3F
@@ -101,14 +162,20 @@ void e1000_read_mac(uint8_t mac[6]) {
 void e1000_transmit(uint8_t* data, uint32_t len) {
     static uint8_t tx_index = 0;  
     
+    if (!tx_descs[tx_index] || len > E1000_BUFFER_SIZE) {
+        return;
+    }
+    
     // Copy the data to the next available transmit buffer
     memcpy(tx_buffers[tx_index], data, len);
     
     // Set the length in the descriptor
     tx_descs[tx_index]->length = len;
+    tx_descs[tx_index]->cmd = E1000_TXD_CMD_EOP | E1000_TXD_CMD_IFCS | E1000_TXD_CMD_RS;
+    tx_descs[tx_index]->status = 0;
 
     // Move to next transmit descriptor  
-    tx_index = (tx_index + 1) % 8;
+    tx_index = (tx_index + 1) % E1000_NUM_TX_DESC;
 
     // Update tail pointer 
     e1000_write(E1000_REG_TDT, tx_index);
@@ -134,7 +201,7 @@ uint32_t e1000_receive(uint8_t* buffer) {
     rx_descs[rx_index]->status = 0;  
 
     // Move to next receive descriptor
-    rx_index = (rx_index + 1) % 32;
+    rx_index = (rx_index + 1) % E1000_NUM_RX_DESC;
 
     // Update tail pointer
     e1000_write(E1000_REG_RDT, rx_index);
@@ -3,6 +3,7 @@
 #include <syncos/spinlock.h>
 #include <syncos/vmm.h>
 #include <syncos/pmm.h>
+#include <syncos/dma.h>
 #include <syncos/timer.h>
 #include <kstd/stdio.h>
 #include <kstd/string.h>
@@ -1652,51 +1653,14 @@ void nvme_debug_dump_controller(uint32_t device_id) {
 
 // Helper functions
 
-// Allocate DMA-capable memory
+// Allocate DMA-capable memory from the contiguous DMA area
 static void* nvme_alloc_dma(size_t size, uintptr_t* phys_addr) {
-    // Round up to page size
-    size = (size + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
-    
-    // Allocate physical pages
-    uintptr_t phys = (uintptr_t)pmm_alloc_pages(size / PAGE_SIZE_4K);
-    if (phys == 0) {
-        return NULL;
-    }
-    
-    // Map to virtual memory with appropriate flags
-    void* virt = vmm_map_physical(phys, size, VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE);
-    if (!virt) {
-        pmm_free_pages(phys, size / PAGE_SIZE_4K);
-        return NULL;
-    }
-    
-    // Return physical address if requested
-    if (phys_addr) {
-        *phys_addr = phys;
-    }
-    
-    return virt;
+    return dma_alloc_coherent(size, phys_addr);
 }
 
 // Free DMA-capable memory
 static void nvme_free_dma(void* virt_addr, size_t size) {
-    if (!virt_addr) {
-        return;
-    }
-    
-    // Round up to page size
-    size = (size + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
-    
-    // Get physical address
-    uintptr_t phys = vmm_get_physical_address((uintptr_t)virt_addr);
-    
-    // Unmap virtual memory
-    vmm_unmap_physical(virt_addr, size);
-    
-    // Free physical memory
-    if (phys) {
-        pmm_free_pages(phys, size / PAGE_SIZE_4K);
-    }
+    dma_free_coherent(virt_addr, size);
 }
 
 // Register access helpers
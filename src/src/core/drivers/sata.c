@@ -2,6 +2,7 @@
 #include <core/drivers/pci.h>
 #include <syncos/vmm.h>
 #include <syncos/pmm.h>
+#include <syncos/dma.h>
 #include <syncos/spinlock.h>
 #include <syncos/timer.h>
 #include <kstd/stdio.h>
@@ -712,51 +713,14 @@ int find_command_slot(sata_port_t* port) {
     return -1;
 }
 
-// Allocate DMA-capable memory
+// Allocate DMA-capable memory from the contiguous DMA area
 void* alloc_dma_buffer(size_t size, uintptr_t* phys_addr) {
-    // Round up to page size
-    size = (size + 4095) & ~4095;
-    
-    // Allocate physical pages
-    uintptr_t phys = (uintptr_t)pmm_alloc_pages(size / 4096);
-    if (phys == 0) {
-        return NULL;
-    }
-    
-    // Map to virtual memory with appropriate flags
-    void* virt = vmm_map_physical(phys, size, VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE);
-    if (!virt) {
-        pmm_free_pages(phys, size / 4096);
-        return NULL;
-    }
-    
-    // Return physical address if requested
-    if (phys_addr) {
-        *phys_addr = phys;
-    }
-    
-    return virt;
+    return dma_alloc_coherent(size, phys_addr);
 }
 
 // Free DMA-capable memory
 void free_dma_buffer(void* virt_addr, size_t size) {
-    if (!virt_addr) {
-        return;
-    }
-    
-    // Round up to page size
-    size = (size + 4095) & ~4095;
-    
-    // Get physical address
-    uintptr_t phys = vmm_get_physical_address((uintptr_t)virt_addr);
-    
-    // Unmap virtual memory
-    vmm_unmap_physical(virt_addr, size);
-    
-    // Free physical memory
-    if (phys) {
-        pmm_free_pages(phys, size / 4096);
-    }
+    dma_free_coherent(virt_addr, size);
 }
 
 // Wait for command completion
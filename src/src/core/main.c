@@ -8,6 +8,8 @@
 #include <syncos/mouse.h>
 #include <syncos/pmm.h>
 #include <syncos/vmm.h>
+#include <syncos/dma.h>
+#include <syncos/slab.h>
 #include <core/drivers/nvme.h>
 #include <core/drivers/sata.h>
 #include <core/drivers/pci.h>
@@ -18,6 +20,7 @@
 #include <syncos/fs/ext4.h>
 #include <syncos/elf.h>
 #include <syncos/process.h>
+#include <syncos/smp.h>
 #include <core/drivers/net/e1000.h>
 #include <syncos/net/net.h>
 
@@ -119,6 +122,9 @@ bool network_init(void) {
 
 // Kernel main function
 void kmain(void) {
+    // Per-CPU state (GS base) before anything that uses it
+    smp_init_bsp();
+    
     // Early serial initialization
     serial_init_stdio();
     
@@ -145,6 +151,12 @@ void kmain(void) {
         
         // Initialize VMM after PMM
         vmm_init();
+        
+        // Take over the contiguous DMA area before any driver needs it
+        dma_init();
+        
+        // Kernel heap
+        kmalloc_init();
     } else {
         printf("ERROR: No memory map response from bootloader\n");
     }
@@ -198,7 +210,10 @@ void kmain(void) {
     ext4_init();
     
     kernel_init_processes();
-
+    
+    // Bring up the other CPUs once the scheduler can take them
+    smp_init();
+    
     bool network_available = network_init();
     if (!network_available) {
         printf("WARNING: No network devices were detected!\n");
@@ -209,8 +224,14 @@ void kmain(void) {
     printf("       SyncOS - Finished Initialization       \n");
     printf("==============================================\n\n");
     
-    // Hang forever
+    // Idle loop: run whatever is queued on this CPU, tear down dead address
+    // spaces, promote populated user ranges to huge pages and top up the
+    // pre-zeroed page pools, then wait for interrupts
     while (1) {
+        process_yield();
+        vmm_reap_address_spaces(VMM_REAP_BATCH);
+        process_collapse_huge_pages(VMM_COLLAPSE_BATCH);
+        pmm_zero_pool_refill(PMM_ZERO_POOL_BATCH);
         __asm__ volatile("hlt");
     }
 }
\ No newline at end of file
@@ -0,0 +1,274 @@
+#include <kstd/rbtree.h>
+
+// Replace child old of parent with new (or the root if there is no parent)
+static void rb_replace_child(rb_root_t *root, rb_node_t *parent,
+                             rb_node_t *old, rb_node_t *new) {
+    if (!parent) {
+        root->root = new;
+    } else if (parent->left == old) {
+        parent->left = new;
+    } else {
+        parent->right = new;
+    }
+}
+
+static void rb_rotate_left(rb_root_t *root, rb_node_t *node) {
+    rb_node_t *right = node->right;
+    
+    node->right = right->left;
+    if (right->left) {
+        right->left->parent = node;
+    }
+    
+    right->parent = node->parent;
+    rb_replace_child(root, node->parent, node, right);
+    
+    right->left = node;
+    node->parent = right;
+}
+
+static void rb_rotate_right(rb_root_t *root, rb_node_t *node) {
+    rb_node_t *left = node->left;
+    
+    node->left = left->right;
+    if (left->right) {
+        left->right->parent = node;
+    }
+    
+    left->parent = node->parent;
+    rb_replace_child(root, node->parent, node, left);
+    
+    left->right = node;
+    node->parent = left;
+}
+
+static inline bool rb_is_red(const rb_node_t *node) {
+    return node && node->red;
+}
+
+// Rebalance after rb_link_node
+void rb_insert_color(rb_root_t *root, rb_node_t *node) {
+    while (rb_is_red(node->parent)) {
+        rb_node_t *parent = node->parent;
+        rb_node_t *grandparent = parent->parent;
+        
+        if (parent == grandparent->left) {
+            rb_node_t *uncle = grandparent->right;
+            
+            if (rb_is_red(uncle)) {
+                // Recolor and continue from the grandparent
+                parent->red = false;
+                uncle->red = false;
+                grandparent->red = true;
+                node = grandparent;
+                continue;
+            }
+            
+            if (node == parent->right) {
+                rb_rotate_left(root, parent);
+                node = parent;
+                parent = node->parent;
+            }
+            
+            parent->red = false;
+            grandparent->red = true;
+            rb_rotate_right(root, grandparent);
+        } else {
+            rb_node_t *uncle = grandparent->left;
+            
+            if (rb_is_red(uncle)) {
+                parent->red = false;
+                uncle->red = false;
+                grandparent->red = true;
+                node = grandparent;
+                continue;
+            }
+            
+            if (node == parent->left) {
+                rb_rotate_right(root, parent);
+                node = parent;
+                parent = node->parent;
+            }
+            
+            parent->red = false;
+            grandparent->red = true;
+            rb_rotate_left(root, grandparent);
+        }
+    }
+    
+    root->root->red = false;
+}
+
+// Restore the black height after removing a black node; node may be NULL,
+// so its parent is passed explicitly
+static void rb_erase_fixup(rb_root_t *root, rb_node_t *node, rb_node_t *parent) {
+    while (node != root->root && !rb_is_red(node)) {
+        if (node == parent->left) {
+            rb_node_t *sibling = parent->right;
+            
+            if (rb_is_red(sibling)) {
+                sibling->red = false;
+                parent->red = true;
+                rb_rotate_left(root, parent);
+                sibling = parent->right;
+            }
+            
+            if (!rb_is_red(sibling->left) && !rb_is_red(sibling->right)) {
+                sibling->red = true;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            
+            if (!rb_is_red(sibling->right)) {
+                sibling->left->red = false;
+                sibling->red = true;
+                rb_rotate_right(root, sibling);
+                sibling = parent->right;
+            }
+            
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->right->red = false;
+            rb_rotate_left(root, parent);
+            node = root->root;
+        } else {
+            rb_node_t *sibling = parent->left;
+            
+            if (rb_is_red(sibling)) {
+                sibling->red = false;
+                parent->red = true;
+                rb_rotate_right(root, parent);
+                sibling = parent->left;
+            }
+            
+            if (!rb_is_red(sibling->left) && !rb_is_red(sibling->right)) {
+                sibling->red = true;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            
+            if (!rb_is_red(sibling->left)) {
+                sibling->right->red = false;
+                sibling->red = true;
+                rb_rotate_left(root, sibling);
+                sibling = parent->left;
+            }
+            
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->left->red = false;
+            rb_rotate_right(root, parent);
+            node = root->root;
+        }
+    }
+    
+    if (node) {
+        node->red = false;
+    }
+}
+
+// Remove a node from the tree
+void rb_erase(rb_root_t *root, rb_node_t *node) {
+    rb_node_t *child;
+    rb_node_t *parent;
+    bool removed_red;
+    
+    if (!node->left || !node->right) {
+        // At most one child: splice the node out directly
+        child = node->left ? node->left : node->right;
+        parent = node->parent;
+        removed_red = node->red;
+        
+        if (child) {
+            child->parent = parent;
+        }
+        rb_replace_child(root, parent, node, child);
+    } else {
+        // Two children: the in-order successor takes the node's place
+        rb_node_t *successor = node->right;
+        while (successor->left) {
+            successor = successor->left;
+        }
+        
+        child = successor->right;
+        removed_red = successor->red;
+        
+        if (successor->parent == node) {
+            parent = successor;
+        } else {
+            parent = successor->parent;
+            parent->left = child;
+            if (child) {
+                child->parent = parent;
+            }
+            successor->right = node->right;
+            node->right->parent = successor;
+        }
+        
+        successor->left = node->left;
+        node->left->parent = successor;
+        successor->parent = node->parent;
+        successor->red = node->red;
+        rb_replace_child(root, node->parent, node, successor);
+    }
+    
+    if (!removed_red) {
+        rb_erase_fixup(root, child, parent);
+    }
+    
+    node->parent = node->left = node->right = NULL;
+}
+
+rb_node_t *rb_first(const rb_root_t *root) {
+    rb_node_t *node = root->root;
+    if (!node) {
+        return NULL;
+    }
+    while (node->left) {
+        node = node->left;
+    }
+    return node;
+}
+
+rb_node_t *rb_last(const rb_root_t *root) {
+    rb_node_t *node = root->root;
+    if (!node) {
+        return NULL;
+    }
+    while (node->right) {
+        node = node->right;
+    }
+    return node;
+}
+
+rb_node_t *rb_next(const rb_node_t *node) {
+    if (node->right) {
+        node = node->right;
+        while (node->left) {
+            node = node->left;
+        }
+        return (rb_node_t *)node;
+    }
+    
+    while (node->parent && node == node->parent->right) {
+        node = node->parent;
+    }
+    return node->parent;
+}
+
+rb_node_t *rb_prev(const rb_node_t *node) {
+    if (node->left) {
+        node = node->left;
+        while (node->right) {
+            node = node->right;
+        }
+        return (rb_node_t *)node;
+    }
+    
+    while (node->parent && node == node->parent->left) {
+        node = node->parent;
+    }
+    return node->parent;
+}
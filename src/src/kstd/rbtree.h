@@ -0,0 +1,56 @@
+#ifndef SYNCOS_KSTD_RBTREE_H
+#define SYNCOS_KSTD_RBTREE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Intrusive red-black tree
+//
+// Nodes are embedded in the caller's structures. Callers walk down the tree
+// themselves to find the insertion point, link the node with rb_link_node()
+// and then rebalance with rb_insert_color(), so any key and comparison can
+// be used without callbacks.
+
+typedef struct rb_node {
+    struct rb_node *parent;
+    struct rb_node *left;
+    struct rb_node *right;
+    bool red;
+} rb_node_t;
+
+typedef struct {
+    rb_node_t *root;
+} rb_root_t;
+
+#define RB_ROOT_INIT { NULL }
+
+// Get the structure containing a node
+#define rb_entry(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
+// Link a new node below parent at *link (found by the caller's descent)
+static inline void rb_link_node(rb_node_t *node, rb_node_t *parent, rb_node_t **link) {
+    node->parent = parent;
+    node->left = NULL;
+    node->right = NULL;
+    node->red = true;
+    *link = node;
+}
+
+// Rebalance after rb_link_node
+void rb_insert_color(rb_root_t *root, rb_node_t *node);
+
+// Remove a node from the tree
+void rb_erase(rb_root_t *root, rb_node_t *node);
+
+// In-order traversal
+rb_node_t *rb_first(const rb_root_t *root);
+rb_node_t *rb_last(const rb_root_t *root);
+rb_node_t *rb_next(const rb_node_t *node);
+rb_node_t *rb_prev(const rb_node_t *node);
+
+static inline bool rb_empty(const rb_root_t *root) {
+    return root->root == NULL;
+}
+
+#endif // SYNCOS_KSTD_RBTREE_H
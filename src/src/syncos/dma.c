@@ -0,0 +1,269 @@
+#include <syncos/dma.h>
+#include <syncos/pmm.h>
+#include <syncos/vmm.h>
+#include <syncos/spinlock.h>
+#include <kstd/stdio.h>
+#include <kstd/string.h>
+
+#define DMA_PAGE_SIZE      4096UL
+#define DMA_MAX_PAGES      (PMM_CMA_SIZE / DMA_PAGE_SIZE)
+#define DMA_MAP_WORDS      ((DMA_MAX_PAGES + 63) / 64)
+
+// Area state; a set bit in used_map means the page is taken, either by a
+// coherent buffer or by a movable allocation (then also set in lent_map)
+static uintptr_t cma_base = 0;
+static size_t cma_pages = 0;
+static uint64_t used_map[DMA_MAP_WORDS];
+static uint64_t lent_map[DMA_MAP_WORDS];
+static uint64_t hhdm_offset = 0;
+static spinlock_t dma_lock;
+
+// Statistics
+static size_t dma_pages = 0;
+static size_t lent_pages = 0;
+static size_t fallback_allocations = 0;
+static size_t failed_allocations = 0;
+
+// Save RFLAGS and disable interrupts; the area is touched from free paths
+// that may run in interrupt context
+static inline uint64_t dma_irq_save(void) {
+    uint64_t rflags;
+    __asm__ volatile("pushfq; popq %0; cli" : "=r"(rflags) :: "memory");
+    return rflags;
+}
+
+static inline void dma_irq_restore(uint64_t rflags) {
+    if (rflags & (1UL << 9)) {
+        __asm__ volatile("sti" ::: "memory");
+    }
+}
+
+static inline bool map_test(const uint64_t* map, size_t index) {
+    return (map[index / 64] >> (index % 64)) & 1;
+}
+
+static void map_set_range(uint64_t* map, size_t index, size_t count) {
+    for (size_t i = index; i < index + count; i++) {
+        map[i / 64] |= 1UL << (i % 64);
+    }
+}
+
+static void map_clear_range(uint64_t* map, size_t index, size_t count) {
+    for (size_t i = index; i < index + count; i++) {
+        map[i / 64] &= ~(1UL << (i % 64));
+    }
+}
+
+// First-fit search for count free pages, skipping fully used words
+static size_t find_free_run(size_t count) {
+    size_t run = 0;
+    
+    for (size_t i = 0; i < cma_pages; i++) {
+        if (run == 0 && (i % 64) == 0 && used_map[i / 64] == ~0UL) {
+            i += 63;
+            continue;
+        }
+        
+        if (map_test(used_map, i)) {
+            run = 0;
+        } else if (++run == count) {
+            return i + 1 - count;
+        }
+    }
+    
+    return SIZE_MAX;
+}
+
+// Take over the DMA area reserved by the PMM
+bool dma_init(void) {
+    uintptr_t base;
+    size_t size;
+    
+    spinlock_init(&dma_lock);
+    spinlock_set_name(&dma_lock, "dma_lock");
+    
+    // Buffers from the PMM fallback are reached through the HHDM as well
+    hhdm_offset = vmm_get_hhdm_offset();
+    
+    if (!pmm_get_cma_region(&base, &size)) {
+        printf("DMA: No contiguous area reserved, falling back to the PMM\n");
+        return false;
+    }
+    
+    memset(used_map, 0, sizeof(used_map));
+    memset(lent_map, 0, sizeof(lent_map));
+    
+    size_t pages = size / DMA_PAGE_SIZE;
+    if (pages > DMA_MAX_PAGES) {
+        pages = DMA_MAX_PAGES;
+    }
+    
+    // Pages past the end of the area in the last word are never free
+    if (pages % 64) {
+        used_map[pages / 64] = ~0UL << (pages % 64);
+    }
+    
+    cma_base = base;
+    cma_pages = pages;
+    
+    printf("DMA: %zu KB contiguous area at 0x%lx\n",
+           (cma_pages * DMA_PAGE_SIZE) / 1024, cma_base);
+    return true;
+}
+
+// Allocate a zeroed, physically contiguous buffer for device DMA
+void* dma_alloc_coherent(size_t size, uintptr_t* phys_addr) {
+    if (size == 0) {
+        return NULL;
+    }
+    
+    size_t count = (size + DMA_PAGE_SIZE - 1) / DMA_PAGE_SIZE;
+    uintptr_t phys = 0;
+    
+    uint64_t rflags = dma_irq_save();
+    spinlock_acquire(&dma_lock);
+    
+    size_t index = cma_pages ? find_free_run(count) : SIZE_MAX;
+    if (index != SIZE_MAX) {
+        map_set_range(used_map, index, count);
+        dma_pages += count;
+        phys = cma_base + index * DMA_PAGE_SIZE;
+    }
+    
+    spinlock_release(&dma_lock);
+    dma_irq_restore(rflags);
+    
+    // The area is full or fragmented by lent pages; try the buddy allocator
+    if (phys == 0) {
+        phys = pmm_alloc_pages(count);
+        if (phys == 0) {
+            __atomic_fetch_add(&failed_allocations, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+        __atomic_fetch_add(&fallback_allocations, 1, __ATOMIC_RELAXED);
+    }
+    
+    // Area pages are not handed out by the PMM, so take their reference here
+    if (dma_cma_contains(phys)) {
+        pmm_cma_claim(phys, count, PMM_OWNER_DMA);
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            pmm_page_set_owner(phys + i * DMA_PAGE_SIZE, PMM_OWNER_DMA);
+        }
+    }
+    
+    // Physical memory is reachable through the direct map, which x86 keeps
+    // cache coherent with device DMA
+    void* virt = (void*)(phys + hhdm_offset);
+    memset(virt, 0, count * DMA_PAGE_SIZE);
+    
+    if (phys_addr) {
+        *phys_addr = phys;
+    }
+    
+    return virt;
+}
+
+// Free a buffer returned by dma_alloc_coherent
+void dma_free_coherent(void* virt_addr, size_t size) {
+    if (!virt_addr || size == 0) {
+        return;
+    }
+    
+    size_t count = (size + DMA_PAGE_SIZE - 1) / DMA_PAGE_SIZE;
+    uintptr_t phys = (uintptr_t)virt_addr - hhdm_offset;
+    
+    if (!dma_cma_contains(phys)) {
+        pmm_free_pages(phys, count);
+        return;
+    }
+    
+    size_t index = (phys - cma_base) / DMA_PAGE_SIZE;
+    
+    uint64_t rflags = dma_irq_save();
+    spinlock_acquire(&dma_lock);
+    
+    map_clear_range(used_map, index, count);
+    dma_pages -= count;
+    
+    pmm_cma_release(phys, count);
+    
+    spinlock_release(&dma_lock);
+    dma_irq_restore(rflags);
+}
+
+// Lend one idle page to a movable allocation
+uintptr_t dma_cma_lend_page(void) {
+    if (cma_pages == 0) {
+        return 0;
+    }
+    
+    uintptr_t phys = 0;
+    
+    uint64_t rflags = dma_irq_save();
+    spinlock_acquire(&dma_lock);
+    
+    // Keep at least half of the area available for drivers, and lend from
+    // the top so that coherent buffers stay packed at the bottom
+    if (dma_pages + lent_pages < cma_pages / 2) {
+        for (size_t i = cma_pages; i-- > 0;) {
+            if (!map_test(used_map, i)) {
+                map_set_range(used_map, i, 1);
+                map_set_range(lent_map, i, 1);
+                lent_pages++;
+                phys = cma_base + i * DMA_PAGE_SIZE;
+                break;
+            }
+        }
+    }
+    
+    spinlock_release(&dma_lock);
+    dma_irq_restore(rflags);
+    
+    return phys;
+}
+
+// Check whether a physical address falls inside the DMA area
+bool dma_cma_contains(uintptr_t phys) {
+    return cma_pages != 0 && phys >= cma_base &&
+           phys < cma_base + cma_pages * DMA_PAGE_SIZE;
+}
+
+// Take back pages that were lent to movable allocations
+void dma_cma_return_pages(uintptr_t phys, size_t count) {
+    if (!dma_cma_contains(phys)) {
+        return;
+    }
+    
+    size_t index = (phys - cma_base) / DMA_PAGE_SIZE;
+    
+    uint64_t rflags = dma_irq_save();
+    spinlock_acquire(&dma_lock);
+    
+    for (size_t i = index; i < index + count && i < cma_pages; i++) {
+        // Coherent buffers are released through dma_free_coherent only
+        if (map_test(lent_map, i)) {
+            map_clear_range(lent_map, i, 1);
+            map_clear_range(used_map, i, 1);
+            lent_pages--;
+        }
+    }
+    
+    spinlock_release(&dma_lock);
+    dma_irq_restore(rflags);
+}
+
+// Get DMA area statistics
+bool dma_get_stats(dma_stats_t* stats) {
+    if (!stats) {
+        return false;
+    }
+    
+    stats->base = cma_base;
+    stats->total_pages = cma_pages;
+    stats->dma_pages = dma_pages;
+    stats->lent_pages = lent_pages;
+    stats->fallback_allocations = fallback_allocations;
+    stats->failed_allocations = failed_allocations;
+    return true;
+}
@@ -0,0 +1,44 @@
+#ifndef _SYNCOS_DMA_H
+#define _SYNCOS_DMA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Contiguous DMA area
+//
+// The PMM reserves PMM_CMA_SIZE bytes of physically contiguous memory below
+// 4GB at boot. Coherent driver buffers are carved out of it by a first-fit
+// page bitmap, so large rings and bounce buffers do not depend on the buddy
+// allocator staying unfragmented. Pages DMA is not using are lent to
+// PMM_ALLOC_MOVABLE allocations, keeping half of the area back for drivers.
+
+// DMA area statistics
+typedef struct {
+    uintptr_t base;              // Physical base of the area (0 if none)
+    size_t total_pages;          // Pages in the area
+    size_t dma_pages;            // Pages held by coherent buffers
+    size_t lent_pages;           // Pages lent to movable allocations
+    size_t fallback_allocations; // Buffers served by the PMM instead
+    size_t failed_allocations;   // Buffers that could not be served at all
+} dma_stats_t;
+
+// Take over the DMA area reserved by the PMM
+bool dma_init(void);
+
+// Allocate a zeroed, physically contiguous buffer for device DMA
+// Returns the kernel virtual address and stores the bus address in phys_addr
+void* dma_alloc_coherent(size_t size, uintptr_t* phys_addr);
+
+// Free a buffer returned by dma_alloc_coherent
+void dma_free_coherent(void* virt_addr, size_t size);
+
+// Get DMA area statistics
+bool dma_get_stats(dma_stats_t* stats);
+
+// PMM hooks for lending idle DMA pages to movable allocations
+uintptr_t dma_cma_lend_page(void);
+bool dma_cma_contains(uintptr_t phys);
+void dma_cma_return_pages(uintptr_t phys, size_t count);
+
+#endif // _SYNCOS_DMA_H
@@ -260,44 +260,57 @@ bool elf_load(elf_context_t* ctx, uint64_t base_addr) {
         ELF_LOG("Loading segment %d: vaddr=0x%lx, size=0x%lx, flags=0x%x", 
                i, vaddr, mem_size, ph->p_flags);
         
-        // Allocate memory for the segment
+        // Only pages backed by file data are copied; the rest of the
+        // segment (BSS) is zero-filled on first access
         size_t page_count = mem_size / PAGE_SIZE_4K;
-        void* segment_addr = ctx->alloc_pages(page_count);
-        if (!segment_addr) {
-            ELF_LOG("Failed to allocate memory for segment");
-            return false;
+        size_t file_pages = (ph->p_filesz + PAGE_SIZE_4K - 1) / PAGE_SIZE_4K;
+        if (file_pages > page_count) {
+            file_pages = page_count;
         }
         
-        // Clear the memory
-        memset(segment_addr, 0, mem_size);
+        // Map the memory to the virtual address
+        uint64_t vm_flags = VMM_FLAG_PRESENT;
+        if (ph->p_flags & PF_W) vm_flags |= VMM_FLAG_WRITABLE;
+        if (!(ph->p_flags & PF_X)) vm_flags |= VMM_FLAG_NO_EXECUTE;
+        if (ph->p_flags & PF_R) vm_flags |= VMM_FLAG_USER; // User-accessible
         
-        // Copy segment data
-        if (ph->p_filesz > 0) {
-            size_t copy_size = ph->p_filesz;
-            if (copy_size > mem_size) {
-                copy_size = mem_size;
+        if (file_pages > 0) {
+            // Allocate memory for the file-backed part of the segment
+            size_t file_size = file_pages * PAGE_SIZE_4K;
+            void* segment_addr = ctx->alloc_pages(file_pages);
+            if (!segment_addr) {
+                ELF_LOG("Failed to allocate memory for segment");
+                return false;
             }
             
+            // Clear the tail of the last page and copy segment data
+            size_t copy_size = ph->p_filesz;
+            if (copy_size > file_size) {
+                copy_size = file_size;
+            }
+            memset(segment_addr, 0, file_size);
             memcpy(segment_addr, (const uint8_t*)ctx->data + ph->p_offset, copy_size);
+            
+            // Map pages into virtual memory
+            if (!vmm_map_pages(vaddr, (uintptr_t)segment_addr, file_pages, vm_flags)) {
+                ELF_LOG("Failed to map segment to virtual memory");
+                ctx->free_pages(segment_addr, file_pages);
+                return false;
+            }
+            
+            // Store loaded segment info
+            if (ctx->loaded_segment_count < 16) {
+                ctx->loaded_segments[ctx->loaded_segment_count].vaddr = segment_addr;
+                ctx->loaded_segments[ctx->loaded_segment_count].size = file_size;
+                ctx->loaded_segment_count++;
+            }
         }
         
-        // Store loaded segment info
-        if (ctx->loaded_segment_count < 16) {
-            ctx->loaded_segments[ctx->loaded_segment_count].vaddr = segment_addr;
-            ctx->loaded_segments[ctx->loaded_segment_count].size = mem_size;
-            ctx->loaded_segment_count++;
-        }
-        
-        // Map the memory to the virtual address
-        uint32_t vm_flags = VMM_FLAG_PRESENT;
-        if (ph->p_flags & PF_W) vm_flags |= VMM_FLAG_WRITABLE;
-        if (!(ph->p_flags & PF_X)) vm_flags |= VMM_FLAG_NO_EXECUTE;
-        if (ph->p_flags & PF_R) vm_flags |= VMM_FLAG_USER; // User-accessible
-        
-        // Map pages into virtual memory
-        if (!vmm_map_pages(vaddr, (uintptr_t)segment_addr, page_count, vm_flags)) {
-            ELF_LOG("Failed to map segment to virtual memory");
-            ctx->free_pages(segment_addr, page_count);
+        // Reserve the zero-filled remainder
+        if (file_pages < page_count &&
+            !vmm_map_lazy((vaddr & ~(PAGE_SIZE_4K - 1)) + file_pages * PAGE_SIZE_4K,
+                          page_count - file_pages, vm_flags)) {
+            ELF_LOG("Failed to reserve BSS for segment");
             return false;
         }
     }
@@ -6,6 +6,7 @@
 #include <kstd/string.h>
 #include <syncos/vmm.h>
 #include <syncos/pmm.h>
+#include <syncos/slab.h>
 
 static bool nvme_storage_read(storage_device_t* dev, uint64_t lba, void* buffer, uint32_t sector_count);
 static bool nvme_storage_write(storage_device_t* dev, uint64_t lba, const void* buffer, uint32_t sector_count);
@@ -26,6 +27,9 @@ static bool sata_storage_flush(storage_device_t* dev);
 static uint32_t storage_device_count = 0;
 static storage_device_t detected_devices[16]; // Max 16 storage devices
 
+// Slab cache for open file handles
+static kmem_cache_t* ext4_file_cache = NULL;
+
 // Helper functions
 
 // Convert sectors to blocks
@@ -205,7 +209,7 @@ bool ext4_detect(storage_device_t* device) {
     }
     
     // Allocate buffer for superblock
-    ext4_superblock_t* superblock = (ext4_superblock_t*)vmm_allocate(4096, VMM_FLAG_WRITABLE);
+    ext4_superblock_t* superblock = (ext4_superblock_t*)kmalloc(4096);
     if (!superblock) {
         EXT4_TRACE("Failed to allocate memory for superblock");
         return false;
@@ -217,7 +221,7 @@ bool ext4_detect(storage_device_t* device) {
     
     if (!device->read(device, sb_sector, superblock, sector_count)) {
         EXT4_TRACE("Failed to read superblock");
-        vmm_free(superblock, 4096);
+        kfree(superblock);
         return false;
     }
     
@@ -238,7 +242,7 @@ bool ext4_detect(storage_device_t* device) {
                  superblock->s_magic, EXT4_SUPER_MAGIC);
     }
     
-    vmm_free(superblock, 4096);
+    kfree(superblock);
     return is_ext4;
 }
 
@@ -249,7 +253,7 @@ bool ext4_mount(storage_device_t* device, ext4_fs_t** fs_out) {
     }
     
     // Allocate memory for filesystem structure
-    ext4_fs_t* fs = (ext4_fs_t*)vmm_allocate(sizeof(ext4_fs_t), VMM_FLAG_WRITABLE);
+    ext4_fs_t* fs = (ext4_fs_t*)kmalloc(sizeof(ext4_fs_t));
     if (!fs) {
         EXT4_TRACE("Failed to allocate memory for filesystem structure");
         return false;
@@ -266,14 +270,14 @@ bool ext4_mount(storage_device_t* device, ext4_fs_t** fs_out) {
     
     if (!device->read(device, sb_sector, &fs->superblock, sector_count)) {
         EXT4_TRACE("Failed to read superblock");
-        vmm_free(fs, sizeof(ext4_fs_t));
+        kfree(fs);
         return false;
     }
     
     // Verify magic number
     if (fs->superblock.s_magic != EXT4_SUPER_MAGIC) {
         EXT4_TRACE("Invalid Ext4 magic number: 0x%04x", fs->superblock.s_magic);
-        vmm_free(fs, sizeof(ext4_fs_t));
+        kfree(fs);
         return false;
     }
     
@@ -290,10 +294,13 @@ bool ext4_mount(storage_device_t* device, ext4_fs_t** fs_out) {
     
     // Allocate memory for group descriptors
     uint32_t group_desc_size = fs->groups_count * sizeof(ext4_group_desc_t);
-    fs->group_desc = (ext4_group_desc_t*)vmm_allocate(group_desc_size, VMM_FLAG_WRITABLE);
+    uint32_t group_desc_blocks = (group_desc_size + fs->block_size - 1) / fs->block_size;
+    
+    // read_blocks fills whole blocks, so size the table in blocks
+    fs->group_desc = (ext4_group_desc_t*)kmalloc(group_desc_blocks * fs->block_size);
     if (!fs->group_desc) {
         EXT4_TRACE("Failed to allocate memory for group descriptors");
-        vmm_free(fs, sizeof(ext4_fs_t));
+        kfree(fs);
         return false;
     }
     
@@ -306,21 +313,19 @@ bool ext4_mount(storage_device_t* device, ext4_fs_t** fs_out) {
     }
     
     // Read group descriptor table
-    if (!read_blocks(fs, gdt_block, 
-                    (group_desc_size + fs->block_size - 1) / fs->block_size, 
-                    fs->group_desc)) {
+    if (!read_blocks(fs, gdt_block, group_desc_blocks, fs->group_desc)) {
         EXT4_TRACE("Failed to read group descriptor table");
-        vmm_free(fs->group_desc, group_desc_size);
-        vmm_free(fs, sizeof(ext4_fs_t));
+        kfree(fs->group_desc);
+        kfree(fs);
         return false;
     }
     
     // Allocate block buffer
-    fs->block_buffer = vmm_allocate(fs->block_size, VMM_FLAG_WRITABLE);
+    fs->block_buffer = kmalloc(fs->block_size);
     if (!fs->block_buffer) {
         EXT4_TRACE("Failed to allocate block buffer");
-        vmm_free(fs->group_desc, group_desc_size);
-        vmm_free(fs, sizeof(ext4_fs_t));
+        kfree(fs->group_desc);
+        kfree(fs);
         return false;
     }
     
@@ -356,14 +361,14 @@ void ext4_unmount(ext4_fs_t* fs) {
     
     // Free allocated memory
     if (fs->block_buffer) {
-        vmm_free(fs->block_buffer, fs->block_size);
+        kfree(fs->block_buffer);
     }
     
     if (fs->group_desc) {
-        vmm_free(fs->group_desc, fs->groups_count * sizeof(ext4_group_desc_t));
+        kfree(fs->group_desc);
     }
     
-    vmm_free(fs, sizeof(ext4_fs_t));
+    kfree(fs);
 }
 
 // Read a block from the filesystem
@@ -465,7 +470,7 @@ static bool read_inode(ext4_fs_t* fs, uint32_t inode_num, ext4_inode_t* inode) {
     uint32_t offset = (index * fs->inode_size) % fs->block_size;
     
     // Allocate buffer for the block
-    void* block_data = vmm_allocate(fs->block_size, VMM_FLAG_WRITABLE);
+    void* block_data = kmalloc(fs->block_size);
     if (!block_data) {
         EXT4_TRACE("Failed to allocate memory for inode block");
         return false;
@@ -474,14 +479,14 @@ static bool read_inode(ext4_fs_t* fs, uint32_t inode_num, ext4_inode_t* inode) {
     // Read the block containing the inode
     if (!ext4_read_block(fs, inode_block, block_data)) {
         EXT4_TRACE("Failed to read inode block %lu", inode_block);
-        vmm_free(block_data, fs->block_size);
+        kfree(block_data);
         return false;
     }
     
     // Copy the inode data
     memcpy(inode, (uint8_t*)block_data + offset, sizeof(ext4_inode_t));
     
-    vmm_free(block_data, fs->block_size);
+    kfree(block_data);
     return true;
 }
 
@@ -515,7 +520,7 @@ static bool write_inode(ext4_fs_t* fs, uint32_t inode_num, const ext4_inode_t* i
     uint32_t offset = (index * fs->inode_size) % fs->block_size;
     
     // Allocate buffer for the block
-    void* block_data = vmm_allocate(fs->block_size, VMM_FLAG_WRITABLE);
+    void* block_data = kmalloc(fs->block_size);
     if (!block_data) {
         EXT4_TRACE("Failed to allocate memory for inode block");
         return false;
@@ -524,7 +529,7 @@ static bool write_inode(ext4_fs_t* fs, uint32_t inode_num, const ext4_inode_t* i
     // Read the block containing the inode
     if (!ext4_read_block(fs, inode_block, block_data)) {
         EXT4_TRACE("Failed to read inode block %lu", inode_block);
-        vmm_free(block_data, fs->block_size);
+        kfree(block_data);
         return false;
     }
     
@@ -534,11 +539,11 @@ static bool write_inode(ext4_fs_t* fs, uint32_t inode_num, const ext4_inode_t* i
     // Write the block back
     if (!ext4_write_block(fs, inode_block, block_data)) {
         EXT4_TRACE("Failed to write inode block %lu", inode_block);
-        vmm_free(block_data, fs->block_size);
+        kfree(block_data);
         return false;
     }
     
-    vmm_free(block_data, fs->block_size);
+    kfree(block_data);
     return true;
 }
 
@@ -598,7 +603,7 @@ static bool find_inode_by_path(ext4_fs_t* fs, const char* path, uint32_t* inode_
         bool has_extents = (inode.i_flags & EXT4_EXTENTS_FL) != 0;
         
         // Allocate buffer for directory data
-        void* dir_data = vmm_allocate(fs->block_size, VMM_FLAG_WRITABLE);
+        void* dir_data = kmalloc(fs->block_size);
         if (!dir_data) {
             return false;
         }
@@ -611,7 +616,7 @@ static bool find_inode_by_path(ext4_fs_t* fs, const char* path, uint32_t* inode_
             
             // Make sure it's a valid extent header
             if (header->eh_magic != 0xF30A) {
-                vmm_free(dir_data, fs->block_size);
+                kfree(dir_data);
                 return false;
             }
             
@@ -691,7 +696,7 @@ static bool find_inode_by_path(ext4_fs_t* fs, const char* path, uint32_t* inode_
             // TODO: Handle indirect blocks if needed
         }
         
-        vmm_free(dir_data, fs->block_size);
+        kfree(dir_data);
         
         if (!found) {
             return false;
@@ -719,7 +724,7 @@ bool ext4_open(ext4_fs_t* fs, const char* path, ext4_file_t** file_out) {
     }
     
     // Allocate file handle
-    ext4_file_t* file = (ext4_file_t*)vmm_allocate(sizeof(ext4_file_t), VMM_FLAG_WRITABLE);
+    ext4_file_t* file = (ext4_file_t*)kmem_cache_alloc(ext4_file_cache);
     if (!file) {
         EXT4_TRACE("Failed to allocate file handle");
         return false;
@@ -734,7 +739,7 @@ bool ext4_open(ext4_fs_t* fs, const char* path, ext4_file_t** file_out) {
     // Read the inode
     if (!read_inode(fs, inode_num, &file->inode)) {
         EXT4_TRACE("Failed to read inode %u", inode_num);
-        vmm_free(file, sizeof(ext4_file_t));
+        kmem_cache_free(ext4_file_cache, file);
         return false;
     }
     
@@ -748,7 +753,7 @@ void ext4_close(ext4_file_t* file) {
         return;
     }
     
-    vmm_free(file, sizeof(ext4_file_t));
+    kmem_cache_free(ext4_file_cache, file);
 }
 
 // Get file size
@@ -763,6 +768,9 @@ uint64_t ext4_size(ext4_file_t* file) {
 
 // Initialize the Ext4 system
 void ext4_init(void) {
+    // File handles come from their own slab cache
+    ext4_file_cache = kmem_cache_create("ext4_file", sizeof(ext4_file_t), 0);
+    
     // Detect storage devices
     storage_detect_all_devices();
 }
\ No newline at end of file
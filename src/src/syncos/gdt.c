@@ -1,15 +1,23 @@
 #include <syncos/gdt.h>
+#include <syncos/percpu.h>
 #include <kstd/string.h>
 #include <kstd/stdio.h>
 #include <stddef.h>
 #include <stdbool.h>
 
+// Every CPU loads the same GDT but its own TSS; the TSS descriptors take
+// two entries each, the first CPU's at GDT_TSS
+#define GDT_TABLE_ENTRIES (GDT_ENTRIES + 1 + 2 * (PERCPU_MAX_CPUS - 1))
+
+// MSR holding the GS base, which points at the per-CPU area
+#define MSR_GS_BASE 0xC0000101
+
 // GDT and TSS structures with cache-line alignment to prevent false sharing
 // Using 64-byte alignment which is common cache line size
-static gdt_entry_t gdt[GDT_ENTRIES + 1] __attribute__((aligned(64)));
-static gdt_entry_t gdt_backup_v[GDT_ENTRIES + 1] __attribute__((aligned(64)));
+static gdt_entry_t gdt[GDT_TABLE_ENTRIES] __attribute__((aligned(64)));
+static gdt_entry_t gdt_backup_v[GDT_TABLE_ENTRIES] __attribute__((aligned(64)));
 static gdtr_t gdtr __attribute__((aligned(64)));
-static tss_t tss __attribute__((aligned(64)));
+static tss_t tss[PERCPU_MAX_CPUS] __attribute__((aligned(64)));
 
 // Track initialization status with memory barrier semantics
 static volatile _Atomic bool initialized = false;
@@ -32,12 +40,22 @@ static bool validate_gdt(void);
 static uint32_t calculate_gdt_checksum(void);
 static void gdt_panic(const char *message);
 
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t low, high;
+    __asm__ volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+    return ((uint64_t)high << 32) | low;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    __asm__ volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
 // Calculate a simple checksum of GDT content
 static uint32_t calculate_gdt_checksum(void) {
     uint32_t checksum = 0;
     uint8_t *ptr = (uint8_t *)&gdt[0];
     
-    for (size_t i = 0; i < sizeof(gdt_entry_t) * (GDT_ENTRIES + 1); i++) {
+    for (size_t i = 0; i < sizeof(gdt_entry_t) * GDT_TABLE_ENTRIES; i++) {
         checksum = ((checksum << 5) | (checksum >> 27)) ^ ptr[i];
     }
     
@@ -46,7 +64,7 @@ static uint32_t calculate_gdt_checksum(void) {
 
 // Validate GDT entry number is in bounds
 static inline bool is_valid_gdt_entry(uint32_t num) {
-    return num < (GDT_ENTRIES + 1);
+    return num < GDT_TABLE_ENTRIES;
 }
 
 // Simple function to set a GDT entry with validation
@@ -102,6 +120,13 @@ static bool gdt_set_tss(uint32_t num, uint64_t base, uint32_t limit) {
     return true;
 }
 
+// Set up the TSS of a CPU and its descriptor
+static bool gdt_set_cpu_tss(uint32_t cpu) {
+    tss[cpu].iomap_base = sizeof(tss_t);  // Disable I/O permissions bitmap
+    
+    return gdt_set_tss(GDT_TSS_SELECTOR(cpu) >> 3, (uint64_t)&tss[cpu], sizeof(tss_t) - 1);
+}
+
 // This function actually loads the GDT
 void gdt_flush(void) {
     // Disable interrupts during critical GDT operation
@@ -147,6 +172,9 @@ void gdt_flush(void) {
         : "rax", "memory"
     );
     
+    // Loading GS clears the base pointing at the per-CPU area
+    uint64_t gs_base = rdmsr(MSR_GS_BASE);
+    
     // Reload data segment registers with proper constraint for register values
     __asm__ volatile (
         "movw %0, %%ds\n"
@@ -158,12 +186,13 @@ void gdt_flush(void) {
         : "rm" ((uint16_t)GDT_KERNEL_DATA)
         : "memory"
     );
+    wrmsr(MSR_GS_BASE, gs_base);
     
     // Re-enable interrupts
     __asm__ volatile ("sti");
 }
 
-// Load the TSS with proper error checking
+// Load the TSS of the calling CPU with proper error checking
 static bool tss_flush(void) {
     bool tss_load_failed = false;
     
@@ -173,7 +202,7 @@ static bool tss_flush(void) {
         "movb $1, %0\n"       // Set failure flag
         "1:\n"
         : "=m" (tss_load_failed)
-        : "rm" ((uint16_t)GDT_TSS)
+        : "rm" ((uint16_t)GDT_TSS_SELECTOR(percpu_current_id()))
         : "memory"
     );
     
@@ -196,6 +225,18 @@ void gdt_reload(void) {
     printf("GDT reloaded successfully\n");
 }
 
+// Load the shared GDT and the calling CPU's TSS on an application processor
+void gdt_load_cpu(void) {
+    if (!__atomic_load_n(&initialized, __ATOMIC_SEQ_CST)) {
+        gdt_panic("GDT loaded on a CPU before initialization");
+    }
+    
+    gdt_flush();
+    if (!tss_flush()) {
+        gdt_panic("TSS load failed on application processor");
+    }
+}
+
 // Validate the GDT structure for integrity
 static bool validate_gdt() {
     // Check for NULL descriptor
@@ -218,8 +259,8 @@ static bool validate_gdt() {
         return false;
     }
     
-    // Check TSS is properly set up
-    if (gdt[GDT_TSS >> 3].access != GDT_TSS_ACCESS) {
+    // Check TSS is properly set up; loading it marks the descriptor busy
+    if ((gdt[GDT_TSS >> 3].access & ~GDT_TSS_BUSY) != GDT_TSS_ACCESS) {
         printf("ERROR: Invalid TSS access rights\n");
         return false;
     }
@@ -334,13 +375,15 @@ bool gdt_recover(void) {
     // If backup restoration failed, reinitialize from scratch
     printf("Backup restoration failed, reinitializing GDT from scratch...\n");
     
-    // Zero out all structures for clean state
-    memset(&gdt, 0, sizeof(gdt));
+    // Zero out the segments and this CPU's TSS for clean state; the other
+    // CPUs keep running on their TSS and its descriptor
+    uint32_t cpu = percpu_current_id();
+    memset(&gdt, 0, GDT_TSS);
     memset(&gdtr, 0, sizeof(gdtr));
-    memset(&tss, 0, sizeof(tss));
+    memset(&tss[cpu], 0, sizeof(tss_t));
     
     // Set up the GDT pointer
-    gdtr.limit = (sizeof(gdt_entry_t) * (GDT_ENTRIES + 1)) - 1;
+    gdtr.limit = (sizeof(gdt_entry_t) * GDT_TABLE_ENTRIES) - 1;
     gdtr.base = (uint64_t)&gdt[0];
     
     // Create the actual GDT entries
@@ -375,11 +418,8 @@ bool gdt_recover(void) {
         return false;
     }
     
-    // Set up the TSS
-    tss.iomap_base = sizeof(tss_t);  // Disable I/O permissions bitmap
-    
-    // Configure TSS entry in GDT - takes 2 entries (5 and 6)
-    if (!gdt_set_tss(5, (uint64_t)&tss, sizeof(tss_t) - 1)) {
+    // Set up this CPU's TSS - the descriptor takes 2 entries
+    if (!gdt_set_cpu_tss(cpu)) {
         __atomic_store_n(&recovery_in_progress, false, __ATOMIC_SEQ_CST);
         gdt_panic("Failed to set TSS during recovery");
         return false;
@@ -437,7 +477,7 @@ void gdt_init(void) {
     memset(&tss, 0, sizeof(tss));
     
     // Set up the GDT pointer - account for the extra entry for TSS
-    gdtr.limit = (sizeof(gdt_entry_t) * (GDT_ENTRIES + 1)) - 1;
+    gdtr.limit = (sizeof(gdt_entry_t) * GDT_TABLE_ENTRIES) - 1;
     gdtr.base = (uint64_t)&gdt[0];
     
     printf("GDTR: Base=0x%lx, Limit=0x%x\n", gdtr.base, gdtr.limit);
@@ -472,14 +512,13 @@ void gdt_init(void) {
         return;
     }
     
-    // Set up the TSS
-    tss.iomap_base = sizeof(tss_t);  // Disable I/O permissions bitmap
-    
-    // Configure TSS entry in GDT - takes 2 entries (5 and 6)
-    if (!gdt_set_tss(5, (uint64_t)&tss, sizeof(tss_t) - 1)) {
-        __atomic_store_n(&initialized, false, __ATOMIC_SEQ_CST);
-        gdt_panic("Failed to set TSS");
-        return;
+    // Set up the TSS of every CPU - each descriptor takes 2 entries
+    for (uint32_t cpu = 0; cpu < PERCPU_MAX_CPUS; cpu++) {
+        if (!gdt_set_cpu_tss(cpu)) {
+            __atomic_store_n(&initialized, false, __ATOMIC_SEQ_CST);
+            gdt_panic("Failed to set TSS");
+            return;
+        }
     }
     
     // Validate GDT integrity before loading
@@ -536,8 +575,8 @@ void gdt_set_kernel_stack(uint64_t stack) {
     // Disable interrupts during stack update to prevent partial update
     __asm__ volatile ("cli");
     
-    // Set the stack pointer in the TSS
-    tss.rsp0 = stack;
+    // Set the stack pointer in this CPU's TSS
+    tss[percpu_current_id()].rsp0 = stack;
     
     // Re-enable interrupts
     __asm__ volatile ("sti");
@@ -558,7 +597,7 @@ uint64_t gdt_get_kernel_stack(void) {
     __asm__ volatile (
         "movq %1, %0"
         : "=r" (stack)
-        : "m" (tss.rsp0)
+        : "m" (tss[percpu_current_id()].rsp0)
         : "memory"
     );
     
@@ -597,6 +636,6 @@ void gdt_dump(void) {
     }
     
     printf("TSS Info:\n");
-    printf("  RSP0: 0x%lx\n", tss.rsp0);
-    printf("  IOMap Base: 0x%x\n", tss.iomap_base);
+    printf("  RSP0: 0x%lx\n", tss[percpu_current_id()].rsp0);
+    printf("  IOMap Base: 0x%x\n", tss[percpu_current_id()].iomap_base);
 }
\ No newline at end of file
@@ -15,12 +15,16 @@
 #define GDT_USER_DATA   0x20
 #define GDT_TSS         0x28
 
+// TSS selector of a CPU; every CPU has its own 16-byte TSS descriptor
+#define GDT_TSS_SELECTOR(cpu) (GDT_TSS + (cpu) * 16)
+
 // Access Byte Flags
 #define GDT_KERNEL_CODE_ACCESS 0x9A  // Present, Ring 0, Executable, Readable
 #define GDT_KERNEL_DATA_ACCESS 0x92  // Present, Ring 0, Writable
 #define GDT_USER_CODE_ACCESS   0xFA  // Present, Ring 3, Executable, Readable
 #define GDT_USER_DATA_ACCESS   0xF2  // Present, Ring 3, Writable
 #define GDT_TSS_ACCESS         0x89  // Present, TSS Descriptor
+#define GDT_TSS_BUSY           0x02  // Set in the access byte by ltr
 
 // Granularity Flags
 #define GDT_KERNEL_CODE_FLAGS  0xA0  // 4KB Gran, 64-bit
@@ -67,6 +71,7 @@ uint64_t gdt_get_kernel_stack(void);
 // Enhanced GDT functions for fault tolerance
 void gdt_flush(void);        // Load the GDT into the CPU
 void gdt_reload(void);       // Reload GDT and all segment registers
+void gdt_load_cpu(void);     // Load the GDT and this CPU's TSS on an AP
 bool gdt_recover(void);      // Attempt to recover corrupted GDT
 void gdt_verify(uint64_t tick_count, void *context); // Verify GDT integrity periodically
 void gdt_register_verification(void); // Register GDT verification with timer system
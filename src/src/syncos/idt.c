@@ -101,6 +101,16 @@ void idt_init(void) {
     printf("IDT initialization complete\n");
 }
 
+// Load the shared IDT on an application processor
+void idt_load(void) {
+    __asm__ volatile (
+        "lidt %0"
+        : 
+        : "m" (idtr)
+        : "memory"
+    );
+}
+
 // Internal register exception handler
 void idt_register_exception_handler(uint8_t vector, exception_handler_t handler) {
     if (vector < IDT_ENTRIES) {
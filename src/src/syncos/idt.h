@@ -34,6 +34,7 @@ typedef void (*interrupt_handler_t)(void);
 
 // Public function prototypes
 void idt_init(void);
+void idt_load(void);
 void idt_set_handler(uint8_t vector, interrupt_handler_t handler, uint8_t type);
 void idt_enable_interrupts(void);
 void idt_disable_interrupts(void);
@@ -0,0 +1,181 @@
+#include <syncos/lapic.h>
+#include <syncos/vmm.h>
+#include <syncos/timer.h>
+#include <syncos/idt.h>
+#include <kstd/stdio.h>
+#include <stddef.h>
+
+#define MSR_APIC_BASE           0x1B
+#define APIC_BASE_ENABLE        (1UL << 11)
+#define APIC_BASE_ADDR_MASK     0x000FFFFFFFFFF000UL
+
+// Register offsets
+#define LAPIC_REG_ID            0x020
+#define LAPIC_REG_TPR           0x080
+#define LAPIC_REG_EOI           0x0B0
+#define LAPIC_REG_SVR           0x0F0
+#define LAPIC_REG_ICR_LOW       0x300
+#define LAPIC_REG_ICR_HIGH      0x310
+#define LAPIC_REG_LVT_TIMER     0x320
+#define LAPIC_REG_TIMER_INIT    0x380
+#define LAPIC_REG_TIMER_CURRENT 0x390
+#define LAPIC_REG_TIMER_DIVIDE  0x3E0
+
+#define LAPIC_SVR_ENABLE        (1U << 8)
+#define LAPIC_LVT_MASKED        (1U << 16)
+#define LAPIC_TIMER_PERIODIC    (1U << 17)
+#define LAPIC_TIMER_DIVIDE_16   0x3
+#define LAPIC_ICR_PENDING       (1U << 12)
+#define LAPIC_ICR_ALL_BUT_SELF  (3U << 18)
+
+// PIT ticks the timer rate is measured over
+#define LAPIC_CALIBRATE_TICKS   10
+
+static volatile uint32_t* lapic_regs = NULL;
+static uint32_t timer_counts_per_ms = 0;
+static lapic_handler_t lapic_handlers[256 - LAPIC_VECTOR_BASE];
+
+// Assembly entry points
+extern void lapic_timer_stub(void);
+extern void lapic_tlb_stub(void);
+extern void lapic_spurious_stub(void);
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t low, high;
+    __asm__ volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+    return ((uint64_t)high << 32) | low;
+}
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic_regs[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+    lapic_regs[reg / 4] = value;
+}
+
+// Map the local APIC, install its vectors and calibrate its timer
+bool lapic_init(void) {
+    uint64_t base = rdmsr(MSR_APIC_BASE);
+    if (!(base & APIC_BASE_ENABLE)) {
+        printf("LAPIC: Disabled by firmware\n");
+        return false;
+    }
+    
+    lapic_regs = vmm_map_physical(base & APIC_BASE_ADDR_MASK, PAGE_SIZE_4K,
+                                  VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_NOCACHE);
+    if (!lapic_regs) {
+        printf("LAPIC: Failed to map registers at 0x%lx\n", base & APIC_BASE_ADDR_MASK);
+        return false;
+    }
+    
+    idt_set_handler(LAPIC_TIMER_VECTOR, lapic_timer_stub, IDT_GATE_INTERRUPT);
+    idt_set_handler(LAPIC_TLB_VECTOR, lapic_tlb_stub, IDT_GATE_INTERRUPT);
+    idt_set_handler(LAPIC_SPURIOUS_VECTOR, lapic_spurious_stub, IDT_GATE_INTERRUPT);
+    
+    lapic_init_cpu();
+    
+    // Count down from the maximum over a few PIT ticks
+    uint32_t pit_frequency = timer_get_frequency();
+    if (pit_frequency == 0) {
+        printf("LAPIC: PIT not running, cannot calibrate the timer\n");
+        return false;
+    }
+    
+    uint64_t start = timer_get_ticks();
+    while (timer_get_ticks() == start) {
+        __asm__ volatile("pause");
+    }
+    
+    lapic_write(LAPIC_REG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_REG_TIMER_INIT, 0xFFFFFFFF);
+    
+    start = timer_get_ticks();
+    while (timer_get_ticks() - start < LAPIC_CALIBRATE_TICKS) {
+        __asm__ volatile("pause");
+    }
+    
+    uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_REG_TIMER_CURRENT);
+    lapic_write(LAPIC_REG_TIMER_INIT, 0);
+    
+    uint64_t elapsed_us = (uint64_t)LAPIC_CALIBRATE_TICKS * 1000000 / pit_frequency;
+    timer_counts_per_ms = (uint32_t)((uint64_t)elapsed * 1000 / elapsed_us);
+    
+    printf("LAPIC: Registers at %p, ID %u, timer %u counts/ms\n",
+           lapic_regs, lapic_get_id(), timer_counts_per_ms);
+    return timer_counts_per_ms != 0;
+}
+
+// Enable the local APIC of the calling CPU
+void lapic_init_cpu(void) {
+    lapic_write(LAPIC_REG_TPR, 0);
+    lapic_write(LAPIC_REG_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+}
+
+// Start the periodic timer of the calling CPU
+void lapic_start_timer(uint32_t frequency_hz) {
+    if (frequency_hz == 0 || timer_counts_per_ms == 0) {
+        return;
+    }
+    
+    uint32_t count = (uint32_t)((uint64_t)timer_counts_per_ms * 1000 / frequency_hz);
+    lapic_write(LAPIC_REG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_TIMER_VECTOR | LAPIC_TIMER_PERIODIC);
+    lapic_write(LAPIC_REG_TIMER_INIT, count ? count : 1);
+}
+
+// Get the local APIC ID of the calling CPU
+uint32_t lapic_get_id(void) {
+    return lapic_read(LAPIC_REG_ID) >> 24;
+}
+
+// Acknowledge the interrupt being serviced
+void lapic_eoi(void) {
+    lapic_write(LAPIC_REG_EOI, 0);
+}
+
+// Wait until the previous interrupt has left the local APIC
+static void lapic_wait_icr(void) {
+    while (lapic_read(LAPIC_REG_ICR_LOW) & LAPIC_ICR_PENDING) {
+        __asm__ volatile("pause");
+    }
+}
+
+// Send an interrupt to one CPU
+void lapic_send_ipi(uint32_t lapic_id, uint8_t vector) {
+    lapic_wait_icr();
+    lapic_write(LAPIC_REG_ICR_HIGH, lapic_id << 24);
+    lapic_write(LAPIC_REG_ICR_LOW, vector);
+}
+
+// Send an interrupt to every CPU but the calling one
+void lapic_broadcast_ipi(uint8_t vector) {
+    lapic_wait_icr();
+    lapic_write(LAPIC_REG_ICR_HIGH, 0);
+    lapic_write(LAPIC_REG_ICR_LOW, vector | LAPIC_ICR_ALL_BUT_SELF);
+}
+
+// Set the handler of a vector in the local APIC range
+bool lapic_register_handler(uint8_t vector, lapic_handler_t handler) {
+    if (vector < LAPIC_VECTOR_BASE || vector == LAPIC_SPURIOUS_VECTOR) {
+        return false;
+    }
+    
+    lapic_handlers[vector - LAPIC_VECTOR_BASE] = handler;
+    return true;
+}
+
+// Common handler called by the assembly stubs
+void lapic_dispatch(uint64_t vector) {
+    if (vector == LAPIC_SPURIOUS_VECTOR) {
+        return;
+    }
+    
+    lapic_eoi();
+    
+    lapic_handler_t handler = lapic_handlers[vector - LAPIC_VECTOR_BASE];
+    if (handler) {
+        handler();
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef _SYNCOS_LAPIC_H
+#define _SYNCOS_LAPIC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Local APIC
+//
+// Every CPU has a local APIC at the same physical address. It delivers the
+// scheduler tick of the application processors and inter-processor
+// interrupts; the legacy PIC and the PIT keep serving device IRQs and the
+// tick of the bootstrap processor.
+
+// Interrupt vectors owned by the local APIC
+#define LAPIC_VECTOR_BASE       0xF0
+#define LAPIC_TIMER_VECTOR      0xF0    // Scheduler tick
+#define LAPIC_TLB_VECTOR        0xF1    // TLB shootdown request
+#define LAPIC_SPURIOUS_VECTOR   0xFF    // Spurious interrupts (never acknowledged)
+
+// Handler for a local APIC vector; the interrupt is acknowledged first, so
+// the handler may switch to another process
+typedef void (*lapic_handler_t)(void);
+
+// Map the local APIC, install its vectors and calibrate its timer against
+// the PIT; runs on the bootstrap processor with interrupts enabled
+bool lapic_init(void);
+
+// Enable the local APIC of the calling CPU
+void lapic_init_cpu(void);
+
+// Start the periodic timer of the calling CPU
+void lapic_start_timer(uint32_t frequency_hz);
+
+// Get the local APIC ID of the calling CPU
+uint32_t lapic_get_id(void);
+
+// Acknowledge the interrupt being serviced
+void lapic_eoi(void);
+
+// Send an interrupt to one CPU
+void lapic_send_ipi(uint32_t lapic_id, uint8_t vector);
+
+// Send an interrupt to every CPU but the calling one
+void lapic_broadcast_ipi(uint8_t vector);
+
+// Set the handler of a vector in the local APIC range
+bool lapic_register_handler(uint8_t vector, lapic_handler_t handler);
+
+#endif // _SYNCOS_LAPIC_H
@@ -0,0 +1,40 @@
+#ifndef _SYNCOS_PERCPU_H
+#define _SYNCOS_PERCPU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Maximum number of CPUs the kernel keeps per-CPU state for
+#define PERCPU_MAX_CPUS 16
+
+// Per-CPU data area
+//
+// Every CPU points its GS base at its own area, so the executing CPU finds
+// its state with one GS-relative load. Subsystems keep their per-CPU state
+// in arrays indexed by percpu_current_id().
+typedef struct percpu {
+    struct percpu* self;                // Address of this area (read through %gs)
+    uint32_t id;                        // Index into per-CPU arrays
+    uint32_t lapic_id;                  // Local APIC ID
+    uintptr_t stack_top;                // Top of the CPU's kernel stack
+    volatile bool online;               // The CPU is up and scheduling
+    volatile uint64_t tlb_flush_seq;    // TLB flushes other CPUs asked for
+    volatile uint64_t tlb_flush_done;   // Last of them this CPU carried out
+} percpu_t;
+
+// Get the index of the CPU executing this code
+static inline uint32_t percpu_current_id(void) {
+    uint32_t id;
+    __asm__ volatile("movl %%gs:%c1, %0" : "=r"(id) : "i"(offsetof(percpu_t, id)));
+    return id;
+}
+
+// Get the data area of the CPU executing this code
+static inline percpu_t* percpu_current(void) {
+    percpu_t* self;
+    __asm__ volatile("movq %%gs:%c1, %0" : "=r"(self) : "i"(offsetof(percpu_t, self)));
+    return self;
+}
+
+#endif // _SYNCOS_PERCPU_H
@@ -1,4 +1,8 @@
 #include <syncos/pmm.h>
+#include <syncos/vmm.h>
+#include <syncos/dma.h>
+#include <syncos/percpu.h>
+#include <syncos/spinlock.h>
 #include <limine.h>
 #include <kstd/stdio.h>
 #include <kstd/string.h>
@@ -6,35 +10,580 @@
 // Static PMM configuration
 static pmm_config_t pmm_config = {0};
 
-// Use a larger static bitmap for managing more memory
-#define STATIC_BITMAP_SIZE 8192 // 8KB = 64K pages = 256MB of memory
-static uint8_t static_bitmap[STATIC_BITMAP_SIZE] = {0};
+// Page metadata (bitmap and buddy order map) is sized from the memory map
+// and carved out of the first usable region large enough to hold it
 static uint8_t *page_bitmap = NULL;
 static size_t bitmap_size = 0;
+static size_t usable_pages = 0;
+
+// Memory below 1MB is left alone (real mode structures, SMP trampolines)
+#define PMM_LOW_MEMORY_LIMIT 0x100000UL
+
+// Buddy allocator state
+//
+// Free blocks of 2^order pages are kept on per-order doubly linked lists.
+// The list node lives in the first page of the free block itself (accessed
+// through the HHDM), so the only side metadata is one byte per page that
+// records the order of the free block starting there (0 = not a free head).
+// Block alignment is computed on the absolute page frame number, which keeps
+// every order-N block naturally aligned to 2^N pages in physical memory.
+typedef struct pmm_free_block {
+    struct pmm_free_block *next;
+    struct pmm_free_block *prev;
+} pmm_free_block_t;
+
+static pmm_free_block_t *free_lists[PMM_MAX_ORDER + 1] = {0};
+static size_t free_block_count[PMM_MAX_ORDER + 1] = {0};
+static uint8_t *block_order = NULL;
+static uint64_t pmm_hhdm_offset = 0;
+
+// Page frame number range covered by the bitmap
+static uintptr_t base_pfn = 0;
+
+// Page frame database, one descriptor per page in the bitmap range
+static page_t *page_db = NULL;
+
+// Shared zero page
+static uintptr_t zero_page_phys = 0;
 
 // Statistics tracking
 static size_t total_allocations = 0;
 static size_t failed_allocations = 0;
 
+// Referenced frames by owner, and frames with more than one user; kept up
+// to date as references and owners change so readers never scan page_db
+static size_t owner_frames[PMM_OWNER_PAGE_CACHE + 1];
+static size_t shared_frames = 0;
+
+// Lock protecting the buddy free lists, bitmap and order map
+static spinlock_t pmm_lock;
+
+// Per-CPU page frame caches
+//
+// Single-page allocations and frees go through a small per-CPU magazine of
+// frames, which is only touched by its owning CPU with interrupts disabled.
+// The global allocator is only locked to refill or drain a batch of frames.
+// Cached frames stay marked as used in the bitmap.
+#define PMM_PCP_CAPACITY 64
+#define PMM_PCP_BATCH    16
+
+typedef struct {
+    uintptr_t frames[PMM_PCP_CAPACITY];
+    uint32_t count;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t refills;
+    uint64_t drains;
+} __attribute__((aligned(64))) pmm_pcp_t;
+
+static pmm_pcp_t pcp_caches[PERCPU_MAX_CPUS];
+
+// Pre-zeroed page pool
+//
+// Frames are taken from the buddy allocator and cleared in idle time so
+// that PMM_ALLOC_ZERO allocations do not pay for the memset. Like the
+// per-CPU caches, pooled frames are marked used in the bitmap but counted
+// as free in the zone counters.
+static uintptr_t zero_pool[PMM_ZERO_POOL_SIZE];
+static uint32_t zero_pool_count = 0;
+static spinlock_t zero_pool_lock;
+static uint64_t zero_pool_hits = 0;
+static uint64_t zero_pool_misses = 0;
+
+// Zero every allocation (PMM_FLAG_ZERO_PAGES)
+static bool zero_all_allocations = false;
+
+// Contiguous DMA area, kept out of the buddy allocator and handed to dma.c
+static uintptr_t cma_phys = 0;
+
+// Zone accounting
+//
+// Counters track pages that are free from the caller's point of view
+// (buddy lists plus per-CPU caches) and are updated atomically at the API
+// boundary, so statistics never need to look at the bitmap. Buddy blocks
+// never straddle a zone boundary because both boundaries are aligned to
+// the largest block size.
+#define PMM_ZONE_DMA_END_PFN   (0x1000000UL / 4096)     // 16MB
+#define PMM_ZONE_DMA32_END_PFN (0x100000000UL / 4096)   // 4GB
+
+typedef struct {
+    const char *name;
+    size_t managed_pages;
+    volatile size_t free_pages;
+    size_t watermark_min;
+    size_t watermark_low;
+    size_t watermark_high;
+    volatile uint32_t level;
+    volatile uint32_t notified_level;
+} pmm_zone_t;
+
+static pmm_zone_t zones[PMM_ZONE_COUNT] = {
+    [PMM_ZONE_DMA]    = { .name = "DMA" },
+    [PMM_ZONE_DMA32]  = { .name = "DMA32" },
+    [PMM_ZONE_NORMAL] = { .name = "Normal" },
+};
+
+// Watermark notification callbacks
+#define PMM_MAX_WATERMARK_CALLBACKS 8
+
+static struct {
+    pmm_watermark_callback_t callback;
+    void *context;
+} watermark_callbacks[PMM_MAX_WATERMARK_CALLBACKS];
+static volatile bool watermark_pending = false;
+
+// Disable interrupts and return the previous RFLAGS
+static inline uint64_t pmm_irq_save(void) {
+    uint64_t rflags;
+    __asm__ volatile("pushfq; popq %0; cli" : "=r"(rflags) : : "memory");
+    return rflags;
+}
+
+// Restore the interrupt flag saved by pmm_irq_save
+static inline void pmm_irq_restore(uint64_t rflags) {
+    if (rflags & (1 << 9)) {
+        __asm__ volatile("sti" : : : "memory");
+    }
+}
+
+// Bitmap helpers (index is relative to base_pfn)
+static inline bool bitmap_test(size_t index) {
+    return (page_bitmap[index / 8] & (1 << (index % 8))) != 0;
+}
+
+static void bitmap_set_range(size_t index, size_t count) {
+    // Leading bits up to a byte boundary
+    while (count > 0 && (index % 8) != 0) {
+        page_bitmap[index / 8] |= (1 << (index % 8));
+        index++;
+        count--;
+    }
+    
+    // Whole bytes
+    if (count >= 8) {
+        memset(&page_bitmap[index / 8], 0xFF, count / 8);
+        index += count & ~7UL;
+        count &= 7;
+    }
+    
+    // Trailing bits
+    while (count > 0) {
+        page_bitmap[index / 8] |= (1 << (index % 8));
+        index++;
+        count--;
+    }
+}
+
+static void bitmap_clear_range(size_t index, size_t count) {
+    while (count > 0 && (index % 8) != 0) {
+        page_bitmap[index / 8] &= ~(1 << (index % 8));
+        index++;
+        count--;
+    }
+    
+    if (count >= 8) {
+        memset(&page_bitmap[index / 8], 0x00, count / 8);
+        index += count & ~7UL;
+        count &= 7;
+    }
+    
+    while (count > 0) {
+        page_bitmap[index / 8] &= ~(1 << (index % 8));
+        index++;
+        count--;
+    }
+}
+
+// Get the list node stored in a free block
+static inline pmm_free_block_t *block_node(uintptr_t pfn) {
+    return (pmm_free_block_t *)((pfn << 12) + pmm_hhdm_offset);
+}
+
+static inline uintptr_t node_pfn(pmm_free_block_t *node) {
+    return ((uintptr_t)node - pmm_hhdm_offset) >> 12;
+}
+
+// Check whether a pfn lies inside the managed range
+static inline bool pfn_in_range(uintptr_t pfn) {
+    return pfn >= base_pfn && pfn < base_pfn + pmm_config.max_pages;
+}
+
+// Count a referenced frame under its owner, or stop counting it
+static inline void owner_frames_add(uint8_t owner, size_t count) {
+    if (owner <= PMM_OWNER_PAGE_CACHE) {
+        __atomic_fetch_add(&owner_frames[owner], count, __ATOMIC_RELAXED);
+    }
+}
+
+static inline void owner_frames_sub(uint8_t owner, size_t count) {
+    if (owner <= PMM_OWNER_PAGE_CACHE) {
+        __atomic_fetch_sub(&owner_frames[owner], count, __ATOMIC_RELAXED);
+    }
+}
+
+// Reset the descriptors of freshly allocated pages to a single reference
+static void page_db_alloc_range(uintptr_t pfn, size_t count, uint16_t flags) {
+    for (size_t i = 0; i < count; i++) {
+        page_t *page = &page_db[pfn + i - base_pfn];
+        page->refcount = 1;
+        page->flags = flags;
+        page->owner = PMM_OWNER_NONE;
+        page->private = 0;
+    }
+    owner_frames_add(PMM_OWNER_NONE, count);
+}
+
+// Clear the descriptors of pages going back to the allocator
+static void page_db_free_range(uintptr_t pfn, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        page_t *page = &page_db[pfn + i - base_pfn];
+        
+        // Frames freed by their last pmm_page_put were uncounted already
+        if (page->refcount > 0) {
+            owner_frames_sub(page->owner, 1);
+        }
+        if (page->refcount > 1) {
+            __atomic_fetch_sub(&shared_frames, 1, __ATOMIC_RELAXED);
+        }
+        
+        page->refcount = 0;
+        page->flags = PMM_PAGE_FREE;
+        page->owner = PMM_OWNER_NONE;
+        page->private = 0;
+    }
+}
+
+static inline bool page_reserved(uintptr_t pfn) {
+    return (page_db[pfn - base_pfn].flags & PMM_PAGE_RESERVED) != 0;
+}
+
+// Frames sitting in a CPU cache or the zero pool are still set in the
+// bitmap, so only the descriptor tells whether a frame was already freed
+static inline bool page_free(uintptr_t pfn) {
+    return (page_db[pfn - base_pfn].flags & PMM_PAGE_FREE) != 0;
+}
+
+// Push a free block onto its order list
+static void free_list_push(uintptr_t pfn, unsigned int order) {
+    pmm_free_block_t *node = block_node(pfn);
+    
+    node->prev = NULL;
+    node->next = free_lists[order];
+    if (free_lists[order]) {
+        free_lists[order]->prev = node;
+    }
+    free_lists[order] = node;
+    free_block_count[order]++;
+    
+    block_order[pfn - base_pfn] = (uint8_t)(order + 1);
+}
+
+// Unlink a specific free block from its order list
+static void free_list_remove(uintptr_t pfn, unsigned int order) {
+    pmm_free_block_t *node = block_node(pfn);
+    
+    if (node->prev) {
+        node->prev->next = node->next;
+    } else {
+        free_lists[order] = node->next;
+    }
+    if (node->next) {
+        node->next->prev = node->prev;
+    }
+    free_block_count[order]--;
+    
+    block_order[pfn - base_pfn] = 0;
+}
+
+// Pop any free block of the given order
+static uintptr_t free_list_pop(unsigned int order) {
+    pmm_free_block_t *node = free_lists[order];
+    if (!node) {
+        return 0;
+    }
+    
+    uintptr_t pfn = node_pfn(node);
+    free_list_remove(pfn, order);
+    return pfn;
+}
+
+// Return a block to the buddy lists, merging with free buddies
+static void buddy_free_block(uintptr_t pfn, unsigned int order) {
+    bitmap_clear_range(pfn - base_pfn, 1UL << order);
+    
+    while (order < PMM_MAX_ORDER) {
+        uintptr_t buddy = pfn ^ (1UL << order);
+        
+        if (!pfn_in_range(buddy) || block_order[buddy - base_pfn] != order + 1) {
+            break;
+        }
+        
+        free_list_remove(buddy, order);
+        pfn &= ~(1UL << order);
+        order++;
+    }
+    
+    free_list_push(pfn, order);
+}
+
+// Take a block of the given order, splitting larger blocks as needed
+static uintptr_t buddy_alloc_block(unsigned int order) {
+    unsigned int current = order;
+    
+    while (current <= PMM_MAX_ORDER && !free_lists[current]) {
+        current++;
+    }
+    
+    if (current > PMM_MAX_ORDER) {
+        return 0;
+    }
+    
+    uintptr_t pfn = free_list_pop(current);
+    
+    // Split down, returning the upper halves to the lower order lists
+    while (current > order) {
+        current--;
+        free_list_push(pfn + (1UL << current), current);
+    }
+    
+    bitmap_set_range(pfn - base_pfn, 1UL << order);
+    return pfn;
+}
+
+// Release an arbitrary run of pages as maximal naturally aligned blocks
+static void buddy_free_range(uintptr_t pfn, size_t count) {
+    while (count > 0) {
+        unsigned int order = 0;
+        
+        while (order < PMM_MAX_ORDER &&
+               (pfn & ((1UL << (order + 1)) - 1)) == 0 &&
+               (1UL << (order + 1)) <= count) {
+            order++;
+        }
+        
+        buddy_free_block(pfn, order);
+        pfn += 1UL << order;
+        count -= 1UL << order;
+    }
+}
+
+// Smallest order whose block holds count pages
+static inline unsigned int order_for_count(size_t count) {
+    unsigned int order = 0;
+    while ((1UL << order) < count) {
+        order++;
+    }
+    return order;
+}
+
+// Allocate a run larger than the biggest buddy block by joining adjacent
+// max-order blocks. A fully free aligned max-order window is always a
+// single free block because frees coalesce eagerly. align_pages must be a
+// power of two no smaller than a max-order block.
+static uintptr_t buddy_alloc_large(size_t count, size_t align_pages) {
+    const size_t block_pages = 1UL << PMM_MAX_ORDER;
+    size_t blocks_needed = (count + block_pages - 1) / block_pages;
+    
+    if (free_block_count[PMM_MAX_ORDER] < blocks_needed) {
+        return 0;
+    }
+    
+    uintptr_t first = (base_pfn + block_pages - 1) & ~(block_pages - 1);
+    uintptr_t end = base_pfn + pmm_config.max_pages;
+    size_t run = 0;
+    uintptr_t run_start = 0;
+    
+    for (uintptr_t pfn = first; pfn + block_pages <= end; pfn += block_pages) {
+        if (block_order[pfn - base_pfn] != PMM_MAX_ORDER + 1) {
+            run = 0;
+            continue;
+        }
+        
+        if (run == 0) {
+            // Runs may only start on the requested alignment
+            if (pfn & (align_pages - 1)) {
+                continue;
+            }
+            run_start = pfn;
+        }
+        
+        if (++run == blocks_needed) {
+            for (size_t i = 0; i < blocks_needed; i++) {
+                free_list_remove(run_start + i * block_pages, PMM_MAX_ORDER);
+            }
+            bitmap_set_range(run_start - base_pfn, blocks_needed * block_pages);
+            
+            // Give back the unused tail
+            buddy_free_range(run_start + count, blocks_needed * block_pages - count);
+            return run_start;
+        }
+    }
+    
+    return 0;
+}
+
+// Get the zone a page frame belongs to
+static inline pmm_zone_id_t pfn_zone(uintptr_t pfn) {
+    if (pfn < PMM_ZONE_DMA_END_PFN) {
+        return PMM_ZONE_DMA;
+    }
+    if (pfn < PMM_ZONE_DMA32_END_PFN) {
+        return PMM_ZONE_DMA32;
+    }
+    return PMM_ZONE_NORMAL;
+}
+
+// End pfn (exclusive) of a zone
+static inline uintptr_t zone_end_pfn(pmm_zone_id_t zone) {
+    switch (zone) {
+        case PMM_ZONE_DMA:   return PMM_ZONE_DMA_END_PFN;
+        case PMM_ZONE_DMA32: return PMM_ZONE_DMA32_END_PFN;
+        default:             return UINTPTR_MAX;
+    }
+}
+
+// Recompute a zone's watermark level after its free count changed
+static void zone_update_level(pmm_zone_t *zone, size_t free_pages) {
+    uint32_t level = zone->level;
+    uint32_t new_level = level;
+    
+    if (free_pages < zone->watermark_min) {
+        new_level = PMM_WATERMARK_MIN;
+    } else if (free_pages < zone->watermark_low) {
+        new_level = PMM_WATERMARK_LOW;
+    } else if (free_pages >= zone->watermark_high) {
+        new_level = PMM_WATERMARK_OK;
+    } else if (level == PMM_WATERMARK_MIN) {
+        new_level = PMM_WATERMARK_LOW;
+    }
+    
+    if (new_level != level) {
+        __atomic_store_n(&zone->level, new_level, __ATOMIC_RELAXED);
+        __atomic_store_n(&watermark_pending, true, __ATOMIC_RELEASE);
+    }
+}
+
+// Adjust the free counters of the zones covering a pfn range
+static void zone_account_range(uintptr_t pfn, size_t count, bool freed) {
+    while (count > 0) {
+        pmm_zone_id_t id = pfn_zone(pfn);
+        pmm_zone_t *zone = &zones[id];
+        size_t span = count;
+        
+        if (zone_end_pfn(id) - pfn < span) {
+            span = zone_end_pfn(id) - pfn;
+        }
+        
+        size_t free_pages;
+        if (freed) {
+            free_pages = __atomic_add_fetch(&zone->free_pages, span, __ATOMIC_RELAXED);
+        } else {
+            free_pages = __atomic_sub_fetch(&zone->free_pages, span, __ATOMIC_RELAXED);
+        }
+        zone_update_level(zone, free_pages);
+        
+        pfn += span;
+        count -= span;
+    }
+}
+
+// Deliver watermark level changes to registered callbacks
+// Must be called without the PMM lock held and with interrupts restored
+static void pmm_notify_watermarks(void) {
+    if (!__atomic_exchange_n(&watermark_pending, false, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    
+    for (int id = 0; id < PMM_ZONE_COUNT; id++) {
+        pmm_zone_t *zone = &zones[id];
+        uint32_t level = __atomic_load_n(&zone->level, __ATOMIC_RELAXED);
+        
+        if (__atomic_exchange_n(&zone->notified_level, level, __ATOMIC_RELAXED) == level) {
+            continue;
+        }
+        
+        for (int i = 0; i < PMM_MAX_WATERMARK_CALLBACKS; i++) {
+            pmm_watermark_callback_t callback = watermark_callbacks[i].callback;
+            if (callback) {
+                callback((pmm_zone_id_t)id, (pmm_watermark_t)level,
+                         zone->free_pages, watermark_callbacks[i].context);
+            }
+        }
+    }
+}
+
+// Clip a memory map entry to whole pages above the low memory limit
+static bool usable_entry_range(const struct limine_memmap_entry *entry,
+                               uintptr_t *start, uintptr_t *end) {
+    if (entry->type != LIMINE_MEMMAP_USABLE) {
+        return false;
+    }
+    
+    uintptr_t region_start = (entry->base + pmm_config.page_size - 1) & ~(pmm_config.page_size - 1);
+    uintptr_t region_end = (entry->base + entry->length) & ~(pmm_config.page_size - 1);
+    
+    if (region_start < PMM_LOW_MEMORY_LIMIT) {
+        region_start = PMM_LOW_MEMORY_LIMIT;
+    }
+    
+    if (region_start >= region_end) {
+        return false;
+    }
+    
+    *start = region_start;
+    *end = region_end;
+    return true;
+}
+
 // Initialize the PMM with memory map data
+// Give a usable physical range to the buddy allocator at boot
+static void pmm_add_free_range(uintptr_t start, uintptr_t end) {
+    if (start >= end) {
+        return;
+    }
+    
+    size_t count = (end - start) / pmm_config.page_size;
+    uintptr_t pfn = start / pmm_config.page_size;
+    
+    for (size_t i = 0; i < count; i++) {
+        page_db[pfn + i - base_pfn].flags = PMM_PAGE_FREE;
+    }
+    buddy_free_range(pfn, count);
+    usable_pages += count;
+    
+    // Split the range across zones for accounting
+    while (count > 0) {
+        pmm_zone_id_t id = pfn_zone(pfn);
+        size_t span = count;
+        if (zone_end_pfn(id) - pfn < span) {
+            span = zone_end_pfn(id) - pfn;
+        }
+        zones[id].managed_pages += span;
+        pfn += span;
+        count -= span;
+    }
+}
+
 void pmm_init(const struct limine_memmap_response *memmap, unsigned int flags) {
     printf("Initializing physical memory manager\n");
     
     // Fixed page size
     pmm_config.page_size = 4096;
     
-    // Calculate how many pages we can track with our static bitmap
-    pmm_config.max_pages = STATIC_BITMAP_SIZE * 8;
+    // Free list nodes and metadata are accessed through the higher half direct map
+    pmm_hhdm_offset = vmm_get_hhdm_offset();
     
-    // Set up our bitmap to point to the static array
-    page_bitmap = static_bitmap;
-    bitmap_size = STATIC_BITMAP_SIZE;
+    spinlock_init(&pmm_lock);
+    spinlock_set_name(&pmm_lock, "pmm_lock");
+    memset(pcp_caches, 0, sizeof(pcp_caches));
     
-    // Use the memory map to find a good starting address
-    uintptr_t start_address = 0x100000; // Default to 1MB if no better option
-    size_t largest_usable_size = 0;
+    spinlock_init(&zero_pool_lock);
+    spinlock_set_name(&zero_pool_lock, "pmm_zero_pool");
+    zero_all_allocations = (flags & PMM_FLAG_ZERO_PAGES) != 0;
     
-    // Count total memory and identify the largest contiguous usable region
+    // Find the span of physical memory covered by usable regions
+    uintptr_t lowest = UINTPTR_MAX;
+    uintptr_t highest = 0;
     uintptr_t total_memory = 0;
     
     for (size_t i = 0; i < memmap->entry_count; i++) {
@@ -47,120 +596,331 @@ void pmm_init(const struct limine_memmap_response *memmap, unsigned int flags) {
                   entry->length / (1024*1024),
                   entry->type);
         }
-              
-        if (entry->type == LIMINE_MEMMAP_USABLE) {
-            total_memory += entry->length;
-            
-            // Find the largest usable region bigger than 1MB that starts above 1MB
-            if (entry->length > largest_usable_size && entry->base >= 0x100000) {
-                largest_usable_size = entry->length;
-                start_address = entry->base;
-            }
+        
+        uintptr_t region_start, region_end;
+        if (!usable_entry_range(entry, &region_start, &region_end)) {
+            continue;
         }
+        
+        total_memory += entry->length;
+        if (region_start < lowest) lowest = region_start;
+        if (region_end > highest) highest = region_end;
     }
     
-    printf("Total memory: %lu MB\n", total_memory / (1024 * 1024));
-    printf("Found usable region at 0x%lx (%lu MB)\n", 
-           start_address, largest_usable_size / (1024 * 1024));
+    if (highest == 0) {
+        printf("PMM: No usable memory found\n");
+        return;
+    }
+    
+    pmm_config.kernel_start = lowest;
+    pmm_config.kernel_end = highest;
+    pmm_config.max_pages = (highest - lowest) / pmm_config.page_size;
+    pmm_config.total_memory = total_memory;
+    base_pfn = lowest / pmm_config.page_size;
     
-    // Store the base address for our managed memory region
-    pmm_config.kernel_start = start_address;
+    // Size the metadata: one bit per page for the bitmap, one byte per page
+    // for the buddy order map and a page_t per page for the frame database
+    bitmap_size = (pmm_config.max_pages + 7) / 8;
+    size_t page_db_offset = (bitmap_size + pmm_config.max_pages + 15) & ~15UL;
+    size_t metadata_size = page_db_offset + pmm_config.max_pages * sizeof(page_t);
+    size_t metadata_pages = (metadata_size + pmm_config.page_size - 1) / pmm_config.page_size;
     
-    // Calculate how much memory we can actually manage
-    size_t manageable_size = pmm_config.max_pages * pmm_config.page_size;
-    if (manageable_size > largest_usable_size) {
-        // Adjust downward if we can't track that much memory
-        pmm_config.max_pages = largest_usable_size / pmm_config.page_size;
-        printf("Adjusted max pages to %u to fit in available memory\n", 
-               pmm_config.max_pages);
+    // Place the metadata at the start of the first usable region that fits it
+    uintptr_t metadata_phys = 0;
+    for (size_t i = 0; i < memmap->entry_count; i++) {
+        uintptr_t region_start, region_end;
+        if (usable_entry_range(memmap->entries[i], &region_start, &region_end) &&
+            region_end - region_start >= metadata_pages * pmm_config.page_size) {
+            metadata_phys = region_start;
+            break;
+        }
     }
     
-    // Calculate the end address of our managed memory region
-    pmm_config.kernel_end = start_address + (pmm_config.max_pages * pmm_config.page_size);
+    if (metadata_phys == 0) {
+        printf("PMM: No usable region can hold %zu KB of metadata\n", metadata_size / 1024);
+        return;
+    }
     
-    // Initialize all memory as free (already zeroed in our static array)
+    page_bitmap = (uint8_t *)(metadata_phys + pmm_hhdm_offset);
+    block_order = page_bitmap + bitmap_size;
+    page_db = (page_t *)(page_bitmap + page_db_offset);
     
-    // Now mark specific regions as used based on memory map
-    for (size_t i = 0; i < memmap->entry_count; i++) {
-        struct limine_memmap_entry *entry = memmap->entries[i];
+    // Everything starts out used (holes and reserved ranges stay that way),
+    // and no page is the head of a free block yet
+    memset(page_bitmap, 0xFF, bitmap_size);
+    memset(block_order, 0, pmm_config.max_pages);
+    memset(page_db, 0, pmm_config.max_pages * sizeof(page_t));
+    
+    for (size_t i = 0; i < pmm_config.max_pages; i++) {
+        page_db[i].zone = pfn_zone(base_pfn + i);
+    }
+    
+    uintptr_t metadata_end = metadata_phys + metadata_pages * pmm_config.page_size;
+    
+    // Reserve the contiguous DMA area: the first 2MB aligned window below
+    // 4GB that fits in a usable region, before fragmentation can set in.
+    // The ISA DMA zone is only used when nothing above it fits.
+    for (int pass = 0; pass < 2 && cma_phys == 0; pass++) {
+        uintptr_t floor = pass == 0 ? zone_end_pfn(PMM_ZONE_DMA) * pmm_config.page_size : 0;
         
-        // Skip usable regions and regions outside our management range
-        if (entry->type == LIMINE_MEMMAP_USABLE) {
-            continue;
+        for (size_t i = 0; i < memmap->entry_count && cma_phys == 0; i++) {
+            uintptr_t region_start, region_end;
+            if (!usable_entry_range(memmap->entries[i], &region_start, &region_end)) {
+                continue;
+            }
+            
+            if (region_start == metadata_phys) {
+                region_start = metadata_end;
+            }
+            if (region_start < floor) {
+                region_start = floor;
+            }
+            
+            uintptr_t start = (region_start + PAGE_SIZE_2M - 1) & ~(PAGE_SIZE_2M - 1);
+            if (start + PMM_CMA_SIZE <= region_end && start + PMM_CMA_SIZE <= PMM_ZONE_DMA32_END_PFN * pmm_config.page_size) {
+                cma_phys = start;
+            }
         }
-        
-        // Skip regions completely outside our managed range
-        if (entry->base >= pmm_config.kernel_end || 
-            entry->base + entry->length <= pmm_config.kernel_start) {
+    }
+    
+    // Hand every usable page except the metadata and the DMA area to the
+    // buddy allocator
+    for (size_t i = 0; i < memmap->entry_count; i++) {
+        uintptr_t region_start, region_end;
+        if (!usable_entry_range(memmap->entries[i], &region_start, &region_end)) {
             continue;
         }
         
-        // Calculate overlap with our managed memory
-        uintptr_t region_start = entry->base;
-        uintptr_t region_end = entry->base + entry->length;
+        if (region_start == metadata_phys) {
+            region_start = metadata_end;
+        }
         
-        // Adjust to fit within our managed range
-        if (region_start < pmm_config.kernel_start) {
-            region_start = pmm_config.kernel_start;
+        if (cma_phys != 0 && cma_phys >= region_start && cma_phys < region_end) {
+            pmm_add_free_range(region_start, cma_phys);
+            region_start = cma_phys + PMM_CMA_SIZE;
         }
         
-        if (region_end > pmm_config.kernel_end) {
-            region_end = pmm_config.kernel_end;
+        pmm_add_free_range(region_start, region_end);
+    }
+    
+    // Watermarks scale with zone size: min is ~0.4% (at least 32 pages),
+    // low and high sit 25% and 50% above it
+    for (int id = 0; id < PMM_ZONE_COUNT; id++) {
+        pmm_zone_t *zone = &zones[id];
+        
+        zone->free_pages = zone->managed_pages;
+        zone->level = PMM_WATERMARK_OK;
+        zone->notified_level = PMM_WATERMARK_OK;
+        
+        if (zone->managed_pages == 0) {
+            continue;
         }
         
-        // Mark the overlapping part as used
-        for (uintptr_t addr = region_start; addr < region_end; addr += pmm_config.page_size) {
-            // Calculate offset from base
-            uintptr_t offset = addr - pmm_config.kernel_start;
-            size_t page_index = offset / pmm_config.page_size;
-            
-            // Mark as used in bitmap
-            size_t byte_index = page_index / 8;
-            uint8_t bit_mask = 1 << (page_index % 8);
-            page_bitmap[byte_index] |= bit_mask;
+        zone->watermark_min = zone->managed_pages / 256;
+        if (zone->watermark_min < 32) {
+            zone->watermark_min = 32;
         }
+        if (zone->watermark_min > zone->managed_pages / 4) {
+            zone->watermark_min = zone->managed_pages / 4;
+        }
+        zone->watermark_low = zone->watermark_min + zone->watermark_min / 4;
+        zone->watermark_high = zone->watermark_min + zone->watermark_min / 2;
     }
     
-    // Also mark the first few pages as used to avoid conflicts with low memory
-    for (size_t i = 0; i < 256 && i < pmm_config.max_pages; i++) {
-        size_t byte_index = i / 8;
-        uint8_t bit_mask = 1 << (i % 8);
-        page_bitmap[byte_index] |= bit_mask;
+    printf("Total memory: %lu MB\n", total_memory / (1024 * 1024));
+    printf("PMM metadata: %zu KB at 0x%lx\n", 
+           (metadata_pages * pmm_config.page_size) / 1024, metadata_phys);
+    if (cma_phys != 0) {
+        printf("PMM DMA area: %lu MB at 0x%lx\n", PMM_CMA_SIZE / (1024 * 1024), cma_phys);
+    } else {
+        printf("PMM: No room for a %lu MB DMA area below 4GB\n", PMM_CMA_SIZE / (1024 * 1024));
     }
+    printf("PMM managing memory from 0x%lx to 0x%lx (%zu MB usable)\n", 
+           pmm_config.kernel_start, pmm_config.kernel_end, 
+           (usable_pages * pmm_config.page_size) / (1024 * 1024));
     
-    // Store total memory size
-    pmm_config.total_memory = total_memory;
+    // Shared zero page, pinned for the lifetime of the system
+    zero_page_phys = pmm_alloc_page_flags(PMM_ALLOC_ZERO);
+    if (zero_page_phys != 0) {
+        page_t *page = &page_db[zero_page_phys / pmm_config.page_size - base_pfn];
+        page->flags = PMM_PAGE_RESERVED | PMM_PAGE_ZERO;
+        pmm_page_set_owner(zero_page_phys, PMM_OWNER_KERNEL);
+    }
+}
+
+// Move a batch of frames from the buddy allocator into a CPU cache
+static void pcp_refill(pmm_pcp_t *pcp) {
+    spinlock_acquire(&pmm_lock);
     
-    printf("PMM managing memory from 0x%lx to 0x%lx (%u MB)\n", 
-           pmm_config.kernel_start, pmm_config.kernel_end, 
-           (unsigned int)((pmm_config.kernel_end - pmm_config.kernel_start) / (1024 * 1024)));
+    while (pcp->count < PMM_PCP_BATCH) {
+        uintptr_t pfn = buddy_alloc_block(0);
+        if (pfn == 0) {
+            break;
+        }
+        pcp->frames[pcp->count++] = pfn;
+    }
+    
+    spinlock_release(&pmm_lock);
+    pcp->refills++;
 }
 
-// Allocate a single physical page
-uintptr_t pmm_alloc_page(void) {
+// Return up to count frames from a CPU cache to the buddy allocator
+static void pcp_drain(pmm_pcp_t *pcp, uint32_t count) {
+    spinlock_acquire(&pmm_lock);
+    
+    while (count > 0 && pcp->count > 0) {
+        buddy_free_block(pcp->frames[--pcp->count], 0);
+        count--;
+    }
+    
+    spinlock_release(&pmm_lock);
+    pcp->drains++;
+}
+
+// Clear a frame through the direct map
+static inline void zero_frame(uintptr_t pfn) {
+    memset((void *)((pfn << 12) + pmm_hhdm_offset), 0, pmm_config.page_size);
+}
+
+// Pop a frame from the pre-zeroed pool (interrupts must be disabled)
+static uintptr_t zero_pool_pop(void) {
+    uintptr_t pfn = 0;
+    
+    spinlock_acquire(&zero_pool_lock);
+    if (zero_pool_count > 0) {
+        pfn = zero_pool[--zero_pool_count];
+    }
+    spinlock_release(&zero_pool_lock);
+    
+    return pfn;
+}
+
+// Allocate a single physical page with PMM_ALLOC_* flags
+uintptr_t pmm_alloc_page_flags(uint32_t flags) {
     if (!page_bitmap) {
         return 0; // PMM not initialized
     }
     
-    for (size_t i = 0; i < pmm_config.max_pages; i++) {
-        size_t byte_index = i / 8;
-        uint8_t bit_mask = 1 << (i % 8);
+    bool want_zero = (flags & PMM_ALLOC_ZERO) || zero_all_allocations;
+    bool zeroed = false;
+    uintptr_t pfn = 0;
+    
+    uint64_t rflags = pmm_irq_save();
+    pmm_pcp_t *pcp = &pcp_caches[percpu_current_id()];
+    
+    if (want_zero) {
+        pfn = zero_pool_pop();
+        if (pfn != 0) {
+            zero_pool_hits++;
+            zeroed = true;
+        } else {
+            zero_pool_misses++;
+        }
+    }
+    
+    if (pfn == 0) {
+        if (pcp->count > 0) {
+            pcp->hits++;
+        } else {
+            pcp->misses++;
+            pcp_refill(pcp);
+        }
         
-        // Check if page is free
-        if (!(page_bitmap[byte_index] & bit_mask)) {
-            // Mark as used
-            page_bitmap[byte_index] |= bit_mask;
-            
-            // Calculate physical address
-            uintptr_t phys_addr = pmm_config.kernel_start + (i * pmm_config.page_size);
+        if (pcp->count > 0) {
+            pfn = pcp->frames[--pcp->count];
+        } else {
+            // Last resort: the zero pool is still free memory
+            pfn = zero_pool_pop();
+            zeroed = pfn != 0;
+        }
+    }
+    
+    // Movable pages may borrow from the DMA area; these are not zone managed
+    bool borrowed = false;
+    if (pfn == 0 && (flags & PMM_ALLOC_MOVABLE)) {
+        pfn = dma_cma_lend_page() / pmm_config.page_size;
+        borrowed = pfn != 0;
+    }
+    
+    if (pfn == 0) {
+        __atomic_fetch_add(&failed_allocations, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_add(&total_allocations, 1, __ATOMIC_RELAXED);
+        page_db_alloc_range(pfn, 1, borrowed ? PMM_PAGE_LENT : 0);
+        if (!borrowed) {
+            zone_account_range(pfn, 1, false);
+        }
+    }
+    
+    pmm_irq_restore(rflags);
+    pmm_notify_watermarks();
+    
+    if (pfn != 0 && want_zero && !zeroed) {
+        zero_frame(pfn);
+    }
+    
+    return pfn * pmm_config.page_size; // 0 if no free pages
+}
+
+// Allocate a single physical page
+uintptr_t pmm_alloc_page(void) {
+    return pmm_alloc_page_flags(0);
+}
+
+// Allocate count contiguous pages starting on a 2^align_order page boundary
+static uintptr_t pmm_alloc_run(size_t count, unsigned int align_order) {
+    uintptr_t pfn = 0;
+    uint64_t rflags = pmm_irq_save();
+    
+    for (int attempt = 0; attempt < 2 && pfn == 0; attempt++) {
+        // Cached single frames can block coalescing; flush ours and retry
+        if (attempt > 0) {
+            pmm_pcp_t *pcp = &pcp_caches[percpu_current_id()];
+            if (pcp->count == 0) {
+                break;
+            }
+            pcp_drain(pcp, pcp->count);
+        }
+        
+        spinlock_acquire(&pmm_lock);
+        
+        if (count > (1UL << PMM_MAX_ORDER) || align_order > PMM_MAX_ORDER) {
+            size_t align_pages = 1UL << (align_order > PMM_MAX_ORDER ? align_order : PMM_MAX_ORDER);
+            pfn = buddy_alloc_large(count, align_pages);
+        } else {
+            // Buddy blocks are naturally aligned to their size
+            unsigned int order = order_for_count(count);
+            if (order < align_order) {
+                order = align_order;
+            }
+            pfn = buddy_alloc_block(order);
             
-            total_allocations++;
-            return phys_addr;
+            // Return the pages beyond the requested count so that callers can
+            // free exactly what they asked for
+            if (pfn != 0 && count < (1UL << order)) {
+                buddy_free_range(pfn + count, (1UL << order) - count);
+            }
         }
+        
+        spinlock_release(&pmm_lock);
+    }
+    
+    if (pfn == 0) {
+        __atomic_fetch_add(&failed_allocations, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_add(&total_allocations, 1, __ATOMIC_RELAXED);
+        page_db_alloc_range(pfn, count, 0);
+        zone_account_range(pfn, count, false);
     }
     
-    failed_allocations++;
-    return 0; // No free pages
+    pmm_irq_restore(rflags);
+    pmm_notify_watermarks();
+    
+    if (pfn != 0 && zero_all_allocations) {
+        memset((void *)((pfn << 12) + pmm_hhdm_offset), 0, count * pmm_config.page_size);
+    }
+    
+    return pfn * pmm_config.page_size; // 0 if no run was found
 }
 
 // Allocate multiple consecutive physical pages
@@ -174,44 +934,16 @@ uintptr_t pmm_alloc_pages(size_t count) {
         return pmm_alloc_page();
     }
     
-    // For larger allocations, find a continuous run of free pages
-    size_t found_pages = 0;
-    size_t start_page = 0;
-    
-    for (size_t i = 0; i < pmm_config.max_pages; i++) {
-        size_t byte_index = i / 8;
-        uint8_t bit_mask = 1 << (i % 8);
-        
-        if (!(page_bitmap[byte_index] & bit_mask)) {
-            // This page is free
-            if (found_pages == 0) {
-                // Start of a new run
-                start_page = i;
-            }
-            
-            found_pages++;
-            
-            if (found_pages == count) {
-                // Found enough consecutive pages, mark them all as used
-                for (size_t j = 0; j < count; j++) {
-                    size_t page_idx = start_page + j;
-                    size_t byte_idx = page_idx / 8;
-                    uint8_t mask = 1 << (page_idx % 8);
-                    page_bitmap[byte_idx] |= mask;
-                }
-                
-                // Calculate physical address
-                total_allocations++;
-                return pmm_config.kernel_start + (start_page * pmm_config.page_size);
-            }
-        } else {
-            // This page is used, reset counter
-            found_pages = 0;
-        }
+    return pmm_alloc_run(count, 0);
+}
+
+// Allocate a naturally aligned 2^order page frame
+uintptr_t pmm_alloc_huge(unsigned int order) {
+    if (!page_bitmap || order > PMM_HUGE_ORDER_1G) {
+        return 0;
     }
     
-    failed_allocations++;
-    return 0; // Couldn't find enough consecutive pages
+    return pmm_alloc_run(1UL << order, order);
 }
 
 // Free a physical page
@@ -227,22 +959,283 @@ void pmm_free_page(uintptr_t page) {
         return;
     }
     
-    // Calculate the page index
-    size_t page_index = (page - pmm_config.kernel_start) / pmm_config.page_size;
-    size_t byte_index = page_index / 8;
-    uint8_t bit_mask = 1 << (page_index % 8);
+    uintptr_t pfn = page / pmm_config.page_size;
+    
+    // The shared zero page and other pinned frames are never freed
+    if (page_reserved(pfn)) {
+        return;
+    }
+    
+    // Pages borrowed from the DMA area go back to it
+    if (dma_cma_contains(page)) {
+        if (page_db[pfn - base_pfn].flags & PMM_PAGE_LENT) {
+            page_db_free_range(pfn, 1);
+        }
+        dma_cma_return_pages(page, 1);
+        return;
+    }
+    
+    // Ignore double frees, they would corrupt the free lists; claiming the
+    // flag atomically also catches two CPUs freeing the frame at once
+    page_t *desc = &page_db[pfn - base_pfn];
+    if (__atomic_fetch_or(&desc->flags, PMM_PAGE_FREE, __ATOMIC_ACQ_REL) & PMM_PAGE_FREE) {
+        return;
+    }
+    
+    page_db_free_range(pfn, 1);
     
-    // Mark as free
-    page_bitmap[byte_index] &= ~bit_mask;
+    uint64_t rflags = pmm_irq_save();
+    pmm_pcp_t *pcp = &pcp_caches[percpu_current_id()];
+    
+    if (pcp->count == PMM_PCP_CAPACITY) {
+        pcp_drain(pcp, PMM_PCP_BATCH);
+    }
+    pcp->frames[pcp->count++] = pfn;
+    zone_account_range(pfn, 1, true);
+    
+    pmm_irq_restore(rflags);
+    pmm_notify_watermarks();
 }
 
 // Free multiple consecutive physical pages
 void pmm_free_pages(uintptr_t page, size_t count) {
+    if (!page_bitmap || count == 0) {
+        return;
+    }
+    
+    if (page < pmm_config.kernel_start ||
+        page + count * pmm_config.page_size > pmm_config.kernel_end ||
+        (page % pmm_config.page_size) != 0) {
+        return;
+    }
+    
+    if (dma_cma_contains(page)) {
+        for (size_t i = 0; i < count; i++) {
+            uintptr_t pfn = page / pmm_config.page_size + i;
+            if (page_db[pfn - base_pfn].flags & PMM_PAGE_LENT) {
+                page_db_free_range(pfn, 1);
+            }
+        }
+        dma_cma_return_pages(page, count);
+        return;
+    }
+    
+    // Release maximal aligned blocks of pages that are actually in use so
+    // the buddies can coalesce back into large contiguous runs
+    uintptr_t pfn = page / pmm_config.page_size;
+    size_t i = 0;
+    
+    uint64_t rflags = pmm_irq_save();
+    spinlock_acquire(&pmm_lock);
+    
+    while (i < count) {
+        if (page_free(pfn + i) || page_reserved(pfn + i)) {
+            i++;
+            continue;
+        }
+        
+        size_t run = 1;
+        while (i + run < count && !page_free(pfn + i + run) &&
+               !page_reserved(pfn + i + run)) {
+            run++;
+        }
+        
+        page_db_free_range(pfn + i, run);
+        buddy_free_range(pfn + i, run);
+        zone_account_range(pfn + i, run, true);
+        i += run;
+    }
+    
+    spinlock_release(&pmm_lock);
+    pmm_irq_restore(rflags);
+    pmm_notify_watermarks();
+}
+
+// Free a frame returned by pmm_alloc_huge
+void pmm_free_huge(uintptr_t addr, unsigned int order) {
+    if (order > PMM_HUGE_ORDER_1G) {
+        return;
+    }
+    
+    pmm_free_pages(addr, 1UL << order);
+}
+
+// Zero free pages into the pre-zeroed pool
+size_t pmm_zero_pool_refill(size_t budget) {
+    if (!page_bitmap) {
+        return 0;
+    }
+    
+    size_t zeroed = 0;
+    
+    while (zeroed < budget && __atomic_load_n(&zero_pool_count, __ATOMIC_RELAXED) < PMM_ZERO_POOL_SIZE) {
+        // Leave memory to real allocations when any zone is under pressure
+        for (int id = 0; id < PMM_ZONE_COUNT; id++) {
+            if (zones[id].managed_pages && zones[id].level != PMM_WATERMARK_OK) {
+                return zeroed;
+            }
+        }
+        
+        uint64_t rflags = pmm_irq_save();
+        spinlock_acquire(&pmm_lock);
+        uintptr_t pfn = buddy_alloc_block(0);
+        spinlock_release(&pmm_lock);
+        pmm_irq_restore(rflags);
+        
+        if (pfn == 0) {
+            break;
+        }
+        
+        // Clear with interrupts enabled, the page is not visible to anyone yet
+        zero_frame(pfn);
+        
+        rflags = pmm_irq_save();
+        spinlock_acquire(&zero_pool_lock);
+        bool stored = zero_pool_count < PMM_ZERO_POOL_SIZE;
+        if (stored) {
+            zero_pool[zero_pool_count++] = pfn;
+        }
+        spinlock_release(&zero_pool_lock);
+        
+        if (!stored) {
+            spinlock_acquire(&pmm_lock);
+            buddy_free_block(pfn, 0);
+            spinlock_release(&pmm_lock);
+        }
+        pmm_irq_restore(rflags);
+        
+        if (!stored) {
+            break;
+        }
+        zeroed++;
+    }
+    
+    return zeroed;
+}
+
+// Get the frame descriptor of a physical address
+page_t *pmm_get_page(uintptr_t phys) {
+    if (!page_db || phys < pmm_config.kernel_start || phys >= pmm_config.kernel_end) {
+        return NULL;
+    }
+    
+    return &page_db[phys / pmm_config.page_size - base_pfn];
+}
+
+// Get the physical address described by a frame descriptor
+uintptr_t pmm_page_to_phys(const page_t *page) {
+    if (!page_db || page < page_db || page >= page_db + pmm_config.max_pages) {
+        return 0;
+    }
+    
+    return (base_pfn + (uintptr_t)(page - page_db)) * pmm_config.page_size;
+}
+
+// Take an extra reference on an allocated frame
+uint32_t pmm_page_get(uintptr_t phys) {
+    page_t *page = pmm_get_page(phys);
+    if (!page || page->refcount == 0) {
+        return 0;
+    }
+    
+    uint32_t refs = __atomic_add_fetch(&page->refcount, 1, __ATOMIC_ACQ_REL);
+    if (refs == 2) {
+        __atomic_fetch_add(&shared_frames, 1, __ATOMIC_RELAXED);
+    }
+    return refs;
+}
+
+// Drop a reference and free the frame with the last one
+bool pmm_page_put(uintptr_t phys) {
+    page_t *page = pmm_get_page(phys);
+    if (!page) {
+        return false;
+    }
+    
+    if (page->refcount == 0) {
+        printf("PMM: Reference underflow on frame 0x%lx\n", phys & ~(pmm_config.page_size - 1));
+        return false;
+    }
+    
+    uint32_t refs = __atomic_sub_fetch(&page->refcount, 1, __ATOMIC_ACQ_REL);
+    if (refs == 1) {
+        __atomic_fetch_sub(&shared_frames, 1, __ATOMIC_RELAXED);
+    }
+    if (refs != 0) {
+        return false;
+    }
+    
+    // Pinned frames keep their last reference forever
+    if (page->flags & PMM_PAGE_RESERVED) {
+        page->refcount = 1;
+        return false;
+    }
+    
+    owner_frames_sub(page->owner, 1);
+    pmm_free_page(phys & ~(pmm_config.page_size - 1));
+    return true;
+}
+
+// Get the reference count of a frame
+uint32_t pmm_page_refcount(uintptr_t phys) {
+    page_t *page = pmm_get_page(phys);
+    return page ? page->refcount : 0;
+}
+
+// Tag an allocated frame with its owner
+void pmm_page_set_owner(uintptr_t phys, pmm_page_owner_t owner) {
+    page_t *page = pmm_get_page(phys);
+    if (!page) {
+        return;
+    }
+    
+    // Free frames are not counted under any owner
+    if (page->refcount > 0) {
+        owner_frames_sub(page->owner, 1);
+        owner_frames_add(owner, 1);
+    }
+    page->owner = owner;
+}
+
+// Get the shared, read-only zero page
+uintptr_t pmm_get_zero_page(void) {
+    return zero_page_phys;
+}
+
+// Get the physical range reserved for the contiguous DMA area
+bool pmm_get_cma_region(uintptr_t *base, size_t *size) {
+    if (cma_phys == 0) {
+        return false;
+    }
+    
+    if (base) *base = cma_phys;
+    if (size) *size = PMM_CMA_SIZE;
+    return true;
+}
+
+// Take a reference on frames of the DMA area for a device buffer
+void pmm_cma_claim(uintptr_t phys, size_t count, pmm_page_owner_t owner) {
+    uintptr_t pfn = phys / pmm_config.page_size;
+    if (!page_db || !pfn_in_range(pfn) || !pfn_in_range(pfn + count - 1)) {
+        return;
+    }
+    
+    page_db_alloc_range(pfn, count, 0);
     for (size_t i = 0; i < count; i++) {
-        pmm_free_page(page + (i * pmm_config.page_size));
+        pmm_page_set_owner(phys + i * pmm_config.page_size, owner);
     }
 }
 
+// Drop the reference of DMA area frames whose buffer was freed
+void pmm_cma_release(uintptr_t phys, size_t count) {
+    uintptr_t pfn = phys / pmm_config.page_size;
+    if (!page_db || !pfn_in_range(pfn) || !pfn_in_range(pfn + count - 1)) {
+        return;
+    }
+    
+    page_db_free_range(pfn, count);
+}
+
 // Check if a page is free
 bool pmm_is_page_free(uintptr_t page) {
     if (!page_bitmap) {
@@ -264,23 +1257,22 @@ bool pmm_is_page_free(uintptr_t page) {
     return !(page_bitmap[byte_index] & bit_mask);
 }
 
+// Sum of the free counters of all zones
+static size_t total_free_pages(void) {
+    size_t free_pages = 0;
+    for (int id = 0; id < PMM_ZONE_COUNT; id++) {
+        free_pages += __atomic_load_n(&zones[id].free_pages, __ATOMIC_RELAXED);
+    }
+    return free_pages;
+}
+
 // Get total free memory
 size_t pmm_get_free_memory(void) {
     if (!page_bitmap) {
         return 0;
     }
     
-    size_t free_pages = 0;
-    for (size_t i = 0; i < pmm_config.max_pages; i++) {
-        size_t byte_index = i / 8;
-        uint8_t bit_mask = 1 << (i % 8);
-        
-        if (!(page_bitmap[byte_index] & bit_mask)) {
-            free_pages++;
-        }
-    }
-    
-    return free_pages * pmm_config.page_size;
+    return total_free_pages() * pmm_config.page_size;
 }
 
 // Get total used memory
@@ -289,17 +1281,7 @@ size_t pmm_get_used_memory(void) {
         return 0;
     }
     
-    size_t used_pages = 0;
-    for (size_t i = 0; i < pmm_config.max_pages; i++) {
-        size_t byte_index = i / 8;
-        uint8_t bit_mask = 1 << (i % 8);
-        
-        if (page_bitmap[byte_index] & bit_mask) {
-            used_pages++;
-        }
-    }
-    
-    return used_pages * pmm_config.page_size;
+    return (usable_pages - total_free_pages()) * pmm_config.page_size;
 }
 
 // Get memory information
@@ -309,6 +1291,56 @@ void pmm_get_info(pmm_config_t *config) {
     }
 }
 
+// Get statistics for a single zone
+bool pmm_get_zone_stats(pmm_zone_id_t zone_id, pmm_zone_stats_t *stats) {
+    if (zone_id >= PMM_ZONE_COUNT || !stats) {
+        return false;
+    }
+    
+    pmm_zone_t *zone = &zones[zone_id];
+    size_t free_pages = __atomic_load_n(&zone->free_pages, __ATOMIC_RELAXED);
+    
+    stats->managed_pages = zone->managed_pages;
+    stats->free_pages = free_pages;
+    stats->used_pages = zone->managed_pages - free_pages;
+    stats->watermark_min = zone->watermark_min;
+    stats->watermark_low = zone->watermark_low;
+    stats->watermark_high = zone->watermark_high;
+    stats->level = (pmm_watermark_t)__atomic_load_n(&zone->level, __ATOMIC_RELAXED);
+    
+    return true;
+}
+
+// Register a watermark notification callback
+bool pmm_register_watermark_callback(pmm_watermark_callback_t callback, void *context) {
+    if (!callback) {
+        return false;
+    }
+    
+    for (int i = 0; i < PMM_MAX_WATERMARK_CALLBACKS; i++) {
+        if (!watermark_callbacks[i].callback) {
+            watermark_callbacks[i].context = context;
+            __atomic_store_n(&watermark_callbacks[i].callback, callback, __ATOMIC_RELEASE);
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+// Unregister a watermark notification callback
+bool pmm_unregister_watermark_callback(pmm_watermark_callback_t callback) {
+    for (int i = 0; i < PMM_MAX_WATERMARK_CALLBACKS; i++) {
+        if (watermark_callbacks[i].callback == callback) {
+            __atomic_store_n(&watermark_callbacks[i].callback, NULL, __ATOMIC_RELEASE);
+            watermark_callbacks[i].context = NULL;
+            return true;
+        }
+    }
+    
+    return false;
+}
+
 // Debug function to dump bitmap info
 void pmm_dump_bitmap(void) {
     if (!page_bitmap) {
@@ -316,25 +1348,62 @@ void pmm_dump_bitmap(void) {
         return;
     }
     
-    size_t free_pages = 0;
-    size_t used_pages = 0;
+    size_t free_pages = total_free_pages();
+    size_t used_pages = usable_pages - free_pages;
+    size_t cached_pages = 0;
     
-    for (size_t i = 0; i < pmm_config.max_pages; i++) {
-        size_t byte_index = i / 8;
-        uint8_t bit_mask = 1 << (i % 8);
-        
-        if (page_bitmap[byte_index] & bit_mask) {
-            used_pages++;
-        } else {
-            free_pages++;
-        }
+    for (uint32_t cpu = 0; cpu < PERCPU_MAX_CPUS; cpu++) {
+        cached_pages += pcp_caches[cpu].count;
     }
     
     printf("PMM Statistics:\n");
-    printf("  Total pages: %u\n", pmm_config.max_pages);
+    printf("  Total pages: %u (%zu usable)\n", pmm_config.max_pages, usable_pages);
     printf("  Used pages: %zu (%zu MB)\n", used_pages, (used_pages * pmm_config.page_size) / (1024 * 1024));
-    printf("  Free pages: %zu (%zu MB)\n", free_pages, (free_pages * pmm_config.page_size) / (1024 * 1024));
+    printf("  Free pages: %zu (%zu MB, %zu in CPU caches)\n", free_pages,
+           (free_pages * pmm_config.page_size) / (1024 * 1024), cached_pages);
     printf("  Total allocations: %zu\n", total_allocations);
     printf("  Failed allocations: %zu\n", failed_allocations);
     printf("  Memory range: 0x%lx - 0x%lx\n", pmm_config.kernel_start, pmm_config.kernel_end);
+    printf("  Zero pool: %u/%u pages, %lu hits, %lu misses\n",
+           zero_pool_count, PMM_ZERO_POOL_SIZE, zero_pool_hits, zero_pool_misses);
+    
+    // Referenced frames by owner, and frames with more than one user
+    static const char *owner_names[] = {
+        "untagged", "kernel", "user", "page table", "dma", "slab", "page cache"
+    };
+    
+    printf("  Frames by owner:");
+    for (int owner = 0; owner <= PMM_OWNER_PAGE_CACHE; owner++) {
+        printf(" %s %zu%s", owner_names[owner],
+               __atomic_load_n(&owner_frames[owner], __ATOMIC_RELAXED),
+               owner < PMM_OWNER_PAGE_CACHE ? "," : "\n");
+    }
+    printf("  Shared frames: %zu, zero page at 0x%lx\n",
+           __atomic_load_n(&shared_frames, __ATOMIC_RELAXED), zero_page_phys);
+    printf("  Zones:\n");
+    for (int id = 0; id < PMM_ZONE_COUNT; id++) {
+        pmm_zone_t *zone = &zones[id];
+        if (zone->managed_pages == 0) {
+            continue;
+        }
+        printf("    %-6s: %zu/%zu pages free, watermarks min %zu low %zu high %zu (%s)\n",
+               zone->name, zone->free_pages, zone->managed_pages,
+               zone->watermark_min, zone->watermark_low, zone->watermark_high,
+               zone->level == PMM_WATERMARK_OK ? "ok" :
+               zone->level == PMM_WATERMARK_LOW ? "low" : "min");
+    }
+    printf("  Free blocks by order:\n");
+    for (unsigned int order = 0; order <= PMM_MAX_ORDER; order++) {
+        printf("    Order %2u (%5lu KB): %zu\n", order,
+               (pmm_config.page_size << order) / 1024, free_block_count[order]);
+    }
+    printf("  Per-CPU page caches:\n");
+    for (uint32_t cpu = 0; cpu < PERCPU_MAX_CPUS; cpu++) {
+        pmm_pcp_t *pcp = &pcp_caches[cpu];
+        if (pcp->hits == 0 && pcp->misses == 0 && pcp->count == 0) {
+            continue;
+        }
+        printf("    CPU %u: %u cached, %lu hits, %lu misses, %lu refills, %lu drains\n",
+               cpu, pcp->count, pcp->hits, pcp->misses, pcp->refills, pcp->drains);
+    }
 }
\ No newline at end of file
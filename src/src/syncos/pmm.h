@@ -7,18 +7,97 @@
 
 extern struct limine_memmap_response;
 
-// Bitmap-based physical memory manager
+// Bitmap-backed binary buddy physical memory manager
+
+// Largest buddy block order (2^10 pages = 4MB)
+#define PMM_MAX_ORDER          10
 
 // PMM initialization flags
 #define PMM_FLAG_ZERO_PAGES    (1 << 0)  // Zero out pages on allocation
 #define PMM_FLAG_CLEAR_BITMAP  (1 << 1)  // Clear bitmap during initialization
 
+// Huge frame orders for pmm_alloc_huge (naturally aligned)
+#define PMM_HUGE_ORDER_2M      9    // 512 pages
+#define PMM_HUGE_ORDER_1G      18   // 262144 pages
+
+// Page allocation flags
+#define PMM_ALLOC_ZERO         (1 << 0)  // Return a zero-filled page
+#define PMM_ALLOC_MOVABLE      (1 << 1)  // Page may be borrowed from the DMA area
+
+// Contiguous DMA area reserved below 4GB at boot (see syncos/dma.h)
+#define PMM_CMA_SIZE           (8UL * 1024 * 1024)
+
+// Number of pre-zeroed pages kept ready for PMM_ALLOC_ZERO
+#define PMM_ZERO_POOL_SIZE     256
+#define PMM_ZERO_POOL_BATCH    16   // Pages zeroed per idle iteration
+
+// Physical memory zones
+typedef enum {
+    PMM_ZONE_DMA,              // Below 16MB (legacy ISA DMA)
+    PMM_ZONE_DMA32,            // Below 4GB (32-bit DMA capable devices)
+    PMM_ZONE_NORMAL,           // Everything above 4GB
+    PMM_ZONE_COUNT
+} pmm_zone_id_t;
+
+// Zone watermark levels
+// A zone drops to LOW below its low mark and to MIN below its min mark,
+// and only returns to OK once it climbs back above its high mark
+typedef enum {
+    PMM_WATERMARK_OK,
+    PMM_WATERMARK_LOW,
+    PMM_WATERMARK_MIN
+} pmm_watermark_t;
+
+// Per-zone statistics
+typedef struct {
+    size_t managed_pages;      // Usable pages in the zone
+    size_t free_pages;         // Pages available for allocation
+    size_t used_pages;         // Pages handed out
+    size_t watermark_min;      // Min watermark (pages)
+    size_t watermark_low;      // Low watermark (pages)
+    size_t watermark_high;     // High watermark (pages)
+    pmm_watermark_t level;     // Current watermark level
+} pmm_zone_stats_t;
+
+// Watermark notification callback, called without PMM locks held when a
+// zone changes level
+typedef void (*pmm_watermark_callback_t)(pmm_zone_id_t zone, pmm_watermark_t level,
+                                         size_t free_pages, void *context);
+
 // Physical page information
 typedef struct {
     uintptr_t address;       // Physical address of the page
     uint64_t flags;          // Page flags (reserved, used, etc.)
 } pmm_page_info_t;
 
+// Page frame flags
+#define PMM_PAGE_RESERVED      (1 << 0)  // Never returned to the allocator
+#define PMM_PAGE_ZERO          (1 << 1)  // The shared zero page
+#define PMM_PAGE_COW           (1 << 2)  // Mapped copy-on-write
+#define PMM_PAGE_LENT          (1 << 3)  // Borrowed from the DMA area
+#define PMM_PAGE_FREE          (1 << 4)  // Held by the allocator
+
+// Page frame owners
+typedef enum {
+    PMM_OWNER_NONE,            // Free or untagged
+    PMM_OWNER_KERNEL,          // Kernel heap (vmm_allocate)
+    PMM_OWNER_USER,            // User memory
+    PMM_OWNER_PAGE_TABLE,      // Paging structure
+    PMM_OWNER_DMA,             // Device DMA buffer
+    PMM_OWNER_SLAB,            // Slab allocator
+    PMM_OWNER_PAGE_CACHE       // Cached file data
+} pmm_page_owner_t;
+
+// Page frame descriptor, one per physical page indexed by PFN
+// A frame is free when its refcount is zero; allocation sets it to one
+typedef struct page {
+    volatile uint32_t refcount; // Number of users (mappings, references)
+    uint16_t flags;             // PMM_PAGE_* flags
+    uint8_t zone;               // pmm_zone_id_t of the frame
+    uint8_t owner;              // pmm_page_owner_t
+    uint64_t private;           // Owner-defined data
+} page_t;
+
 // PMM configuration structure
 typedef struct {
     uintptr_t total_memory;         // Total physical memory
@@ -34,9 +113,19 @@ void pmm_init(const struct limine_memmap_response *memmap, unsigned int flags);
 // Allocate a single physical page
 uintptr_t pmm_alloc_page(void);
 
+// Allocate a single physical page with PMM_ALLOC_* flags
+uintptr_t pmm_alloc_page_flags(uint32_t flags);
+
 // Allocate multiple consecutive physical pages
 uintptr_t pmm_alloc_pages(size_t count);
 
+// Allocate 2^order pages aligned to their own size (e.g. PMM_HUGE_ORDER_2M)
+// Returns the physical address, or 0 if no aligned run is free
+uintptr_t pmm_alloc_huge(unsigned int order);
+
+// Free a frame returned by pmm_alloc_huge
+void pmm_free_huge(uintptr_t addr, unsigned int order);
+
 // Free a single physical page
 void pmm_free_page(uintptr_t page);
 
@@ -46,6 +135,28 @@ void pmm_free_pages(uintptr_t page, size_t count);
 // Check if a page is free
 bool pmm_is_page_free(uintptr_t page);
 
+// Get the frame descriptor of a physical address (NULL if unmanaged)
+page_t *pmm_get_page(uintptr_t phys);
+
+// Get the physical address described by a frame descriptor
+uintptr_t pmm_page_to_phys(const page_t *page);
+
+// Take an extra reference on an allocated frame; returns the new count
+uint32_t pmm_page_get(uintptr_t phys);
+
+// Drop a reference; the frame is freed when the last one goes away
+// Returns true if the frame was freed
+bool pmm_page_put(uintptr_t phys);
+
+// Get the reference count of a frame
+uint32_t pmm_page_refcount(uintptr_t phys);
+
+// Tag an allocated frame with its owner
+void pmm_page_set_owner(uintptr_t phys, pmm_page_owner_t owner);
+
+// Get the shared, read-only zero page
+uintptr_t pmm_get_zero_page(void);
+
 // Get total free memory
 size_t pmm_get_free_memory(void);
 
@@ -55,6 +166,27 @@ size_t pmm_get_used_memory(void);
 // Get memory information
 void pmm_get_info(pmm_config_t *config);
 
+// Get the physical range reserved for the contiguous DMA area
+bool pmm_get_cma_region(uintptr_t *base, size_t *size);
+
+// Give frames of the DMA area, which the PMM does not hand out, a single
+// reference and an owner, or drop it again
+void pmm_cma_claim(uintptr_t phys, size_t count, pmm_page_owner_t owner);
+void pmm_cma_release(uintptr_t phys, size_t count);
+
+// Zero up to budget free pages into the pre-zeroed pool
+// Meant to be called from idle context; returns the number of pages zeroed
+size_t pmm_zero_pool_refill(size_t budget);
+
+// Get statistics for a single zone
+bool pmm_get_zone_stats(pmm_zone_id_t zone, pmm_zone_stats_t *stats);
+
+// Register a watermark notification callback
+bool pmm_register_watermark_callback(pmm_watermark_callback_t callback, void *context);
+
+// Unregister a watermark notification callback
+bool pmm_unregister_watermark_callback(pmm_watermark_callback_t callback);
+
 // Debug functions
 void pmm_dump_bitmap(void);
 
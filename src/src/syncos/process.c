@@ -5,6 +5,7 @@
 #include <syncos/spinlock.h>
 #include <syncos/timer.h>
 #include <syncos/idt.h>
+#include <syncos/smp.h>
 #include <kstd/string.h>
 #include <kstd/stdio.h>
 
@@ -19,15 +20,102 @@
 // Default time quantum in timer ticks
 #define DEFAULT_TIME_QUANTUM 20
 
+// Load balancing: a busy CPU looks for work every BALANCE_INTERVAL ticks
+// and only takes it from a queue at least BALANCE_IMBALANCE longer than its
+// own. A process that ran within BALANCE_CACHE_HOT_TICKS is left where its
+// cache state is.
+#define BALANCE_INTERVAL        100
+#define BALANCE_IMBALANCE       2
+#define BALANCE_CACHE_HOT_TICKS 5
+
+// Dynamic priority: a process that uses up its quantum drops a level, one
+// that wakes up gains a level plus one per PRIORITY_BOOST_TICKS it slept.
+// Either way it stays within PRIORITY_BONUS_MAX of its base priority.
+#define PRIORITY_BONUS_MAX      5
+#define PRIORITY_BOOST_TICKS    10
+
+// Ready list level of a process: 0 is the highest priority
+#define priority_level(process) (PROCESS_PRIORITY_MAX - (process)->dynamic_priority)
+
+_Static_assert(PROCESS_PRIORITY_LEVELS <= 64, "ready bitmap holds one bit per level");
+
+// Fair class: every runnable process gets a slice of the target latency in
+// proportion to its weight, but never less than the minimum granularity.
+// Both are in timer ticks and can be changed with process_set_fair_tunables.
+#define FAIR_TARGET_LATENCY     20
+#define FAIR_MIN_GRANULARITY    4
+
+// Virtual runtime a weight-1024 (priority 0) process accrues per tick
+#define FAIR_VRUNTIME_PER_TICK  1024
+
+// process_t.reap_state: a process terminated while on a CPU or pinned is
+// freed by whichever of process_terminate and the CPU or unpinner sees it
+// released first
+#define REAP_NONE               0
+#define REAP_PENDING            1
+#define REAP_RUNNING            2   // Being freed; the slot is not free yet
+
+static uint64_t fair_target_latency = FAIR_TARGET_LATENCY;
+static uint64_t fair_min_granularity = FAIR_MIN_GRANULARITY;
+
+// Weight of each base priority, from PROCESS_PRIORITY_MIN up; one level
+// is worth about 25% more CPU time than the level below it
+static const uint32_t fair_weights[PROCESS_PRIORITY_LEVELS] = {
+    /* -20 */    12,    15,    18,    23,    29,
+    /* -15 */    36,    45,    56,    70,    87,
+    /* -10 */   110,   137,   172,   215,   272,
+    /*  -5 */   335,   423,   526,   655,   820,
+    /*   0 */  1024,  1277,  1586,  1991,  2501,
+    /*   5 */  3121,  3906,  4904,  6100,  7620,
+    /*  10 */  9548, 11916, 14949, 18705, 23254,
+    /*  15 */ 29154, 36291, 46273, 56483, 71755,
+};
+
 // Process table
 static process_t process_table[PROCESS_MAX_COUNT];
 static uint32_t next_pid = 1;
-static process_t* current_process = NULL;
-static process_t* idle_process = NULL;
 
-// Process queues
-static process_t* ready_queue_head = NULL;
-static process_t* ready_queue_tail = NULL;
+// Per-CPU run queue
+//
+// Each CPU schedules only the processes on its own queue, so the timer tick
+// takes no lock shared with other CPUs. The queue keeps one FIFO list per
+// priority level and a bitmap of the non-empty ones, so the next process is
+// the head of the list at the lowest set bit. A process's dynamic priority
+// only changes while it is not queued. Processes of the fair class wait in a
+// tree ordered by virtual runtime instead and run when no priority-class
+// process is ready. Queues are balanced by stealing: a
+// CPU with nothing to run, or periodically one with a much shorter queue,
+// moves a READY process from the busiest queue to its own. Two queues are
+// always locked in CPU order.
+typedef struct {
+    process_t* current;        // Process running on the CPU
+    process_t* idle;           // Runs when nothing else is ready
+    struct {
+        process_t* head;       // Processes waiting at this level
+        process_t* tail;
+    } ready[PROCESS_PRIORITY_LEVELS];
+    uint64_t ready_bitmap;     // Bit n set while level n is not empty
+    rb_root_t fair_tree;       // Fair-class processes by virtual runtime
+    size_t nr_fair;            // Processes in the fair tree
+    uint64_t fair_weight;      // Sum of their weights
+    uint64_t min_vruntime;     // Virtual runtime of the last fair pick
+    size_t nr_ready;           // Processes in all levels and the tree
+    process_t* switched_from;  // Process whose context is being saved
+    uint64_t balance_ticks;    // Ticks since the last periodic balance
+    uint64_t steal_attempts;   // Queues locked to steal from
+    uint64_t migrations;       // Processes stolen from other CPUs
+    spinlock_t lock;           // Protects the ready queue
+} runqueue_t;
+
+static runqueue_t runqueues[PERCPU_MAX_CPUS];
+#define this_runqueue() (&runqueues[percpu_current_id()])
+#define current_process (this_runqueue()->current)
+
+// Idle processes of the application processors; the bootstrap processor's
+// is slot 0 of the process table
+static process_t ap_idle[PERCPU_MAX_CPUS];
+
+// Blocked processes, shared by all CPUs
 static process_t* blocked_queue_head = NULL;
 
 // Process table lock
@@ -48,6 +136,7 @@ static uint32_t allocate_pid(void);
 static uintptr_t create_process_address_space(void);
 static void* create_process_stack(size_t stack_size, uintptr_t page_table);
 static void free_process_resources(process_t* process);
+static void reap_process(process_t* process);
 
 // External assembly functions for context switching
 extern void process_switch_context(uint64_t* old_ctx, uint64_t* new_ctx);
@@ -64,32 +153,382 @@ static void process_free_pages(void* addr, size_t page_count) {
     pmm_free_pages((uintptr_t)addr, page_count);
 }
 
+// Hand the frames of loaded ELF segments over to the address space they are
+// mapped in, so they are reference counted (and can be shared copy-on-write)
+// and released by vmm_delete_address_space rather than elf_cleanup
+static void adopt_elf_segments(elf_context_t* ctx) {
+    for (size_t i = 0; i < ctx->loaded_segment_count; i++) {
+        uintptr_t phys = (uintptr_t)ctx->loaded_segments[i].vaddr;
+        size_t page_count = ctx->loaded_segments[i].size / PAGE_SIZE_4K;
+        
+        for (size_t j = 0; j < page_count; j++) {
+            pmm_page_set_owner(phys + j * PAGE_SIZE_4K, PMM_OWNER_USER);
+        }
+        
+        ctx->loaded_segments[i].vaddr = NULL;
+        ctx->loaded_segments[i].size = 0;
+    }
+    ctx->loaded_segment_count = 0;
+}
+
+// Describe the loadable segments as memory areas of the process
+static void add_elf_areas(process_t* process) {
+    elf_context_t* ctx = &process->elf_ctx;
+    
+    for (uint16_t i = 0; i < ctx->header.e_phnum; i++) {
+        elf64_program_header_t* phdr = &ctx->program_headers[i];
+        if (phdr->p_type != PT_LOAD || phdr->p_memsz == 0) {
+            continue;
+        }
+        
+        uintptr_t start = phdr->p_vaddr & ~(PAGE_SIZE_4K - 1);
+        uintptr_t end = (phdr->p_vaddr + phdr->p_memsz + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
+        
+        // A page shared with the previous segment stays with that segment
+        if (vma_find(&process->vm, start)) {
+            start += PAGE_SIZE_4K;
+        }
+        if (start >= end) {
+            continue;
+        }
+        
+        uint32_t flags = VMA_USER | VMA_FIXED;
+        if (phdr->p_flags & PF_R) flags |= VMA_READ;
+        if (phdr->p_flags & PF_W) flags |= VMA_WRITE;
+        if (phdr->p_flags & PF_X) flags |= VMA_EXEC;
+        
+        if (!vma_map(&process->vm, start, end - start, flags, NULL, NULL, 0, "elf")) {
+            PROCESS_LOG("Failed to add memory area for segment at 0x%lx", start);
+        }
+    }
+}
+
+// Keep a priority within the valid range
+static int clamp_priority(int priority) {
+    if (priority < PROCESS_PRIORITY_MIN) return PROCESS_PRIORITY_MIN;
+    if (priority > PROCESS_PRIORITY_MAX) return PROCESS_PRIORITY_MAX;
+    return priority;
+}
+
+// Move the dynamic priority of a process by delta, staying near its base
+static void adjust_dynamic_priority(process_t* process, int delta) {
+    int priority = process->dynamic_priority + delta;
+    
+    if (priority > process->base_priority + PRIORITY_BONUS_MAX) {
+        priority = process->base_priority + PRIORITY_BONUS_MAX;
+    } else if (priority < process->base_priority - PRIORITY_BONUS_MAX) {
+        priority = process->base_priority - PRIORITY_BONUS_MAX;
+    }
+    process->dynamic_priority = clamp_priority(priority);
+}
+
+static inline process_t* fair_entry(rb_node_t* node) {
+    return node ? rb_entry(node, process_t, fair_node) : NULL;
+}
+
+// Weight of a fair-class process
+static inline uint64_t fair_weight(const process_t* process) {
+    return fair_weights[process->base_priority - PROCESS_PRIORITY_MIN];
+}
+
+// Virtual runtime a process accrues over a number of ticks
+static inline uint64_t fair_vruntime_delta(const process_t* process, uint64_t ticks) {
+    return ticks * FAIR_VRUNTIME_PER_TICK * fair_weights[-PROCESS_PRIORITY_MIN] / fair_weight(process);
+}
+
+// Insert a process into the fair tree; the queue's lock must be held
+static void fair_enqueue(runqueue_t* rq, process_t* process) {
+    // A process coming back from a sleep, or a new one, starts next to the
+    // others, with at most half the target latency of credit
+    uint64_t credit = fair_vruntime_delta(process, fair_target_latency / 2);
+    uint64_t floor = rq->min_vruntime > credit ? rq->min_vruntime - credit : 0;
+    if (process->vruntime < floor) {
+        process->vruntime = floor;
+    }
+    
+    // Equal keys go right, so equal processes take turns
+    rb_node_t** link = &rq->fair_tree.root;
+    rb_node_t* parent = NULL;
+    while (*link) {
+        parent = *link;
+        if (process->vruntime < fair_entry(parent)->vruntime) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+        }
+    }
+    rb_link_node(&process->fair_node, parent, link);
+    rb_insert_color(&rq->fair_tree, &process->fair_node);
+    
+    rq->nr_fair++;
+    rq->fair_weight += fair_weight(process);
+}
+
+// Remove a process from the fair tree; the queue's lock must be held
+static void fair_dequeue(runqueue_t* rq, process_t* process) {
+    rb_erase(&rq->fair_tree, &process->fair_node);
+    rq->nr_fair--;
+    rq->fair_weight -= fair_weight(process);
+}
+
+// Ticks a fair-class process may run before the others get their turn
+static uint64_t fair_timeslice(runqueue_t* rq, process_t* current) {
+    uint64_t weight = fair_weight(current);
+    uint64_t total = rq->fair_weight + weight;
+    
+    // With too many processes the period stretches so that each still gets
+    // the minimum granularity
+    uint64_t period = fair_target_latency;
+    if ((rq->nr_fair + 1) * fair_min_granularity > period) {
+        period = (rq->nr_fair + 1) * fair_min_granularity;
+    }
+    
+    uint64_t slice = period * weight / total;
+    return slice > fair_min_granularity ? slice : fair_min_granularity;
+}
+
+// Check whether a running fair-class process should make way for another
+static bool fair_should_preempt(runqueue_t* rq, process_t* current) {
+    process_t* leftmost = fair_entry(rb_first(&rq->fair_tree));
+    if (!leftmost) {
+        return false;
+    }
+    
+    uint64_t ran = current->cpu_time - current->last_schedule;
+    if (ran >= fair_timeslice(rq, current)) {
+        return true;
+    }
+    
+    // A process that fell more than the minimum granularity behind, such
+    // as one that just woke up, does not wait for the slice to end
+    return ran >= fair_min_granularity &&
+           current->vruntime > leftmost->vruntime + fair_vruntime_delta(leftmost, fair_min_granularity);
+}
+
+// Append a process to the list of its priority level; the queue's lock
+// must be held
+static void priority_enqueue(runqueue_t* rq, process_t* process) {
+    int level = priority_level(process);
+    process->next = NULL;
+    
+    if (!rq->ready[level].head) {
+        // Level is empty
+        rq->ready[level].head = process;
+        rq->ready[level].tail = process;
+        process->prev = NULL;
+        rq->ready_bitmap |= 1UL << level;
+    } else {
+        // Add to end of level
+        rq->ready[level].tail->next = process;
+        process->prev = rq->ready[level].tail;
+        rq->ready[level].tail = process;
+    }
+}
+
+// Unlink a process from the list of its priority level; the queue's lock
+// must be held
+static void priority_dequeue(runqueue_t* rq, process_t* process) {
+    int level = priority_level(process);
+    
+    if (process->prev) {
+        process->prev->next = process->next;
+    } else {
+        rq->ready[level].head = process->next;
+    }
+    
+    if (process->next) {
+        process->next->prev = process->prev;
+    } else {
+        rq->ready[level].tail = process->prev;
+    }
+    
+    if (!rq->ready[level].head) {
+        rq->ready_bitmap &= ~(1UL << level);
+    }
+    
+    process->next = NULL;
+    process->prev = NULL;
+}
+
+// Queue a process in its scheduling class; the queue's lock must be held
+static void runqueue_enqueue(runqueue_t* rq, process_t* process) {
+    if (process->sched_class == PROCESS_SCHED_FAIR) {
+        fair_enqueue(rq, process);
+    } else {
+        priority_enqueue(rq, process);
+    }
+    rq->nr_ready++;
+}
+
+// Unqueue a process from its scheduling class; the queue's lock must be held
+static void runqueue_dequeue(runqueue_t* rq, process_t* process) {
+    if (process->sched_class == PROCESS_SCHED_FAIR) {
+        fair_dequeue(rq, process);
+    } else {
+        priority_dequeue(rq, process);
+    }
+    rq->nr_ready--;
+}
+
+// Lock the run queue holding a process. The process can migrate until that
+// lock is held, so its CPU is checked again afterwards. Interrupts must be
+// disabled.
+static runqueue_t* lock_process_runqueue(process_t* process) {
+    while (1) {
+        uint32_t cpu = __atomic_load_n(&process->cpu, __ATOMIC_ACQUIRE);
+        runqueue_t* rq = &runqueues[cpu];
+        
+        spinlock_acquire(&rq->lock);
+        if (process->cpu == cpu) {
+            return rq;
+        }
+        spinlock_release(&rq->lock);
+    }
+}
+
+// Check whether a queued process can be moved to another CPU: not while
+// its context is still being saved, nor while it is cache hot
+static bool process_can_migrate(const process_t* process, uint64_t now) {
+    if (__atomic_load_n(&process->on_cpu, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    
+    // A process that never ran has nothing in any cache
+    return process->cpu_time == 0 || now - process->last_ran >= BALANCE_CACHE_HOT_TICKS;
+}
+
+// Find the process to run next: round-robin within the highest priority
+// level that has processes, then the fair process that has had the least
+// CPU time for its weight. Pinned processes wait where they are.
+static process_t* pick_next_process(runqueue_t* rq) {
+    for (uint64_t levels = rq->ready_bitmap; levels; levels &= levels - 1) {
+        for (process_t* p = rq->ready[__builtin_ctzll(levels)].head; p; p = p->next) {
+            if (!__atomic_load_n(&p->pinned, __ATOMIC_ACQUIRE)) {
+                return p;
+            }
+        }
+    }
+    
+    for (rb_node_t* node = rb_first(&rq->fair_tree); node; node = rb_next(node)) {
+        if (!__atomic_load_n(&fair_entry(node)->pinned, __ATOMIC_ACQUIRE)) {
+            return fair_entry(node);
+        }
+    }
+    return NULL;
+}
+
+// Move a READY process from the busiest run queue to this CPU's. An idle
+// CPU takes work from any queue with some waiting, a busy one only from a
+// queue clearly longer than its own. Interrupts must be disabled.
+static bool steal_process(bool idle) {
+    uint32_t self = percpu_current_id();
+    runqueue_t* dst = &runqueues[self];
+    
+    // Find the longest queue without locking any
+    uint32_t busiest = self;
+    size_t longest = 0;
+    for (uint32_t i = 0; i < PERCPU_MAX_CPUS; i++) {
+        percpu_t* cpu = smp_get_cpu(i);
+        if (i == self || !cpu || !cpu->online) {
+            continue;
+        }
+        
+        size_t nr_ready = __atomic_load_n(&runqueues[i].nr_ready, __ATOMIC_RELAXED);
+        if (nr_ready > longest) {
+            busiest = i;
+            longest = nr_ready;
+        }
+    }
+    
+    size_t own = idle ? 0 : __atomic_load_n(&dst->nr_ready, __ATOMIC_RELAXED);
+    if (busiest == self || longest < own + (idle ? 1 : BALANCE_IMBALANCE)) {
+        return false;
+    }
+    
+    runqueue_t* src = &runqueues[busiest];
+    runqueue_t* first = busiest < self ? src : dst;
+    runqueue_t* second = busiest < self ? dst : src;
+    spinlock_acquire(&first->lock);
+    spinlock_acquire(&second->lock);
+    dst->steal_attempts++;
+    
+    // Take the highest priority process that can move, then the fair one
+    // furthest behind. The head of each level has waited longest, so it is
+    // the least likely to be cache hot.
+    uint64_t now = timer_get_ticks();
+    process_t* victim = NULL;
+    if (src->nr_ready >= own + (idle ? 1 : BALANCE_IMBALANCE)) {
+        for (uint64_t levels = src->ready_bitmap; levels && !victim; levels &= levels - 1) {
+            process_t* p = src->ready[__builtin_ctzll(levels)].head;
+            for (; p; p = p->next) {
+                if (process_can_migrate(p, now)) {
+                    victim = p;
+                    break;
+                }
+            }
+        }
+        
+        for (rb_node_t* node = rb_first(&src->fair_tree); node && !victim; node = rb_next(node)) {
+            if (process_can_migrate(fair_entry(node), now)) {
+                victim = fair_entry(node);
+            }
+        }
+    }
+    
+    if (victim) {
+        runqueue_dequeue(src, victim);
+        
+        // Virtual runtimes only compare within one queue; keep the
+        // process's lead or lag relative to the queue it leaves
+        if (victim->sched_class == PROCESS_SCHED_FAIR) {
+            int64_t lag = (int64_t)(victim->vruntime - src->min_vruntime);
+            if (lag < 0 && (uint64_t)-lag > dst->min_vruntime) {
+                victim->vruntime = 0;
+            } else {
+                victim->vruntime = dst->min_vruntime + lag;
+            }
+        }
+        
+        __atomic_store_n(&victim->cpu, self, __ATOMIC_RELEASE);
+        runqueue_enqueue(dst, victim);
+        dst->migrations++;
+    }
+    
+    spinlock_release(&second->lock);
+    spinlock_release(&first->lock);
+    return victim != NULL;
+}
+
 // Schedule the next process to run
 static void schedule_next(void) {
     // Disable interrupts while scheduling
     idt_disable_interrupts();
     
+    runqueue_t* rq = this_runqueue();
+    
+    // About to go idle: look for work queued on other CPUs first
+    if (rq->nr_ready == 0) {
+        steal_process(true);
+    }
+    
+    spinlock_acquire(&rq->lock);
+    
     // Try to get next process from ready queue
-    process_t* next = NULL;
+    process_t* next = pick_next_process(rq);
     
-    // Simple round-robin scheduler
-    if (ready_queue_head) {
-        next = ready_queue_head;
-        ready_queue_head = ready_queue_head->next;
-        
-        if (ready_queue_head) {
-            ready_queue_head->prev = NULL;
-        } else {
-            ready_queue_tail = NULL;
+    if (next) {
+        runqueue_dequeue(rq, next);
+        next->state = PROCESS_STATE_RUNNING;
+        if (next->sched_class == PROCESS_SCHED_FAIR && next->vruntime > rq->min_vruntime) {
+            rq->min_vruntime = next->vruntime;
         }
-        
-        next->next = NULL;
-        next->prev = NULL;
     } else {
         // No ready processes, use idle process
-        next = idle_process;
+        next = rq->idle;
     }
     
+    spinlock_release(&rq->lock);
+    
     // Switch to the next process
     if (next) {
         context_switch(next);
@@ -109,6 +548,12 @@ bool process_init(void) {
     spinlock_init(&process_lock);
     spinlock_set_name(&process_lock, "process_lock");
     
+    for (size_t i = 0; i < PERCPU_MAX_CPUS; i++) {
+        memset(&runqueues[i], 0, sizeof(runqueue_t));
+        spinlock_init(&runqueues[i].lock);
+        spinlock_set_name(&runqueues[i].lock, "runqueue");
+    }
+    
     // Initialize process scheduler
     if (!process_scheduler_init()) {
         PROCESS_LOG("Failed to initialize process scheduler");
@@ -133,33 +578,39 @@ bool process_scheduler_init(void) {
     return true;
 }
 
-// Register the kernel thread as the idle process
+// Register the kernel thread as the idle process of the calling CPU
 bool process_register_kernel_idle(void) {
+    uint32_t cpu = percpu_current_id();
     spinlock_acquire(&process_lock);
     
     // Create a process entry for the idle process
-    process_t* idle = &process_table[0]; // Reserve slot 0 for idle
+    process_t* idle = cpu == 0 ? &process_table[0] : &ap_idle[cpu]; // Reserve slot 0 for idle
     memset(idle, 0, sizeof(process_t));
     
     idle->pid = 0;
+    idle->cpu = cpu;
     idle->state = PROCESS_STATE_READY;
     strncpy(idle->name, "kernel_idle", sizeof(idle->name) - 1);
     
     // The idle process already has a context (current kernel execution context)
     idle->context.cr3 = vmm_get_current_address_space();
     
+    // Switching to idle loads the kernel tables, so a CPU does not keep an
+    // exited process's tables loaded and hold off the reaper
+    idle->page_table = idle->context.cr3;
+    
     // Set up other fields
     idle->quantum = UINT64_MAX; // Idle process runs until another process is ready
-    idle->base_priority = -20;  // Lowest priority
-    idle->dynamic_priority = -20;
+    idle->base_priority = PROCESS_PRIORITY_MIN;  // Lowest priority
+    idle->dynamic_priority = PROCESS_PRIORITY_MIN;
     
     // Set as idle process
-    idle_process = idle;
-    current_process = idle;
+    runqueues[cpu].idle = idle;
+    runqueues[cpu].current = idle;
     
     spinlock_release(&process_lock);
     
-    PROCESS_LOG("Registered kernel idle process (PID 0)");
+    PROCESS_LOG("Registered kernel idle process (PID 0) of CPU %u", cpu);
     return true;
 }
 
@@ -172,22 +623,59 @@ static void timer_callback(uint64_t tick_count, void* context) {
         return;
     }
     
+    process_timer_tick();
+}
+
+// Check whether a process that should run before the current one waits.
+// Priority-class processes run before fair ones; a fair process also makes
+// way once its slice is used up.
+static bool should_preempt(runqueue_t* rq, process_t* current) {
+    uint64_t levels = __atomic_load_n(&rq->ready_bitmap, __ATOMIC_RELAXED);
+    
+    if (current == rq->idle) {
+        return __atomic_load_n(&rq->nr_ready, __ATOMIC_RELAXED) > 0;
+    }
+    
+    if (current->sched_class == PROCESS_SCHED_FAIR) {
+        return levels || fair_should_preempt(rq, current);
+    }
+    return levels && __builtin_ctzll(levels) < priority_level(current);
+}
+
+// Account a tick to the process running on this CPU and preempt it once
+// its share of the CPU is used up or a process that should run first is
+// ready
+void process_timer_tick(void) {
+    runqueue_t* rq = this_runqueue();
+    process_t* current = rq->current;
+    
+    // Even out the queue lengths now and then
+    if (++rq->balance_ticks >= BALANCE_INTERVAL) {
+        rq->balance_ticks = 0;
+        steal_process(false);
+    }
+    
     // Check if we need to schedule another process
-    if (current_process && current_process->state == PROCESS_STATE_RUNNING) {
-        current_process->cpu_time++;
+    if (current && current->state == PROCESS_STATE_RUNNING) {
+        current->cpu_time++;
+        if (current->sched_class == PROCESS_SCHED_FAIR) {
+            current->vruntime += fair_vruntime_delta(current, 1);
+        }
         
-        // If the process has used its time quantum, reschedule
-        if (current_process->cpu_time - current_process->last_schedule >= current_process->quantum) {
-            // Move current process back to ready queue
-            spinlock_acquire(&process_lock);
-            
-            if (current_process != idle_process) {
-                current_process->state = PROCESS_STATE_READY;
-                add_to_ready_queue(current_process);
+        // If a priority-class process has used its time quantum, or a
+        // process that should run first is waiting, reschedule
+        bool expired = current->sched_class == PROCESS_SCHED_PRIORITY &&
+                       current->cpu_time - current->last_schedule >= current->quantum;
+        if (expired || should_preempt(rq, current)) {
+            // Move current process back to ready queue; running a whole
+            // quantum costs it a priority level
+            if (current != rq->idle) {
+                if (expired) {
+                    adjust_dynamic_priority(current, -1);
+                }
+                add_to_ready_queue(current);
             }
             
-            spinlock_release(&process_lock);
-            
             // Schedule next process
             schedule_next();
         }
@@ -197,6 +685,23 @@ static void timer_callback(uint64_t tick_count, void* context) {
     }
 }
 
+// Pick the CPU with the shortest ready queue for a new process
+static uint32_t select_cpu(void) {
+    uint32_t best = 0;
+    
+    for (uint32_t i = 1; i < PERCPU_MAX_CPUS; i++) {
+        percpu_t* cpu = smp_get_cpu(i);
+        if (!cpu || !cpu->online) {
+            continue;
+        }
+        
+        if (runqueues[i].nr_ready < runqueues[best].nr_ready) {
+            best = i;
+        }
+    }
+    return best;
+}
+
 // Allocate a new process ID
 static uint32_t allocate_pid(void) {
     // Simple PID allocation: increment and wrap around if needed
@@ -228,49 +733,25 @@ static void* create_process_stack(size_t stack_size, uintptr_t page_table) {
     // Align stack size to page boundary
     stack_size = (stack_size + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
     
-    // Allocate physical memory for the stack
-    size_t page_count = stack_size / PAGE_SIZE_4K;
-    uintptr_t stack_phys = pmm_alloc_pages(page_count);
-    if (stack_phys == 0) {
-        PROCESS_LOG("Failed to allocate physical memory for process stack");
-        return NULL;
-    }
-    
     // Define a virtual address for the stack (just below 2GB marker for user space)
     uint64_t stack_virt = 0x00000000EFFFF000ULL - stack_size + PAGE_SIZE_4K;
     
+    size_t page_count = stack_size / PAGE_SIZE_4K;
+    
     // Save current address space
     uintptr_t old_cr3 = vmm_get_current_address_space();
     
     // Switch to process address space
     vmm_switch_address_space(page_table);
     
-    // Map stack pages into process address space
-    for (size_t i = 0; i < stack_size; i += PAGE_SIZE_4K) {
-        if (!vmm_map_page(stack_virt + i, stack_phys + i, 
-                         VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_USER)) {
-            PROCESS_LOG("Failed to map process stack page at 0x%lx", stack_virt + i);
-            
-            // Clean up already mapped pages
-            for (size_t j = 0; j < i; j += PAGE_SIZE_4K) {
-                vmm_unmap_page(stack_virt + j);
-            }
-            
-            // Switch back to original address space
-            vmm_switch_address_space(old_cr3);
-            
-            // Free physical memory
-            pmm_free_pages(stack_phys, page_count);
-            
-            return NULL;
-        }
-    }
-    
-    // Add a guard page below the stack
-    uint64_t guard_virt = stack_virt - PAGE_SIZE_4K;
-    if (!vmm_map_page(guard_virt, 0, VMM_FLAG_PRESENT | VMM_FLAG_NO_EXECUTE)) {
-        PROCESS_LOG("Warning: Failed to create stack guard page");
-        // Continue anyway, this is just a protection feature
+    // Reserve the stack; frames are faulted in as the stack grows, so only
+    // the pages actually touched cost memory. The page below stays
+    // unmapped as a guard.
+    if (!vmm_map_lazy(stack_virt, page_count,
+                      VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_USER)) {
+        PROCESS_LOG("Failed to reserve process stack at 0x%lx", stack_virt);
+        vmm_switch_address_space(old_cr3);
+        return NULL;
     }
     
     // Switch back to original address space
@@ -322,9 +803,13 @@ uint32_t process_create(const void* elf_data, size_t elf_size, const process_par
     // Find a free process table entry
     process_t* process = NULL;
     for (size_t i = 1; i < PROCESS_MAX_COUNT; i++) { // Skip index 0 (idle)
-        if (process_table[i].state == PROCESS_STATE_TERMINATED || 
-            process_table[i].pid == 0) {
-            process = &process_table[i];
+        // A terminated process may still be leaving its CPU or being freed
+        process_t* slot = &process_table[i];
+        if (slot->pid == 0 ||
+            (slot->state == PROCESS_STATE_TERMINATED &&
+             !__atomic_load_n(&slot->on_cpu, __ATOMIC_ACQUIRE) &&
+             __atomic_load_n(&slot->reap_state, __ATOMIC_ACQUIRE) == REAP_NONE)) {
+            process = slot;
             break;
         }
     }
@@ -347,9 +832,12 @@ uint32_t process_create(const void* elf_data, size_t elf_size, const process_par
     
     // Set process state
     process->state = PROCESS_STATE_NEW;
+    process->cpu = select_cpu();
     
-    // Set up priority and time quantum
-    process->base_priority = params->priority;
+    // Set up scheduling class, priority and time quantum
+    process->sched_class = params->sched_class == PROCESS_SCHED_FAIR ?
+                           PROCESS_SCHED_FAIR : PROCESS_SCHED_PRIORITY;
+    process->base_priority = clamp_priority(params->priority);
     process->dynamic_priority = process->base_priority;
     process->quantum = params->time_quantum ? params->time_quantum : DEFAULT_TIME_QUANTUM;
     
@@ -360,6 +848,7 @@ uint32_t process_create(const void* elf_data, size_t elf_size, const process_par
         spinlock_release(&process_lock);
         return 0;
     }
+    vma_space_init(&process->vm, process->page_table);
     
     // Create process stack
     size_t stack_size = params->stack_size ? params->stack_size : PROCESS_DEFAULT_STACK_SIZE;
@@ -368,18 +857,26 @@ uint32_t process_create(const void* elf_data, size_t elf_size, const process_par
     
     if (!process->stack_top) {
         PROCESS_LOG("Failed to create process stack");
+        vma_space_destroy(&process->vm);
         vmm_delete_address_space(process->page_table);
         process->pid = 0; // Mark as free
         spinlock_release(&process_lock);
         return 0;
     }
     
+    // The stack keeps its reservation markers; the area describes it
+    uintptr_t stack_top = (uintptr_t)process->stack_top;
+    size_t stack_span = (stack_size + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
+    vma_map(&process->vm, stack_top - stack_span, stack_span,
+            VMA_READ | VMA_WRITE | VMA_USER | VMA_FIXED, NULL, NULL, 0, "stack");
+    
     // Initialize ELF context
     if (!elf_init(&process->elf_ctx, elf_data, elf_size, 
                  process_alloc_pages, process_free_pages)) {
         PROCESS_LOG("Failed to initialize ELF context");
         
         // Clean up resources
+        vma_space_destroy(&process->vm);
         vmm_delete_address_space(process->page_table);
         process->pid = 0; // Mark as free
         spinlock_release(&process_lock);
@@ -401,6 +898,7 @@ uint32_t process_create(const void* elf_data, size_t elf_size, const process_par
         
         // Clean up resources
         elf_cleanup(&process->elf_ctx);
+        vma_space_destroy(&process->vm);
         vmm_delete_address_space(process->page_table);
         process->pid = 0; // Mark as free
         
@@ -408,6 +906,10 @@ uint32_t process_create(const void* elf_data, size_t elf_size, const process_par
         return 0;
     }
     
+    // The address space owns the loaded segments from now on
+    adopt_elf_segments(&process->elf_ctx);
+    add_elf_areas(process);
+    
     // Get entry point
     process->entry_point = elf_get_entry_point(&process->elf_ctx);
     PROCESS_LOG("Process entry point: 0x%lx", process->entry_point);
@@ -494,12 +996,18 @@ bool process_terminate(uint32_t pid, int exit_code) {
     process->exit_code = exit_code;
     process->state = PROCESS_STATE_TERMINATED;
     
-    // Free resources
-    free_process_resources(process);
+    // Free resources; a process still on a CPU (this one included) keeps
+    // them until that CPU has switched away from it, a pinned one until
+    // it is unpinned
+    __atomic_store_n(&process->reap_state, REAP_PENDING, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&process->on_cpu, __ATOMIC_SEQ_CST) &&
+        !__atomic_load_n(&process->pinned, __ATOMIC_SEQ_CST)) {
+        reap_process(process);
+    }
     
-    // If this was the current process, schedule another
+    // If this was the current process, schedule another; a process running
+    // on another CPU is switched away from on its next tick
     if (current_process == process) {
-        current_process = NULL;
         spinlock_release(&process_lock);
         schedule_next();
     } else {
@@ -509,62 +1017,41 @@ bool process_terminate(uint32_t pid, int exit_code) {
     return true;
 }
 
-// Add a process to the ready queue
+// Add a process to the ready queue of its CPU
 static void add_to_ready_queue(process_t* process) {
     if (!process) return;
     
-    // Initialize links
-    process->next = NULL;
-    
-    if (!ready_queue_head) {
-        // Queue is empty
-        ready_queue_head = process;
-        ready_queue_tail = process;
-        process->prev = NULL;
-    } else {
-        // Add to end of queue
-        ready_queue_tail->next = process;
-        process->prev = ready_queue_tail;
-        ready_queue_tail = process;
-    }
+    // The tick takes the queue lock from interrupt context
+    bool enabled = idt_are_interrupts_enabled();
+    idt_disable_interrupts();
+    runqueue_t* rq = lock_process_runqueue(process);
     
+    runqueue_enqueue(rq, process);
     process->state = PROCESS_STATE_READY;
+    
+    spinlock_release(&rq->lock);
+    if (enabled) {
+        idt_enable_interrupts();
+    }
 }
 
-// Remove a process from the ready queue
+// Remove a process from the ready queue of its CPU
 static void remove_from_ready_queue(process_t* process) {
     if (!process) return;
     
-    if (process == ready_queue_head) {
-        // Process is at head of queue
-        ready_queue_head = process->next;
-        if (ready_queue_head) {
-            ready_queue_head->prev = NULL;
-        } else {
-            // Queue is now empty
-            ready_queue_tail = NULL;
-        }
-    } else if (process == ready_queue_tail) {
-        // Process is at tail of queue
-        ready_queue_tail = process->prev;
-        if (ready_queue_tail) {
-            ready_queue_tail->next = NULL;
-        } else {
-            // Queue is now empty
-            ready_queue_head = NULL;
-        }
-    } else {
-        // Process is in middle of queue
-        if (process->prev) {
-            process->prev->next = process->next;
-        }
-        if (process->next) {
-            process->next->prev = process->prev;
-        }
+    bool enabled = idt_are_interrupts_enabled();
+    idt_disable_interrupts();
+    runqueue_t* rq = lock_process_runqueue(process);
+    
+    // A process that was just picked to run is no longer queued
+    if (process->state == PROCESS_STATE_READY) {
+        runqueue_dequeue(rq, process);
     }
     
-    process->next = NULL;
-    process->prev = NULL;
+    spinlock_release(&rq->lock);
+    if (enabled) {
+        idt_enable_interrupts();
+    }
 }
 
 // Add a process to the blocked queue
@@ -610,23 +1097,57 @@ static void free_process_resources(process_t* process) {
     
     // Free page table (if any)
     if (process->page_table) {
+        vma_space_destroy(&process->vm);
         vmm_delete_address_space(process->page_table);
         process->page_table = 0;
     }
     
-    // Zero out memory regions
-    process->memory_region_count = 0;
-    
     // Process state & struct itself remains in the process table
     // They'll be reused when a new process is created
 }
 
+// Free a terminated process's resources unless another CPU already does
+static void reap_process(process_t* process) {
+    int expected = REAP_PENDING;
+    if (__atomic_compare_exchange_n(&process->reap_state, &expected, REAP_RUNNING,
+                                    false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free_process_resources(process);
+        __atomic_store_n(&process->reap_state, REAP_NONE, __ATOMIC_RELEASE);
+    }
+}
+
+// Let other CPUs take the process this CPU just switched away from, and
+// free it if it was terminated while running; runs on the stack of the
+// process switched to
+static void finish_context_switch(void) {
+    runqueue_t* rq = this_runqueue();
+    process_t* prev = rq->switched_from;
+    if (prev) {
+        rq->switched_from = NULL;
+        __atomic_store_n(&prev->on_cpu, false, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&prev->reap_state, __ATOMIC_SEQ_CST) == REAP_PENDING) {
+            reap_process(prev);
+        }
+    }
+}
+
 // Context switch to another process
 static void context_switch(process_t* next) {
-    if (!next || next == current_process) {
+    if (!next) {
         return;
     }
     
+    // Picked again straight away: keep running, on a fresh quantum
+    if (next == current_process) {
+        next->state = PROCESS_STATE_RUNNING;
+        next->last_schedule = next->cpu_time;
+        return;
+    }
+    
+    // A process entered for the first time does not return through
+    // finish_context_switch; complete the switch that entered it now
+    finish_context_switch();
+    
     process_t* prev = current_process;
     current_process = next;
     
@@ -639,15 +1160,23 @@ static void context_switch(process_t* next) {
     
     next->state = PROCESS_STATE_RUNNING;
     next->last_schedule = next->cpu_time;
+    next->on_cpu = true;
     
     // Perform the actual context switch
     if (prev) {
+        // prev stays on this CPU until its context is saved
+        prev->last_ran = timer_get_ticks();
+        this_runqueue()->switched_from = prev;
+        
         // Save current context and switch to new one
         vmm_switch_address_space(next->page_table);
+        vmm_set_vma_space(&next->vm);
         process_switch_context((uint64_t*)&prev->context, (uint64_t*)&next->context);
+        finish_context_switch();
     } else {
         // No previous context, just restore new one
         vmm_switch_address_space(next->page_table);
+        vmm_set_vma_space(&next->vm);
         process_restore_context((uint64_t*)&next->context);
     }
 }
@@ -655,7 +1184,7 @@ static void context_switch(process_t* next) {
 // Set up simple idle process
 bool process_arch_init(void) {
     PROCESS_LOG("Initializing process architecture");
-
+    
     // Nothing needed for x86_64 if we use the bootstrap context
     return true;
 }
@@ -734,37 +1263,80 @@ process_t* process_get_by_id(uint32_t pid) {
 // Yield CPU to another process
 void process_yield(void) {
     // Disable interrupts while modifying the scheduler state
+    bool enabled = idt_are_interrupts_enabled();
     idt_disable_interrupts();
     
-    if (current_process) {
+    // The idle process is picked whenever the queue is empty; it is never queued
+    process_t* current = current_process;
+    if (current && current != this_runqueue()->idle) {
         // Add current process back to ready queue
-        current_process->state = PROCESS_STATE_READY;
-        add_to_ready_queue(current_process);
+        add_to_ready_queue(current);
     }
     
     // Schedule the next process
     schedule_next();
     
-    // Interrupts will be re-enabled by the context switch
+    // Back on this process, possibly after other processes ran
+    if (enabled) {
+        idt_enable_interrupts();
+    }
+}
+
+// Give the CPU to another process if one should run before the current one
+void process_schedule(void) {
+    bool enabled = idt_are_interrupts_enabled();
+    idt_disable_interrupts();
+    
+    runqueue_t* rq = this_runqueue();
+    process_t* current = rq->current;
+    if (!current || current->state != PROCESS_STATE_RUNNING) {
+        schedule_next();
+    } else if (should_preempt(rq, current)) {
+        if (current != rq->idle) {
+            add_to_ready_queue(current);
+        }
+        schedule_next();
+    }
+    
+    if (enabled) {
+        idt_enable_interrupts();
+    }
+}
+
+// Set the target latency and minimum granularity of the fair class
+bool process_set_fair_tunables(uint64_t target_latency, uint64_t min_granularity) {
+    if (min_granularity == 0 || target_latency < min_granularity) {
+        return false;
+    }
+    
+    fair_target_latency = target_latency;
+    fair_min_granularity = min_granularity;
+    return true;
 }
 
 // Block the current process
 void process_block(process_state_t state) {
-    if (!current_process || state == PROCESS_STATE_RUNNING) {
+    process_t* current = current_process;
+    if (!current || current == this_runqueue()->idle || state == PROCESS_STATE_RUNNING) {
         return;
     }
     
     // Disable interrupts while modifying the scheduler state
+    bool enabled = idt_are_interrupts_enabled();
     idt_disable_interrupts();
     
     // Set the process state and add to blocked queue
-    current_process->state = state;
-    add_to_blocked_queue(current_process);
+    spinlock_acquire(&process_lock);
+    current->state = state;
+    add_to_blocked_queue(current);
+    spinlock_release(&process_lock);
     
     // Schedule the next process
     schedule_next();
     
-    // Interrupts will be re-enabled by the context switch
+    if (enabled) {
+        idt_enable_interrupts();
+    }
 }
 
 // Unblock a process
@@ -777,6 +1349,14 @@ bool process_unblock(uint32_t pid) {
         return false;
     }
     
+    // Sleeping earns a priority boost, so processes waiting on I/O are
+    // picked soon after they wake; fair processes are placed by their
+    // virtual runtime instead
+    if (process->sched_class == PROCESS_SCHED_PRIORITY) {
+        uint64_t slept = timer_get_ticks() - process->last_ran;
+        adjust_dynamic_priority(process, 1 + (int)(slept / PRIORITY_BOOST_TICKS));
+    }
+    
     // Remove from blocked queue and add to ready queue
     remove_from_blocked_queue(process);
     process->state = PROCESS_STATE_READY;
@@ -790,14 +1370,32 @@ bool process_unblock(uint32_t pid) {
 bool process_set_priority(uint32_t pid, int priority) {
     spinlock_acquire(&process_lock);
     
+    // The idle processes stay below every priority level
     process_t* process = process_get_by_id(pid);
-    if (!process) {
+    if (!process || pid == 0) {
         spinlock_release(&process_lock);
         return false;
     }
     
-    process->base_priority = priority;
-    process->dynamic_priority = priority;
+    // A queued process moves to the list of its new priority
+    bool enabled = idt_are_interrupts_enabled();
+    idt_disable_interrupts();
+    runqueue_t* rq = lock_process_runqueue(process);
+    bool queued = process->state == PROCESS_STATE_READY;
+    if (queued) {
+        runqueue_dequeue(rq, process);
+    }
+    
+    process->base_priority = clamp_priority(priority);
+    process->dynamic_priority = process->base_priority;
+    
+    if (queued) {
+        runqueue_enqueue(rq, process);
+    }
+    spinlock_release(&rq->lock);
+    if (enabled) {
+        idt_enable_interrupts();
+    }
     
     spinlock_release(&process_lock);
     return true;
@@ -825,6 +1423,20 @@ bool process_get_stats(uint32_t pid, uint64_t* cpu_time, process_state_t* state)
     return true;
 }
 
+// Get scheduler statistics of a CPU
+bool process_get_cpu_stats(uint32_t cpu, process_cpu_stats_t* stats) {
+    if (cpu >= PERCPU_MAX_CPUS || !stats || !smp_get_cpu(cpu)) {
+        return false;
+    }
+    
+    runqueue_t* rq = &runqueues[cpu];
+    stats->nr_ready = __atomic_load_n(&rq->nr_ready, __ATOMIC_RELAXED);
+    stats->nr_fair = __atomic_load_n(&rq->nr_fair, __ATOMIC_RELAXED);
+    stats->steal_attempts = __atomic_load_n(&rq->steal_attempts, __ATOMIC_RELAXED);
+    stats->migrations = __atomic_load_n(&rq->migrations, __ATOMIC_RELAXED);
+    return true;
+}
+
 // Get list of processes
 int process_get_list(uint32_t* pids, int max_count) {
     if (!pids || max_count <= 0) {
@@ -844,7 +1456,7 @@ int process_get_list(uint32_t* pids, int max_count) {
     return count;
 }
 
-// Add memory region info
+// Add a memory area to a process
 bool process_add_memory_region(uint32_t pid, uint64_t start, uint64_t end, 
                              uint32_t flags, const char* name) {
     process_t* process;
@@ -855,37 +1467,73 @@ bool process_add_memory_region(uint32_t pid, uint64_t start, uint64_t end,
         process = process_get_by_id(pid);
     }
     
-    if (!process || !name || start >= end) {
+    // The idle processes run on the kernel tables and have no areas
+    if (!process || process->pid == 0 || !name || start >= end || !process->page_table) {
         return false;
     }
     
-    spinlock_acquire(&process_lock);
+    // The area tree has its own lock; process_lock is not needed
+    return vma_map(&process->vm, start, end - start, (flags & VMA_PROT_MASK) | VMA_FIXED,
+                   NULL, NULL, 0, name) != 0;
+}
+// Keep a process that is not running from being picked until it is
+// unpinned; false if it is running
+static bool pin_process(process_t* process) {
+    // The tick takes run queue locks, so it must not fire while one is held
+    bool enabled = idt_are_interrupts_enabled();
+    idt_disable_interrupts();
+    runqueue_t* rq = lock_process_runqueue(process);
     
-    // Find empty region slot
-    int slot = -1;
-    for (int i = 0; i < 16; i++) {
-        if (process->memory_regions[i].end == 0) {
-            slot = i;
-            break;
-        }
+    bool pinned = process->state != PROCESS_STATE_RUNNING && !process->on_cpu;
+    if (pinned) {
+        __atomic_store_n(&process->pinned, true, __ATOMIC_RELEASE);
     }
     
-    if (slot == -1) {
-        spinlock_release(&process_lock);
-        return false;
+    spinlock_release(&rq->lock);
+    if (enabled) {
+        idt_enable_interrupts();
     }
+    return pinned;
+}
+
+// Let a pinned process run again, or free it if it was terminated meanwhile
+static void unpin_process(process_t* process) {
+    __atomic_store_n(&process->pinned, false, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&process->reap_state, __ATOMIC_SEQ_CST) == REAP_PENDING) {
+        reap_process(process);
+    }
+}
+
+// Promote populated 2MB ranges of the next process that is not running
+size_t process_collapse_huge_pages(size_t budget) {
+    static size_t cursor = 1;
     
-    // Fill region info
-    process->memory_regions[slot].start = start;
-    process->memory_regions[slot].end = end;
-    process->memory_regions[slot].flags = flags;
-    strncpy(process->memory_regions[slot].name, name, 15);
-    process->memory_regions[slot].name[15] = '\0';
+    spinlock_acquire(&process_lock);
     
-    if (process->memory_region_count <= slot) {
-        process->memory_region_count = slot + 1;
+    process_t* target = NULL;
+    for (size_t tries = 1; tries < PROCESS_MAX_COUNT; tries++) {
+        process_t* process = &process_table[cursor];
+        cursor = cursor + 1 < PROCESS_MAX_COUNT ? cursor + 1 : 1;
+        
+        if (process->pid == 0 || process->state == PROCESS_STATE_TERMINATED ||
+            process->page_table == 0) {
+            continue;
+        }
+        
+        if (pin_process(process)) {
+            target = process;
+        }
+        break;
     }
     
     spinlock_release(&process_lock);
-    return true;
-}
\ No newline at end of file
+    
+    // Pinned, the process can be neither run nor freed while its tables
+    // are scanned and copied
+    size_t collapsed = 0;
+    if (target) {
+        collapsed = vmm_collapse_huge_pages(target->page_table, budget);
+        unpin_process(target);
+    }
+    return collapsed;
+}
@@ -2,6 +2,8 @@
 #define _SYNCOS_PROCESS_H
 
 #include <syncos/elf.h>
+#include <syncos/vma.h>
+#include <kstd/rbtree.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -12,6 +14,18 @@
 // Default stack size for processes (2MB)
 #define PROCESS_DEFAULT_STACK_SIZE (2 * 1024 * 1024)
 
+// Priority range; processes with larger values run first. The idle
+// processes sit at the bottom and are never queued.
+#define PROCESS_PRIORITY_MIN    (-20)
+#define PROCESS_PRIORITY_MAX    19
+#define PROCESS_PRIORITY_LEVELS (PROCESS_PRIORITY_MAX - PROCESS_PRIORITY_MIN + 1)
+
+// Scheduling classes
+typedef enum {
+    PROCESS_SCHED_PRIORITY,    // Priority levels, round-robin within a level
+    PROCESS_SCHED_FAIR         // CPU time shared by weight (virtual runtime)
+} process_sched_class_t;
+
 // Process states
 typedef enum {
     PROCESS_STATE_NEW,         // Process created but not ready
@@ -46,14 +60,8 @@ typedef struct process {
     void* stack_top;           // Virtual address of stack top
     size_t stack_size;         // Stack size
     
-    // Memory regions - for virtual memory management
-    struct {
-        uint64_t start;        // Start virtual address
-        uint64_t end;          // End virtual address
-        uint32_t flags;        // Memory protection flags
-        char name[16];         // Region name (for debugging)
-    } memory_regions[16];
-    int memory_region_count;
+    // Memory areas of the address space, for faults and mapping changes
+    vma_space_t vm;
     
     // ELF executable information
     elf_context_t elf_ctx;     // ELF context for the executable
@@ -66,8 +74,18 @@ typedef struct process {
     uint64_t quantum;          // Time quantum for this process
     
     // Priority information
-    int base_priority;         // Base priority level
-    int dynamic_priority;      // Dynamic priority (can change)
+    process_sched_class_t sched_class; // Scheduling class
+    int base_priority;         // Base priority level (fair class: weight)
+    int dynamic_priority;      // Base adjusted for sleep vs. CPU use
+    uint64_t vruntime;         // Fair class: CPU time scaled by weight
+    rb_node_t fair_node;       // Fair class: node in the run queue's tree
+    
+    // CPU whose run queue holds the process
+    uint32_t cpu;
+    uint64_t last_ran;         // Tick the process last left a CPU at
+    volatile bool on_cpu;      // Running, or its context is still being saved
+    volatile int reap_state;   // Terminated: whether its resources are freed yet
+    volatile bool pinned;      // Not to be run while its page tables change
     
     // Links for queues
     struct process* next;      // Next process in queue
@@ -81,8 +99,17 @@ typedef struct {
     size_t stack_size;         // Stack size (0 for default)
     int priority;              // Initial priority
     uint64_t time_quantum;     // Time quantum in timer ticks (0 for default)
+    process_sched_class_t sched_class; // Scheduling class (0 for priority)
 } process_params_t;
 
+// Per-CPU scheduler statistics
+typedef struct {
+    size_t nr_ready;           // Processes waiting in the CPU's queue
+    size_t nr_fair;            // Of them, processes of the fair class
+    uint64_t steal_attempts;   // Times the CPU locked another queue to steal
+    uint64_t migrations;       // Processes it took from other CPUs
+} process_cpu_stats_t;
+
 /**
  * Initialize the process manager
  * @return true if initialized successfully, false otherwise
@@ -135,11 +162,20 @@ process_t* process_get_current(void);
 process_t* process_get_by_id(uint32_t pid);
 
 /**
- * Schedule the next process to run
- * This is called by the timer interrupt handler
+ * Schedule the next process to run if one should run before the current
+ * one, in either scheduling class
+ * The timer tick makes the same decision on every CPU
  */
 void process_schedule(void);
 
+/**
+ * Set the tunables of the fair scheduling class
+ * @param target_latency Ticks in which every fair process should run once
+ * @param min_granularity Shortest slice a fair process runs for, in ticks
+ * @return true if successful, false if the values are inconsistent
+ */
+bool process_set_fair_tunables(uint64_t target_latency, uint64_t min_granularity);
+
 /**
  * Initialize the process scheduler
  * @return true if initialized successfully, false otherwise
@@ -152,6 +188,13 @@ bool process_scheduler_init(void);
  */
 bool process_register_kernel_idle(void);
 
+/**
+ * Account a timer tick to the process running on the calling CPU and
+ * preempt it once its quantum is used up
+ * Called from the timer interrupt of every CPU
+ */
+void process_timer_tick(void);
+
 /**
  * Yield the CPU to another process
  * This can be called by a process voluntarily
@@ -172,9 +215,9 @@ void process_block(process_state_t state);
 bool process_unblock(uint32_t pid);
 
 /**
- * Change process priority
+ * Change process priority; resets the dynamic priority to the new base
  * @param pid Process ID
- * @param priority New priority
+ * @param priority New priority, clamped to PROCESS_PRIORITY_MIN..MAX
  * @return true if successful, false otherwise
  */
 bool process_set_priority(uint32_t pid, int priority);
@@ -188,6 +231,14 @@ bool process_set_priority(uint32_t pid, int priority);
  */
 bool process_get_stats(uint32_t pid, uint64_t* cpu_time, process_state_t* state);
 
+/**
+ * Get scheduler statistics of a CPU
+ * @param cpu CPU index
+ * @param stats Pointer to store the statistics
+ * @return true if successful, false if the CPU does not exist
+ */
+bool process_get_cpu_stats(uint32_t cpu, process_cpu_stats_t* stats);
+
 /**
  * Get list of processes
  * @param pids Array to store process IDs
@@ -197,17 +248,25 @@ bool process_get_stats(uint32_t pid, uint64_t* cpu_time, process_state_t* state)
 int process_get_list(uint32_t* pids, int max_count);
 
 /**
- * Add debugging information about a memory region
+ * Add a memory area to a process's address space, replacing any areas it overlaps
  * @param pid Process ID (0 for current process)
- * @param start Start address of the region
+ * @param start Start address of the region (page aligned)
  * @param end End address of the region
- * @param flags Memory protection flags
+ * @param flags VMA_* protection flags
  * @param name Name of the region
  * @return true if successful, false otherwise
  */
 bool process_add_memory_region(uint32_t pid, uint64_t start, uint64_t end, 
                              uint32_t flags, const char* name);
 
+/**
+ * Promote fully populated 2MB ranges of one process that is not running to
+ * huge pages; each call moves on to the next process
+ * @param budget Maximum number of ranges to promote
+ * @return Number of ranges promoted
+ */
+size_t process_collapse_huge_pages(size_t budget);
+
 /**
  * Process initialization for architecture-specific code
  * Assembly code should call this after setting up the initial execution environment
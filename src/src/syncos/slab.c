@@ -0,0 +1,495 @@
+#include <syncos/slab.h>
+#include <syncos/pmm.h>
+#include <syncos/vmm.h>
+#include <syncos/percpu.h>
+#include <syncos/spinlock.h>
+#include <kstd/stdio.h>
+#include <kstd/string.h>
+
+#define KMEM_PAGE_SIZE         4096UL
+#define KMEM_MAX_SLAB_ORDER    4       // Slabs are at most 64KB
+#define KMEM_MIN_OBJECTS       8       // Grow slabs until this many objects fit
+#define KMEM_SIZE_CLASSES      10      // 16, 32, ... 8192
+
+// Slab header, stored at the start of the slab itself
+typedef struct slab {
+    struct slab* next;
+    struct slab* prev;
+    kmem_cache_t* cache;
+    void* free_list;           // Free objects, linked through their first word
+    uint32_t inuse;            // Objects handed out from this slab
+} slab_t;
+
+// Per-CPU stack of free objects
+typedef struct {
+    uint32_t avail;
+    void* objects[KMEM_CPU_CACHE_SIZE];
+} kmem_cpu_cache_t;
+
+struct kmem_cache {
+    char name[24];
+    size_t object_size;        // Requested size
+    size_t stride;             // Distance between objects
+    size_t offset;             // Offset of the first object in a slab
+    unsigned int order;        // Slab size is 2^order pages
+    uint32_t objects_per_slab;
+    bool active;
+    
+    spinlock_t lock;
+    slab_t* partial;           // Some objects free
+    slab_t* full;              // No objects free
+    slab_t* empty;             // All objects free
+    size_t empty_count;
+    size_t slab_count;
+    
+    uint64_t allocations;
+    uint64_t frees;
+    
+    kmem_cpu_cache_t cpu[PERCPU_MAX_CPUS];
+};
+
+static kmem_cache_t caches[KMEM_MAX_CACHES];
+static spinlock_t caches_lock;
+static kmem_cache_t* kmalloc_caches[KMEM_SIZE_CLASSES];
+static uint64_t hhdm_offset = 0;
+
+// Save RFLAGS and disable interrupts; objects may be freed from IRQ context
+static inline uint64_t kmem_irq_save(void) {
+    uint64_t rflags;
+    __asm__ volatile("pushfq; popq %0; cli" : "=r"(rflags) :: "memory");
+    return rflags;
+}
+
+static inline void kmem_irq_restore(uint64_t rflags) {
+    if (rflags & (1UL << 9)) {
+        __asm__ volatile("sti" ::: "memory");
+    }
+}
+
+static void slab_list_add(slab_t** head, slab_t* slab) {
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head) {
+        (*head)->prev = slab;
+    }
+    *head = slab;
+}
+
+static void slab_list_remove(slab_t** head, slab_t* slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *head = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = slab->prev = NULL;
+}
+
+// Find the slab an object belongs to through its frame descriptor
+static slab_t* object_slab(void* obj) {
+    page_t* page = pmm_get_page((uintptr_t)obj - hhdm_offset);
+    if (!page || page->owner != PMM_OWNER_SLAB) {
+        return NULL;
+    }
+    return (slab_t*)page->private;
+}
+
+// Allocate and carve a new slab (cache lock held)
+static slab_t* slab_create(kmem_cache_t* cache) {
+    size_t pages = 1UL << cache->order;
+    uintptr_t phys = pmm_alloc_pages(pages);
+    if (phys == 0) {
+        return NULL;
+    }
+    
+    slab_t* slab = (slab_t*)(phys + hhdm_offset);
+    slab->next = slab->prev = NULL;
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->free_list = NULL;
+    
+    // Link objects so that the lowest address is handed out first
+    uint8_t* base = (uint8_t*)slab + cache->offset;
+    for (uint32_t i = cache->objects_per_slab; i-- > 0;) {
+        void** obj = (void**)(base + i * cache->stride);
+        *obj = slab->free_list;
+        slab->free_list = obj;
+    }
+    
+    // Every page of the slab points back at its header for kfree
+    for (size_t i = 0; i < pages; i++) {
+        page_t* page = pmm_get_page(phys + i * KMEM_PAGE_SIZE);
+        pmm_page_set_owner(phys + i * KMEM_PAGE_SIZE, PMM_OWNER_SLAB);
+        page->private = (uint64_t)slab;
+    }
+    
+    cache->slab_count++;
+    return slab;
+}
+
+// Release an empty slab back to the PMM (cache lock held)
+static void slab_destroy(kmem_cache_t* cache, slab_t* slab) {
+    cache->slab_count--;
+    pmm_free_pages((uintptr_t)slab - hhdm_offset, 1UL << cache->order);
+}
+
+// Take one object from the slab lists (cache lock held)
+static void* slab_alloc_object(kmem_cache_t* cache) {
+    slab_t* slab = cache->partial;
+    
+    if (!slab) {
+        slab = cache->empty;
+        if (slab) {
+            slab_list_remove(&cache->empty, slab);
+            cache->empty_count--;
+        } else {
+            slab = slab_create(cache);
+            if (!slab) {
+                return NULL;
+            }
+        }
+        slab_list_add(&cache->partial, slab);
+    }
+    
+    void** obj = slab->free_list;
+    slab->free_list = *obj;
+    slab->inuse++;
+    
+    if (slab->inuse == cache->objects_per_slab) {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_add(&cache->full, slab);
+    }
+    
+    return obj;
+}
+
+// Put one object back on its slab (cache lock held)
+static void slab_free_object(kmem_cache_t* cache, void* ptr) {
+    slab_t* slab = object_slab(ptr);
+    void** obj = ptr;
+    
+    if (slab->inuse == cache->objects_per_slab) {
+        slab_list_remove(&cache->full, slab);
+        slab_list_add(&cache->partial, slab);
+    }
+    
+    *obj = slab->free_list;
+    slab->free_list = obj;
+    slab->inuse--;
+    
+    if (slab->inuse == 0) {
+        slab_list_remove(&cache->partial, slab);
+        
+        // Keep one empty slab around to absorb alloc/free churn
+        if (cache->empty_count > 0) {
+            slab_destroy(cache, slab);
+        } else {
+            slab_list_add(&cache->empty, slab);
+            cache->empty_count++;
+        }
+    }
+}
+
+// Move a batch of objects from the slabs into a CPU cache
+static void cpu_cache_refill(kmem_cache_t* cache, kmem_cpu_cache_t* cpu) {
+    spinlock_acquire(&cache->lock);
+    
+    while (cpu->avail < KMEM_CPU_BATCH) {
+        void* obj = slab_alloc_object(cache);
+        if (!obj) {
+            break;
+        }
+        cpu->objects[cpu->avail++] = obj;
+    }
+    
+    spinlock_release(&cache->lock);
+}
+
+// Return count objects from a CPU cache to the slabs
+static void cpu_cache_flush(kmem_cache_t* cache, kmem_cpu_cache_t* cpu, uint32_t count) {
+    spinlock_acquire(&cache->lock);
+    
+    while (count-- > 0 && cpu->avail > 0) {
+        slab_free_object(cache, cpu->objects[--cpu->avail]);
+    }
+    
+    spinlock_release(&cache->lock);
+}
+
+// Create a cache for objects of a fixed size
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align) {
+    if (size == 0 || (align & (align - 1)) != 0) {
+        return NULL;
+    }
+    
+    if (align < sizeof(void*)) {
+        align = sizeof(void*);
+    }
+    
+    if (hhdm_offset == 0) {
+        hhdm_offset = vmm_get_hhdm_offset();
+        spinlock_init(&caches_lock);
+    }
+    
+    uint64_t rflags = kmem_irq_save();
+    spinlock_acquire(&caches_lock);
+    
+    kmem_cache_t* cache = NULL;
+    for (int i = 0; i < KMEM_MAX_CACHES; i++) {
+        if (!caches[i].active) {
+            cache = &caches[i];
+            memset(cache, 0, sizeof(*cache));
+            cache->active = true;
+            break;
+        }
+    }
+    
+    spinlock_release(&caches_lock);
+    kmem_irq_restore(rflags);
+    
+    if (!cache) {
+        printf("SLAB: No free cache slot for %s\n", name);
+        return NULL;
+    }
+    
+    strncpy(cache->name, name, sizeof(cache->name) - 1);
+    cache->object_size = size;
+    cache->stride = (size + align - 1) & ~(align - 1);
+    cache->offset = (sizeof(slab_t) + align - 1) & ~(align - 1);
+    
+    // Grow the slab until enough objects fit to amortize the header
+    cache->order = 0;
+    while (cache->order < KMEM_MAX_SLAB_ORDER &&
+           ((KMEM_PAGE_SIZE << cache->order) - cache->offset) / cache->stride < KMEM_MIN_OBJECTS) {
+        cache->order++;
+    }
+    cache->objects_per_slab = ((KMEM_PAGE_SIZE << cache->order) - cache->offset) / cache->stride;
+    
+    if (cache->objects_per_slab == 0) {
+        printf("SLAB: Object size %zu too large for cache %s\n", size, name);
+        cache->active = false;
+        return NULL;
+    }
+    
+    spinlock_init(&cache->lock);
+    spinlock_set_name(&cache->lock, cache->name);
+    
+    return cache;
+}
+
+// Destroy a cache once all its objects are back
+bool kmem_cache_destroy(kmem_cache_t* cache) {
+    if (!cache || !cache->active) {
+        return false;
+    }
+    
+    uint64_t rflags = kmem_irq_save();
+    
+    for (uint32_t i = 0; i < PERCPU_MAX_CPUS; i++) {
+        cpu_cache_flush(cache, &cache->cpu[i], KMEM_CPU_CACHE_SIZE);
+    }
+    
+    spinlock_acquire(&cache->lock);
+    
+    bool busy = cache->partial || cache->full;
+    if (!busy) {
+        while (cache->empty) {
+            slab_t* slab = cache->empty;
+            slab_list_remove(&cache->empty, slab);
+            slab_destroy(cache, slab);
+        }
+        cache->empty_count = 0;
+        cache->active = false;
+    }
+    
+    spinlock_release(&cache->lock);
+    kmem_irq_restore(rflags);
+    
+    if (busy) {
+        printf("SLAB: Cache %s still has objects in use\n", cache->name);
+        return false;
+    }
+    
+    return true;
+}
+
+// Allocate an object from a cache
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+    if (!cache || !cache->active) {
+        return NULL;
+    }
+    
+    uint64_t rflags = kmem_irq_save();
+    kmem_cpu_cache_t* cpu = &cache->cpu[percpu_current_id()];
+    
+    if (cpu->avail == 0) {
+        cpu_cache_refill(cache, cpu);
+    }
+    
+    void* obj = cpu->avail > 0 ? cpu->objects[--cpu->avail] : NULL;
+    if (obj) {
+        cache->allocations++;
+    }
+    
+    kmem_irq_restore(rflags);
+    return obj;
+}
+
+// Return an object to its cache
+void kmem_cache_free(kmem_cache_t* cache, void* obj) {
+    if (!cache || !obj) {
+        return;
+    }
+    
+    slab_t* slab = object_slab(obj);
+    if (!slab || slab->cache != cache) {
+        printf("SLAB: Object %p does not belong to cache %s\n", obj, cache->name);
+        return;
+    }
+    
+    uint64_t rflags = kmem_irq_save();
+    kmem_cpu_cache_t* cpu = &cache->cpu[percpu_current_id()];
+    
+    if (cpu->avail == KMEM_CPU_CACHE_SIZE) {
+        cpu_cache_flush(cache, cpu, KMEM_CPU_BATCH);
+    }
+    cpu->objects[cpu->avail++] = obj;
+    cache->frees++;
+    
+    kmem_irq_restore(rflags);
+}
+
+// Get statistics for a cache
+bool kmem_cache_get_stats(kmem_cache_t* cache, kmem_cache_stats_t* stats) {
+    if (!cache || !cache->active || !stats) {
+        return false;
+    }
+    
+    uint64_t rflags = kmem_irq_save();
+    spinlock_acquire(&cache->lock);
+    
+    size_t in_use = 0;
+    for (slab_t* slab = cache->partial; slab; slab = slab->next) {
+        in_use += slab->inuse;
+    }
+    for (slab_t* slab = cache->full; slab; slab = slab->next) {
+        in_use += slab->inuse;
+    }
+    for (uint32_t i = 0; i < PERCPU_MAX_CPUS; i++) {
+        in_use -= cache->cpu[i].avail;
+    }
+    
+    stats->name = cache->name;
+    stats->object_size = cache->object_size;
+    stats->slab_size = KMEM_PAGE_SIZE << cache->order;
+    stats->objects_per_slab = cache->objects_per_slab;
+    stats->slabs = cache->slab_count;
+    stats->objects_in_use = in_use;
+    stats->allocations = cache->allocations;
+    stats->frees = cache->frees;
+    
+    spinlock_release(&cache->lock);
+    kmem_irq_restore(rflags);
+    return true;
+}
+
+// Initialize the kmalloc size-class caches
+void kmalloc_init(void) {
+    char name[24];
+    
+    for (int i = 0; i < KMEM_SIZE_CLASSES; i++) {
+        size_t size = (size_t)KMEM_MIN_SIZE << i;
+        snprintf(name, sizeof(name), "kmalloc-%zu", size);
+        
+        // Small classes stay naturally aligned; larger ones only need
+        // cache line alignment
+        kmalloc_caches[i] = kmem_cache_create(name, size, size < 64 ? size : 64);
+        if (!kmalloc_caches[i]) {
+            printf("SLAB: Failed to create %s\n", name);
+        }
+    }
+    
+    printf("SLAB: kmalloc ready, size classes %u..%u bytes\n", KMEM_MIN_SIZE, KMEM_MAX_SIZE);
+}
+
+// Map a request size to its size class index
+static inline int kmalloc_index(size_t size) {
+    if (size <= KMEM_MIN_SIZE) {
+        return 0;
+    }
+    return (int)(64 - __builtin_clzl(size - 1)) - 4;
+}
+
+// Allocate kernel memory
+void* kmalloc(size_t size) {
+    if (size == 0) {
+        return NULL;
+    }
+    
+    if (size <= KMEM_MAX_SIZE) {
+        return kmem_cache_alloc(kmalloc_caches[kmalloc_index(size)]);
+    }
+    
+    // Large allocations get whole pages; the head frame remembers the count
+    size_t pages = (size + KMEM_PAGE_SIZE - 1) / KMEM_PAGE_SIZE;
+    uintptr_t phys = pmm_alloc_pages(pages);
+    if (phys == 0) {
+        return NULL;
+    }
+    
+    page_t* page = pmm_get_page(phys);
+    pmm_page_set_owner(phys, PMM_OWNER_KERNEL);
+    page->private = pages;
+    
+    return (void*)(phys + hhdm_offset);
+}
+
+// Allocate zeroed kernel memory
+void* kzalloc(size_t size) {
+    void* ptr = kmalloc(size);
+    if (ptr) {
+        memset(ptr, 0, size);
+    }
+    return ptr;
+}
+
+// Free memory returned by kmalloc/kzalloc
+void kfree(void* ptr) {
+    if (!ptr) {
+        return;
+    }
+    
+    uintptr_t phys = (uintptr_t)ptr - hhdm_offset;
+    page_t* page = pmm_get_page(phys);
+    
+    if (page && page->owner == PMM_OWNER_SLAB) {
+        slab_t* slab = (slab_t*)page->private;
+        kmem_cache_free(slab->cache, ptr);
+        return;
+    }
+    
+    if (page && page->owner == PMM_OWNER_KERNEL && page->private != 0 &&
+        (phys % KMEM_PAGE_SIZE) == 0) {
+        pmm_free_pages(phys, page->private);
+        return;
+    }
+    
+    printf("SLAB: kfree of unknown pointer %p\n", ptr);
+}
+
+// Debug function to print every cache
+void kmem_dump_stats(void) {
+    printf("Slab caches:\n");
+    printf("  %-20s %8s %8s %6s %8s %10s\n", "name", "objsize", "slab", "slabs", "in use", "allocs");
+    
+    for (int i = 0; i < KMEM_MAX_CACHES; i++) {
+        kmem_cache_stats_t stats;
+        if (!kmem_cache_get_stats(&caches[i], &stats)) {
+            continue;
+        }
+        printf("  %-20s %8zu %8zu %6zu %8zu %10lu\n", stats.name, stats.object_size,
+               stats.slab_size, stats.slabs, stats.objects_in_use, stats.allocations);
+    }
+}
@@ -0,0 +1,68 @@
+#ifndef _SYNCOS_SLAB_H
+#define _SYNCOS_SLAB_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Slab allocator and kernel heap
+//
+// Objects are carved out of physically contiguous slabs taken from the PMM
+// and accessed through the higher half direct map. Every cache keeps a
+// small per-CPU stack of free objects in front of its slab lists, so the
+// common alloc/free path never takes the cache lock. kmalloc() serves
+// 16 B .. 8 KB from power-of-two caches and larger sizes from whole pages.
+
+#define KMEM_MIN_SIZE          16      // Smallest kmalloc size class
+#define KMEM_MAX_SIZE          8192    // Largest kmalloc size class
+#define KMEM_MAX_CACHES        32      // Caches that can exist at once
+#define KMEM_CPU_CACHE_SIZE    32      // Objects cached per CPU and cache
+#define KMEM_CPU_BATCH         16      // Objects moved per refill/flush
+
+// Object cache (opaque)
+typedef struct kmem_cache kmem_cache_t;
+
+// Cache statistics
+typedef struct {
+    const char* name;          // Cache name
+    size_t object_size;        // Requested object size
+    size_t slab_size;          // Bytes per slab
+    size_t objects_per_slab;   // Objects per slab
+    size_t slabs;              // Slabs currently owned by the cache
+    size_t objects_in_use;     // Objects handed out (including CPU caches)
+    uint64_t allocations;      // Total allocations
+    uint64_t frees;            // Total frees
+} kmem_cache_stats_t;
+
+// Initialize the kmalloc size-class caches
+void kmalloc_init(void);
+
+// Create a cache for objects of a fixed size
+// align must be a power of two (0 for the default of 8 bytes)
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align);
+
+// Destroy a cache; fails while objects are still allocated from it
+bool kmem_cache_destroy(kmem_cache_t* cache);
+
+// Allocate an object from a cache
+void* kmem_cache_alloc(kmem_cache_t* cache);
+
+// Return an object to its cache
+void kmem_cache_free(kmem_cache_t* cache, void* obj);
+
+// Get statistics for a cache
+bool kmem_cache_get_stats(kmem_cache_t* cache, kmem_cache_stats_t* stats);
+
+// Allocate kernel memory
+void* kmalloc(size_t size);
+
+// Allocate zeroed kernel memory
+void* kzalloc(size_t size);
+
+// Free memory returned by kmalloc/kzalloc
+void kfree(void* ptr);
+
+// Debug function to print every cache
+void kmem_dump_stats(void);
+
+#endif // _SYNCOS_SLAB_H
@@ -0,0 +1,197 @@
+#include <syncos/smp.h>
+#include <syncos/lapic.h>
+#include <syncos/gdt.h>
+#include <syncos/idt.h>
+#include <syncos/vmm.h>
+#include <syncos/pmm.h>
+#include <syncos/timer.h>
+#include <syncos/process.h>
+#include <kstd/stdio.h>
+#include <limine.h>
+
+#define MSR_GS_BASE             0xC0000101
+
+// Limine SMP request
+__attribute__((used, section(".limine_requests")))
+static volatile struct limine_smp_request smp_request = {
+    .id = LIMINE_SMP_REQUEST,
+    .revision = 0,
+    .flags = 0
+};
+
+// Per-CPU areas, one cache line apart at least
+static percpu_t cpus[PERCPU_MAX_CPUS] __attribute__((aligned(64)));
+static uint32_t cpu_slots = 1;              // Areas handed out so far
+static volatile uint32_t cpus_online = 1;   // CPUs that finished bring-up
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    __asm__ volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+// Point GS at the per-CPU area of the bootstrap processor
+void smp_init_bsp(void) {
+    percpu_t* cpu = &cpus[0];
+    cpu->self = cpu;
+    cpu->id = 0;
+    cpu->online = true;
+    wrmsr(MSR_GS_BASE, (uint64_t)cpu);
+}
+
+// Carry out the TLB flushes other CPUs asked this one for
+void smp_poll(void) {
+    percpu_t* cpu = percpu_current();
+    uint64_t seq = __atomic_load_n(&cpu->tlb_flush_seq, __ATOMIC_ACQUIRE);
+    
+    if (cpu->tlb_flush_done != seq) {
+        vmm_flush_tlb_local();
+        __atomic_store_n(&cpu->tlb_flush_done, seq, __ATOMIC_RELEASE);
+    }
+}
+
+// Make every other CPU drop its TLB entries
+void smp_tlb_shootdown(void) {
+    if (__atomic_load_n(&cpus_online, __ATOMIC_ACQUIRE) <= 1) {
+        return;
+    }
+    
+    uint32_t self = percpu_current_id();
+    uint64_t targets[PERCPU_MAX_CPUS] = {0};
+    
+    for (uint32_t i = 0; i < cpu_slots; i++) {
+        if (i != self && cpus[i].online) {
+            targets[i] = __atomic_add_fetch(&cpus[i].tlb_flush_seq, 1, __ATOMIC_ACQ_REL);
+        }
+    }
+    
+    lapic_broadcast_ipi(LAPIC_TLB_VECTOR);
+    
+    // Keep answering requests aimed at this CPU, so two CPUs shooting each
+    // other down with interrupts disabled cannot deadlock
+    for (uint32_t i = 0; i < cpu_slots; i++) {
+        while (targets[i] && __atomic_load_n(&cpus[i].tlb_flush_done, __ATOMIC_ACQUIRE) < targets[i]) {
+            smp_poll();
+            __asm__ volatile("pause");
+        }
+    }
+}
+
+// Number of CPUs that are up
+uint32_t smp_cpu_count(void) {
+    return __atomic_load_n(&cpus_online, __ATOMIC_ACQUIRE);
+}
+
+// Get the per-CPU area of a CPU
+percpu_t* smp_get_cpu(uint32_t id) {
+    return id < cpu_slots ? &cpus[id] : NULL;
+}
+
+// Entry point of an application processor, on its own stack
+__attribute__((noreturn))
+static void ap_main(percpu_t* cpu) {
+    wrmsr(MSR_GS_BASE, (uint64_t)cpu);
+    
+    // Same page tables, paging features, descriptor tables and local APIC
+    // setup as the bootstrap processor; the GDT is shared, the TSS is not
+    vmm_init_cpu();
+    idt_load();
+    gdt_load_cpu();
+    lapic_init_cpu();
+    
+    // The bring-up context becomes this CPU's idle process
+    process_register_kernel_idle();
+    
+    cpu->online = true;
+    __atomic_fetch_add(&cpus_online, 1, __ATOMIC_RELEASE);
+    printf("SMP: CPU %u (LAPIC %u) online\n", cpu->id, cpu->lapic_id);
+    
+    lapic_start_timer(timer_get_frequency());
+    idt_enable_interrupts();
+    
+    // Idle loop: run whatever lands on this CPU's run queue
+    while (1) {
+        process_yield();
+        __asm__ volatile("sti; hlt");
+    }
+}
+
+// Limine starts each application processor here on a bootloader stack
+__attribute__((noreturn))
+static void ap_entry(struct limine_smp_info* info) {
+    percpu_t* cpu = (percpu_t*)info->extra_argument;
+    
+    // Bootloader memory may be reclaimed; move to the kernel stack first
+    __asm__ volatile(
+        "movq %0, %%rsp\n"
+        "xorq %%rbp, %%rbp\n"
+        "call *%1\n"
+        :
+        : "r"(cpu->stack_top), "r"(ap_main), "D"(cpu)
+        : "memory"
+    );
+    __builtin_unreachable();
+}
+
+// Start the application processors
+bool smp_init(void) {
+    struct limine_smp_response* response = smp_request.response;
+    if (!response) {
+        printf("SMP: No response from bootloader, running on the BSP only\n");
+        return false;
+    }
+    
+    cpus[0].lapic_id = response->bsp_lapic_id;
+    printf("SMP: %lu CPUs reported, BSP LAPIC %u\n", response->cpu_count, response->bsp_lapic_id);
+    
+    if (response->cpu_count <= 1) {
+        return true;
+    }
+    
+    if (!lapic_init()) {
+        printf("SMP: Local APIC unavailable, running on the BSP only\n");
+        return false;
+    }
+    lapic_register_handler(LAPIC_TLB_VECTOR, smp_poll);
+    lapic_register_handler(LAPIC_TIMER_VECTOR, process_timer_tick);
+    
+    for (uint64_t i = 0; i < response->cpu_count; i++) {
+        struct limine_smp_info* info = response->cpus[i];
+        if (info->lapic_id == response->bsp_lapic_id) {
+            continue;
+        }
+        
+        if (cpu_slots == PERCPU_MAX_CPUS) {
+            printf("SMP: Ignoring CPUs beyond the first %u\n", PERCPU_MAX_CPUS);
+            break;
+        }
+        
+        uintptr_t stack = pmm_alloc_pages(SMP_STACK_SIZE / PAGE_SIZE_4K);
+        if (stack == 0) {
+            printf("SMP: Out of memory for the stack of LAPIC %u\n", info->lapic_id);
+            break;
+        }
+        
+        percpu_t* cpu = &cpus[cpu_slots];
+        cpu->self = cpu;
+        cpu->id = cpu_slots++;
+        cpu->lapic_id = info->lapic_id;
+        cpu->stack_top = stack + vmm_get_hhdm_offset() + SMP_STACK_SIZE;
+        
+        // One at a time, so bring-up messages do not interleave
+        uint32_t expected = smp_cpu_count() + 1;
+        info->extra_argument = (uint64_t)cpu;
+        __atomic_store_n(&info->goto_address, ap_entry, __ATOMIC_SEQ_CST);
+        
+        uint64_t start = timer_get_ticks();
+        while (smp_cpu_count() < expected &&
+               timer_get_ticks() - start < SMP_START_TIMEOUT_MS * timer_get_frequency() / 1000) {
+            __asm__ volatile("pause");
+        }
+        
+        if (smp_cpu_count() < expected) {
+            printf("SMP: CPU %u (LAPIC %u) did not come up\n", cpu->id, cpu->lapic_id);
+        }
+    }
+    
+    printf("SMP: %u CPUs online\n", smp_cpu_count());
+    return true;
+}
@@ -0,0 +1,40 @@
+#ifndef _SYNCOS_SMP_H
+#define _SYNCOS_SMP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <syncos/percpu.h>
+
+// Symmetric multiprocessing
+//
+// The application processors reported by Limine are started one at a time
+// once the memory managers, the scheduler and the PIT are up. Each gets its
+// own per-CPU area, kernel stack, TSS, idle process and run queue, and is
+// ticked by its local APIC timer.
+
+// Kernel stack of every application processor
+#define SMP_STACK_SIZE          (16 * 1024)
+
+// How long to wait for an application processor to check in (ms)
+#define SMP_START_TIMEOUT_MS    1000
+
+// Point GS at the per-CPU area of the bootstrap processor; must run before
+// anything touches per-CPU state
+void smp_init_bsp(void);
+
+// Start the application processors
+bool smp_init(void);
+
+// Number of CPUs that are up
+uint32_t smp_cpu_count(void);
+
+// Get the per-CPU area of a CPU (NULL if the index is out of range)
+percpu_t* smp_get_cpu(uint32_t id);
+
+// Make every other CPU drop its TLB entries; returns once all of them have
+void smp_tlb_shootdown(void);
+
+// Service requests other CPUs are waiting on; called while spinning
+void smp_poll(void);
+
+#endif // _SYNCOS_SMP_H
@@ -1,6 +1,7 @@
 #include <syncos/spinlock.h>
 #include <kstd/stdio.h>
 #include <syncos/idt.h>
+#include <syncos/smp.h>
 #include <kstd/string.h>
 
 // Maximum spinlock name length for debugging
@@ -71,6 +72,9 @@ void spinlock_acquire(spinlock_t *lock) {
     
     // Busy-wait spin
     while (atomic_test_and_set(&lock->value)) {
+        // The holder may be waiting on this CPU to flush its TLB
+        smp_poll();
+        
         // Pause instruction to reduce power consumption and improve spinlock performance
         __asm__ volatile ("pause");
     }
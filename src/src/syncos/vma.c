@@ -0,0 +1,443 @@
+#include <syncos/vma.h>
+#include <syncos/vmm.h>
+#include <syncos/pmm.h>
+#include <syncos/slab.h>
+#include <kstd/stdio.h>
+#include <kstd/string.h>
+
+#define VMA_PAGE_SIZE 4096UL
+
+static kmem_cache_t* vma_cache = NULL;
+
+static inline vma_t* vma_entry(rb_node_t* node) {
+    return node ? rb_entry(node, vma_t, node) : NULL;
+}
+
+static inline vma_t* vma_next(vma_t* vma) {
+    return vma_entry(rb_next(&vma->node));
+}
+
+static void vma_insert(vma_space_t* space, vma_t* vma) {
+    rb_node_t** link = &space->tree.root;
+    rb_node_t* parent = NULL;
+    
+    while (*link) {
+        parent = *link;
+        if (vma->start < vma_entry(parent)->start) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+        }
+    }
+    
+    rb_link_node(&vma->node, parent, link);
+    rb_insert_color(&space->tree, &vma->node);
+    space->count++;
+}
+
+static void vma_remove(vma_space_t* space, vma_t* vma) {
+    rb_erase(&space->tree, &vma->node);
+    space->count--;
+}
+
+// Find the area covering addr, or else the first area above it
+static vma_t* vma_find_from(vma_space_t* space, uintptr_t addr) {
+    rb_node_t* node = space->tree.root;
+    vma_t* above = NULL;
+    
+    while (node) {
+        vma_t* vma = vma_entry(node);
+        if (addr < vma->start) {
+            above = vma;
+            node = node->left;
+        } else if (addr >= vma->end) {
+            node = node->right;
+        } else {
+            return vma;
+        }
+    }
+    
+    return above;
+}
+
+// Check whether [start, end) overlaps no area
+static bool vma_range_free(vma_space_t* space, uintptr_t start, uintptr_t end) {
+    vma_t* vma = vma_find_from(space, start);
+    return !vma || vma->start >= end;
+}
+
+// Find a gap of size bytes in [from, VMA_MMAP_END), or 0
+static uintptr_t vma_find_gap(vma_space_t* space, uintptr_t from, size_t size) {
+    uintptr_t addr = from;
+    vma_t* vma = vma_find_from(space, addr);
+    
+    while (addr < VMA_MMAP_END && VMA_MMAP_END - addr >= size) {
+        if (!vma || vma->start >= addr + size) {
+            return addr;
+        }
+        if (vma->end > addr) {
+            addr = vma->end;
+        }
+        vma = vma_next(vma);
+    }
+    
+    return 0;
+}
+
+// Split an area at addr; the upper half becomes a new area
+static bool vma_split(vma_space_t* space, vma_t* vma, uintptr_t addr) {
+    if (addr <= vma->start || addr >= vma->end) {
+        return true;
+    }
+    
+    vma_t* upper = (vma_t*)kmem_cache_alloc(vma_cache);
+    if (!upper) {
+        return false;
+    }
+    
+    *upper = *vma;
+    upper->start = addr;
+    upper->offset = vma->offset + (addr - vma->start);
+    vma->end = addr;
+    vma_insert(space, upper);
+    
+    if (upper->ops && upper->ops->open) {
+        upper->ops->open(upper);
+    }
+    
+    return true;
+}
+
+// Translate area flags to page flags
+static uint64_t vma_page_flags(uint32_t flags) {
+    uint64_t page_flags = VMM_FLAG_PRESENT;
+    
+    if (flags & VMA_WRITE) page_flags |= VMM_FLAG_WRITABLE;
+    if (flags & VMA_USER)  page_flags |= VMM_FLAG_USER;
+    if (!(flags & VMA_EXEC)) page_flags |= VMM_FLAG_NO_EXECUTE;
+    
+    return page_flags;
+}
+
+// Unmap and free every area in [start, end); the space lock must be held
+static bool vma_remove_range(vma_space_t* space, uintptr_t start, uintptr_t end) {
+    vma_t* vma = vma_find_from(space, start);
+    if (!vma || vma->start >= end) {
+        return true;
+    }
+    
+    // Cut the areas straddling either end of the range
+    if (!vma_split(space, vma, start)) {
+        return false;
+    }
+    if (vma->start < start) {
+        vma = vma_next(vma);
+    }
+    
+    uintptr_t old_space = vmm_get_current_address_space();
+    vmm_switch_address_space(space->pml4_phys);
+    
+    bool ok = true;
+    while (vma && vma->start < end) {
+        if (!vma_split(space, vma, end)) {
+            ok = false;
+            break;
+        }
+        
+        vma_t* next = vma_next(vma);
+        vma_remove(space, vma);
+        vmm_release_pages(vma->start, (vma->end - vma->start) / VMA_PAGE_SIZE);
+        
+        if (vma->ops && vma->ops->close) {
+            vma->ops->close(vma);
+        }
+        kmem_cache_free(vma_cache, vma);
+        vma = next;
+    }
+    
+    vmm_switch_address_space(old_space);
+    return ok;
+}
+
+// Initialize an empty set of areas for an address space
+void vma_space_init(vma_space_t* space, uintptr_t pml4_phys) {
+    if (!space) {
+        return;
+    }
+    
+    if (!vma_cache) {
+        vma_cache = kmem_cache_create("vma", sizeof(vma_t), 0);
+        if (!vma_cache) {
+            printf("VMA: Failed to create area cache\n");
+        }
+    }
+    
+    space->tree.root = NULL;
+    spinlock_init(&space->lock);
+    spinlock_set_name(&space->lock, "vma");
+    space->pml4_phys = pml4_phys;
+    space->count = 0;
+    space->mmap_hint = VMA_MMAP_BASE;
+}
+
+// Remove every area (the page tables are left to the address space)
+void vma_space_destroy(vma_space_t* space) {
+    if (!space) {
+        return;
+    }
+    
+    spinlock_acquire(&space->lock);
+    
+    rb_node_t* node;
+    while ((node = rb_first(&space->tree)) != NULL) {
+        vma_t* vma = vma_entry(node);
+        vma_remove(space, vma);
+        if (vma->ops && vma->ops->close) {
+            vma->ops->close(vma);
+        }
+        kmem_cache_free(vma_cache, vma);
+    }
+    space->mmap_hint = VMA_MMAP_BASE;
+    
+    spinlock_release(&space->lock);
+}
+
+// Create an area; addr is a hint unless VMA_FIXED is set
+uintptr_t vma_map(vma_space_t* space, uintptr_t addr, size_t size, uint32_t flags,
+                  const vma_ops_t* ops, void* backing, uint64_t offset, const char* name) {
+    if (!space || !vma_cache || size == 0) {
+        return 0;
+    }
+    
+    size = (size + VMA_PAGE_SIZE - 1) & ~(VMA_PAGE_SIZE - 1);
+    if ((flags & VMA_FIXED) && (addr & (VMA_PAGE_SIZE - 1))) {
+        return 0;
+    }
+    addr &= ~(VMA_PAGE_SIZE - 1);
+    
+    // Only the lower half belongs to an address space's areas
+    if (addr + size < addr || addr + size > VMA_SPACE_END) {
+        if (flags & VMA_FIXED) {
+            return 0;
+        }
+        addr = 0;
+    }
+    
+    vma_t* vma = (vma_t*)kmem_cache_alloc(vma_cache);
+    if (!vma) {
+        return 0;
+    }
+    
+    spinlock_acquire(&space->lock);
+    
+    if (flags & VMA_FIXED) {
+        // A fixed mapping replaces whatever was there
+        if (!vma_remove_range(space, addr, addr + size)) {
+            spinlock_release(&space->lock);
+            kmem_cache_free(vma_cache, vma);
+            return 0;
+        }
+    } else if (addr == 0 || !vma_range_free(space, addr, addr + size)) {
+        addr = vma_find_gap(space, space->mmap_hint, size);
+        if (addr == 0) {
+            addr = vma_find_gap(space, VMA_MMAP_BASE, size);
+        }
+        if (addr == 0) {
+            spinlock_release(&space->lock);
+            kmem_cache_free(vma_cache, vma);
+            return 0;
+        }
+        space->mmap_hint = addr + size;
+    }
+    
+    vma->start = addr;
+    vma->end = addr + size;
+    vma->flags = flags & VMA_PROT_MASK;
+    vma->ops = ops;
+    vma->backing = backing;
+    vma->offset = offset;
+    strncpy(vma->name, name ? name : "anon", sizeof(vma->name) - 1);
+    vma->name[sizeof(vma->name) - 1] = '\0';
+    vma_insert(space, vma);
+    
+    spinlock_release(&space->lock);
+    
+    return addr;
+}
+
+// Remove every area in [addr, addr + size) and release its pages
+bool vma_unmap(vma_space_t* space, uintptr_t addr, size_t size) {
+    if (!space || size == 0 || (addr & (VMA_PAGE_SIZE - 1))) {
+        return false;
+    }
+    
+    size = (size + VMA_PAGE_SIZE - 1) & ~(VMA_PAGE_SIZE - 1);
+    if (addr + size < addr) {
+        return false;
+    }
+    
+    spinlock_acquire(&space->lock);
+    bool ok = vma_remove_range(space, addr, addr + size);
+    if (ok && addr < space->mmap_hint) {
+        space->mmap_hint = addr < VMA_MMAP_BASE ? VMA_MMAP_BASE : addr;
+    }
+    spinlock_release(&space->lock);
+    
+    return ok;
+}
+
+// Change the protection of [addr, addr + size), which must be fully mapped
+bool vma_protect(vma_space_t* space, uintptr_t addr, size_t size, uint32_t flags) {
+    if (!space || size == 0 || (addr & (VMA_PAGE_SIZE - 1))) {
+        return false;
+    }
+    
+    size = (size + VMA_PAGE_SIZE - 1) & ~(VMA_PAGE_SIZE - 1);
+    uintptr_t end = addr + size;
+    if (end < addr) {
+        return false;
+    }
+    flags &= VMA_PROT_MASK;
+    
+    spinlock_acquire(&space->lock);
+    
+    // Refuse ranges with holes before changing anything
+    vma_t* first = vma_find_from(space, addr);
+    uintptr_t covered = addr;
+    for (vma_t* vma = first; vma && vma->start <= covered && covered < end; vma = vma_next(vma)) {
+        covered = vma->end;
+    }
+    if (!first || first->start > addr || covered < end) {
+        spinlock_release(&space->lock);
+        return false;
+    }
+    
+    if (!vma_split(space, first, addr)) {
+        spinlock_release(&space->lock);
+        return false;
+    }
+    vma_t* vma = first->start < addr ? vma_next(first) : first;
+    
+    uintptr_t old_space = vmm_get_current_address_space();
+    vmm_switch_address_space(space->pml4_phys);
+    
+    bool ok = true;
+    while (vma && vma->start < end) {
+        if (!vma_split(space, vma, end)) {
+            ok = false;
+            break;
+        }
+        
+        vma->flags = flags;
+        if (!vmm_protect_pages(vma->start, (vma->end - vma->start) / VMA_PAGE_SIZE,
+                               vma_page_flags(flags))) {
+            ok = false;
+            break;
+        }
+        vma = vma_next(vma);
+    }
+    
+    vmm_switch_address_space(old_space);
+    spinlock_release(&space->lock);
+    
+    return ok;
+}
+
+// Find the area covering addr
+vma_t* vma_find(vma_space_t* space, uintptr_t addr) {
+    if (!space) {
+        return NULL;
+    }
+    
+    spinlock_acquire(&space->lock);
+    vma_t* vma = vma_find_from(space, addr);
+    if (vma && vma->start > addr) {
+        vma = NULL;
+    }
+    spinlock_release(&space->lock);
+    
+    return vma;
+}
+
+// Check an access against the area's protection
+static bool vma_allows(const vma_t* vma, uint32_t error_code) {
+    if ((error_code & VMM_PF_USER) && !(vma->flags & VMA_USER)) {
+        return false;
+    }
+    if (error_code & VMM_PF_WRITE) {
+        return vma->flags & VMA_WRITE;
+    }
+    if (error_code & VMM_PF_INSTRUCTION) {
+        return vma->flags & VMA_EXEC;
+    }
+    return vma->flags & (VMA_READ | VMA_WRITE | VMA_EXEC);
+}
+
+// Give an untouched anonymous page its zeroed frame
+static bool vma_fault_anonymous(vma_t* vma, uintptr_t addr, uint32_t error_code) {
+    // Present pages are only ever wrong for protection reasons
+    if (error_code & VMM_PF_PRESENT) {
+        return false;
+    }
+    
+    uintptr_t phys = pmm_alloc_page_flags(PMM_ALLOC_ZERO | PMM_ALLOC_MOVABLE);
+    if (phys == 0) {
+        printf("VMA: Out of memory populating 0x%lx\n", addr);
+        return false;
+    }
+    pmm_page_set_owner(phys, PMM_OWNER_USER);
+    
+    if (!vmm_map_page(addr & ~(VMA_PAGE_SIZE - 1), phys, vma_page_flags(vma->flags))) {
+        pmm_page_put(phys);
+        return false;
+    }
+    
+    return true;
+}
+
+// Resolve a page fault through the area covering addr
+bool vma_handle_fault(vma_space_t* space, uintptr_t addr, uint32_t error_code) {
+    if (!space) {
+        return false;
+    }
+    
+    spinlock_acquire(&space->lock);
+    
+    vma_t* vma = vma_find_from(space, addr);
+    if (!vma || vma->start > addr || !vma_allows(vma, error_code)) {
+        spinlock_release(&space->lock);
+        return false;
+    }
+    
+    bool handled;
+    if (vma->ops && vma->ops->fault) {
+        handled = vma->ops->fault(vma, addr, error_code);
+    } else {
+        handled = vma_fault_anonymous(vma, addr, error_code);
+    }
+    
+    spinlock_release(&space->lock);
+    return handled;
+}
+
+// Debug function to print every area
+void vma_dump(vma_space_t* space) {
+    if (!space) {
+        return;
+    }
+    
+    spinlock_acquire(&space->lock);
+    
+    printf("VMA: %lu areas in address space 0x%lx\n", space->count, space->pml4_phys);
+    for (rb_node_t* node = rb_first(&space->tree); node; node = rb_next(node)) {
+        vma_t* vma = vma_entry(node);
+        printf("  0x%016lx-0x%016lx %c%c%c%c %s\n", vma->start, vma->end,
+               (vma->flags & VMA_READ) ? 'r' : '-',
+               (vma->flags & VMA_WRITE) ? 'w' : '-',
+               (vma->flags & VMA_EXEC) ? 'x' : '-',
+               (vma->flags & VMA_USER) ? 'u' : '-',
+               vma->name);
+    }
+    
+    spinlock_release(&space->lock);
+}
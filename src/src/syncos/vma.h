@@ -0,0 +1,93 @@
+#ifndef _SYNCOS_VMA_H
+#define _SYNCOS_VMA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <syncos/spinlock.h>
+#include <kstd/rbtree.h>
+
+// Virtual memory areas
+//
+// Every user address space keeps its mappings as non-overlapping, page
+// aligned areas in a red-black tree ordered by start address, so the page
+// fault path finds the area covering an address in O(log n). An area has
+// protection flags and an optional backing object with its own fault
+// handler; areas without one are anonymous memory that is zero-filled on
+// first touch. Map, unmap and protect split areas at the range boundaries.
+
+#define VMA_READ        (1U << 0)   // Readable
+#define VMA_WRITE       (1U << 1)   // Writable
+#define VMA_EXEC        (1U << 2)   // Executable
+#define VMA_USER        (1U << 3)   // Accessible from user mode
+#define VMA_FIXED       (1U << 8)   // Map exactly at the requested address
+
+#define VMA_PROT_MASK   (VMA_READ | VMA_WRITE | VMA_EXEC | VMA_USER)
+
+// Default window for areas placed by vma_map, and the end of the user half
+#define VMA_MMAP_BASE   0x0000100000000000UL
+#define VMA_MMAP_END    0x00007F0000000000UL
+#define VMA_SPACE_END   0x0000800000000000UL
+
+typedef struct vma vma_t;
+
+// Operations of a backing object
+typedef struct {
+    // A split created a new piece of an area sharing the backing object
+    void (*open)(vma_t* vma);
+    
+    // Resolve a fault at addr inside the area; false raises the fault
+    bool (*fault)(vma_t* vma, uintptr_t addr, uint32_t error_code);
+    
+    // The area (or a piece split off it) is being removed
+    void (*close)(vma_t* vma);
+} vma_ops_t;
+
+struct vma {
+    rb_node_t node;
+    uintptr_t start;           // First address
+    uintptr_t end;             // One past the last address
+    uint32_t flags;            // VMA_* protection flags
+    const vma_ops_t* ops;      // Backing object operations (NULL: anonymous)
+    void* backing;             // Backing object
+    uint64_t offset;           // Offset of start within the backing object
+    char name[16];             // Area name (for debugging)
+};
+
+// Areas of one address space
+typedef struct vma_space {
+    rb_root_t tree;
+    spinlock_t lock;
+    uintptr_t pml4_phys;       // Address space the areas describe
+    size_t count;              // Number of areas
+    uintptr_t mmap_hint;       // Where the next unplaced mapping search starts
+} vma_space_t;
+
+// Initialize an empty set of areas for an address space
+void vma_space_init(vma_space_t* space, uintptr_t pml4_phys);
+
+// Remove every area (the page tables are left to the address space)
+void vma_space_destroy(vma_space_t* space);
+
+// Create an area; addr is a hint unless VMA_FIXED is set
+// Returns the start of the area, or 0 on failure
+uintptr_t vma_map(vma_space_t* space, uintptr_t addr, size_t size, uint32_t flags,
+                  const vma_ops_t* ops, void* backing, uint64_t offset, const char* name);
+
+// Remove every area in [addr, addr + size) and release its pages
+bool vma_unmap(vma_space_t* space, uintptr_t addr, size_t size);
+
+// Change the protection of [addr, addr + size), which must be fully mapped
+bool vma_protect(vma_space_t* space, uintptr_t addr, size_t size, uint32_t flags);
+
+// Find the area covering addr (the caller must hold no expectations of it
+// surviving a concurrent unmap)
+vma_t* vma_find(vma_space_t* space, uintptr_t addr);
+
+// Resolve a page fault through the area covering addr
+bool vma_handle_fault(vma_space_t* space, uintptr_t addr, uint32_t error_code);
+
+// Debug function to print every area
+void vma_dump(vma_space_t* space);
+
+#endif // _SYNCOS_VMA_H
@@ -1,8 +1,15 @@
 #include <syncos/vmm.h>
 #include <syncos/pmm.h>
 #include <syncos/idt.h>
+#include <syncos/vrange.h>
+#include <syncos/vma.h>
+#include <syncos/slab.h>
+#include <kstd/rbtree.h>
 #include <kstd/stdio.h>
 #include <kstd/string.h>
+#include <syncos/spinlock.h>
+#include <syncos/percpu.h>
+#include <syncos/smp.h>
 #include <limine.h>
 
 // Limine HHDM and memory map requests
@@ -39,46 +46,191 @@ static volatile struct limine_kernel_address_request kernel_addr_request = {
 #define PAGE_GLOBAL         (1UL << 8)
 #define PAGE_NO_EXECUTE     (1UL << 63)
 
-// Address mask for page tables
-#define PAGE_ADDR_MASK ~0xFFFUL
+// Software-defined bit in a non-present entry: the page is reserved and gets
+// a zeroed frame with the entry's remaining flags on first access
+#define PAGE_LAZY           (1UL << 9)
 
-// Physical memory regions for dynamic allocation
-#define MAX_MEMORY_AREAS 32
+// Software-defined bit in a present entry: the frame is shared copy-on-write
+// and the entry was writable before it was write-protected for sharing
+#define PAGE_COW            (1UL << 10)
 
-typedef struct {
-    uintptr_t base;
-    size_t size;
-    bool is_used;
-    uint32_t flags;
-} memory_area_t;
+// Physical frame bits of an entry (excludes NX and software bits)
+#define PAGE_FRAME_MASK     0x000FFFFFFFFFF000UL
+
+// Start of the kernel half of the address space
+#define KERNEL_HALF_BASE    0xFFFF800000000000UL
+
+// Pages per leaf at each level
+#define PAGES_PER_2M        512UL
+#define PAGES_PER_1G        (512UL * 512UL)
+
+// Address mask for page tables
+#define PAGE_ADDR_MASK ~0xFFFUL
 
 // VMM configuration and state
 static vmm_config_t vmm_config;
 static uint64_t hhdm_offset;
+static uint64_t hhdm_end;
 static uintptr_t kernel_phys_base;
 static uintptr_t kernel_virt_base;
-static uintptr_t current_pml4_phys;
 
-// Virtual memory areas for allocation
-static memory_area_t user_areas[MAX_MEMORY_AREAS];
-static memory_area_t kernel_areas[MAX_MEMORY_AREAS];
-static int user_area_count = 0;
-static int kernel_area_count = 0;
+// Address space loaded on each CPU
+static uintptr_t cpu_pml4_phys[PERCPU_MAX_CPUS];
+#define current_pml4_phys (cpu_pml4_phys[percpu_current_id()])
+
+// Virtual address ranges for vmm_allocate
+static vrange_arena_t kernel_arena;
+static vrange_arena_t user_arena;
+
+// Physical ranges mapped into the MMIO window, indexed by physical and
+// virtual address; a mapping is shared by every caller asking for a range
+// it covers with the same flags
+typedef struct {
+    rb_node_t phys_node;
+    rb_node_t virt_node;
+    uintptr_t phys;            // Page-aligned physical base
+    uintptr_t virt;            // Base in the MMIO window
+    size_t size;               // Mapped bytes
+    uint64_t flags;            // Mapping flags, including the cache type
+    uint32_t refs;             // Callers sharing the mapping
+} io_mapping_t;
+
+// Flags that select the memory type of a mapping
+#define VMM_CACHE_MASK (VMM_FLAG_WRITETHROUGH | VMM_FLAG_NOCACHE | VMM_FLAG_WC)
+
+static vrange_arena_t io_arena;
+static rb_root_t io_by_phys = RB_ROOT_INIT;
+static rb_root_t io_by_virt = RB_ROOT_INIT;
+static spinlock_t io_lock;
+static kmem_cache_t* io_cache = NULL;
+
+// Page-table pages
+//
+// Table pages are handed out from a small pool of zeroed frames, so a new
+// table level costs neither a PMM call nor a clear. The pool is fed by the
+// reaper, which clears the tables of dead address spaces as it takes them
+// apart, and topped up from the PMM in idle time. Dead address spaces wait
+// on a list of their own nodes; the private field of a PML4 descriptor
+// holds its PCID tag.
+#define PT_POOL_SIZE        64
+
+static uintptr_t pt_pool[PT_POOL_SIZE];
+static uint32_t pt_pool_count = 0;
+static spinlock_t pt_pool_lock;
+
+typedef struct dead_space {
+    uintptr_t pml4_phys;
+    struct dead_space* next;
+} dead_space_t;
+
+static dead_space_t* dead_spaces = NULL; // Address spaces waiting for the reaper
+static spinlock_t dead_spaces_lock;
+static kmem_cache_t* dead_space_cache = NULL;
+static uintptr_t reap_pml4 = 0;         // Address space being torn down
+static size_t reap_slot = 0;            // Next PML4 slot to tear down
+
+// Kernel translation cache
+//
+// Kernel-half addresses outside the direct map (the heap window, the MMIO
+// window, the kernel image) are translated through a small direct-mapped
+// per-CPU cache of 4KB translations in front of the page-table walk.
+// Kernel-half tables are shared by every address space, so entries need no
+// address space tag. Any change to a present kernel-half entry bumps the
+// shared epoch, which drops every cached translation on every CPU at once.
+#define XLATE_CACHE_SIZE    64
+
+typedef struct {
+    uintptr_t page;            // Virtual page
+    uintptr_t frame;           // Physical frame behind it
+    uint64_t epoch;            // Epoch the translation was cached in
+} xlate_entry_t;
+
+static xlate_entry_t xlate_cache[PERCPU_MAX_CPUS][XLATE_CACHE_SIZE];
+static volatile uint64_t xlate_epoch = 1;
+
+// Areas of the process running on each CPU, for faults outside the page tables
+static vma_space_t* cpu_vma_space[PERCPU_MAX_CPUS];
+#define current_vma_space (cpu_vma_space[percpu_current_id()])
 
 // Statistics for memory usage
-static struct {
-    size_t pages_allocated;
-    size_t pages_freed;
-    size_t page_faults_handled;
-} vmm_stats = {0};
+static vmm_stats_t vmm_stats = {0};
+
+// Process-context identifiers
+//
+// Each address space is tagged with a PCID so its TLB entries survive while
+// other address spaces run. The tag lives in the private field of the PML4
+// frame descriptor as (generation << 12) | pcid. When the 4095 usable PCIDs
+// run out a new generation starts; a PCID is always loaded with a flushing
+// CR3 write the first time it is used in a generation, so stale entries left
+// by its previous owner never survive. PCID 0 is used, and flushed on every
+// switch, for address spaces without a frame descriptor. PCIDs are shared by
+// all CPUs, so a CPU that first switches in a new generation drops all its
+// entries, including those of PCIDs loaded elsewhere.
+#define PCID_COUNT          4096
+#define CR3_NOFLUSH         (1UL << 63)
+#define CR4_PCIDE           (1UL << 17)
+#define CR4_PGE             (1UL << 7)
+#define MSR_EFER            0xC0000080
+#define EFER_NXE            (1UL << 11)
+
+// Page attribute table
+//
+// The memory type of a mapping is picked by its PWT, PCD and PAT bits. The
+// layout keeps Limine's entries (WB, WT, -, UC, WP, WC) so the boot mappings
+// keep their types, and turns entry 2 (PCD alone) into write-combining so WC
+// needs no PAT bit, whose position differs between 4KB and huge leaves.
+//   0 WB   1 WT   2 WC   3 UC   4 WP   5 WC   6 UC-   7 UC
+#define MSR_PAT             0x277
+#define PAT_UC              0x00UL
+#define PAT_WC              0x01UL
+#define PAT_WT              0x04UL
+#define PAT_WP              0x05UL
+#define PAT_WB              0x06UL
+#define PAT_UC_MINUS        0x07UL
+#define PAT_LAYOUT          (PAT_WB | (PAT_WT << 8) | (PAT_WC << 16) | (PAT_UC << 24) | \
+                             (PAT_WP << 32) | (PAT_WC << 40) | (PAT_UC_MINUS << 48) | (PAT_UC << 56))
+
+static bool pcid_enabled = false;
+static bool pge_enabled = false;
+static bool huge_1g_supported = false;
+static uint64_t pcid_generation = 1;
+static uint64_t pcid_next = 1;
+static uint64_t kernel_pcid_tag = 0;    // Tag of the boot address space
+static spinlock_t pcid_lock;
+static uint64_t cpu_pcid_generation[PERCPU_MAX_CPUS];  // Generation each CPU last flushed in
 
 // Forward declarations
 static void* phys_to_virt(uintptr_t phys);
 static uintptr_t virt_to_phys(void* virt);
+static uintptr_t walk_physical(uintptr_t addr);
 static bool map_page_internal(uintptr_t pml4_phys, uintptr_t virt, uintptr_t phys, uint64_t flags);
-static void register_memory_area(memory_area_t* areas, int* count, uintptr_t base, size_t size, uint32_t flags);
 static void page_fault_handler(uint64_t error_code, uint64_t rip);
 
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    __asm__ volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t low, high;
+    __asm__ volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+    return ((uint64_t)high << 32) | low;
+}
+
+// Disable interrupts, returning the previous RFLAGS; the pool and the dead
+// list are used from fault and exit paths as well as from idle context
+static inline uint64_t vmm_irq_save(void) {
+    uint64_t rflags;
+    __asm__ volatile("pushfq; popq %0; cli" : "=r"(rflags) : : "memory");
+    return rflags;
+}
+
+// Restore the interrupt flag saved by vmm_irq_save
+static inline void vmm_irq_restore(uint64_t rflags) {
+    if (rflags & (1 << 9)) {
+        __asm__ volatile("sti" : : : "memory");
+    }
+}
+
 // Read CR3 register
 static inline uintptr_t read_cr3(void) {
     uintptr_t cr3;
@@ -91,27 +243,243 @@ static inline void write_cr3(uintptr_t cr3) {
     __asm__ volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
 }
 
+// Read CR4 register
+static inline uint64_t read_cr4(void) {
+    uint64_t cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    return cr4;
+}
+
+// Write CR4 register
+static inline void write_cr4(uint64_t cr4) {
+    __asm__ volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+}
+
+// Retire every PCID handed out so far; each address space gets a fresh,
+// flushed PCID on its next switch. Called with pcid_lock held.
+static inline void pcid_new_generation_locked(void) {
+    pcid_generation++;
+    pcid_next = 1;
+    vmm_stats.pcid_generations++;
+}
+
+static void pcid_new_generation(void) {
+    uint64_t rflags = vmm_irq_save();
+    spinlock_acquire(&pcid_lock);
+    pcid_new_generation_locked();
+    spinlock_release(&pcid_lock);
+    vmm_irq_restore(rflags);
+}
+
+// Drop every TLB entry of this CPU, global ones and those of every PCID
+static inline void flush_tlb_all_pcids(void) {
+    uint64_t cr4 = read_cr4();
+    write_cr4(cr4 ^ CR4_PGE);
+    write_cr4(cr4);
+}
+
 // Invalidate TLB entry
 static inline void invlpg(uintptr_t addr) {
     __asm__ volatile("invlpg (%0)" : : "r"(addr) : "memory");
 }
 
+// Drop the cached translation of an entry that was just changed
+static inline void flush_entry(uintptr_t addr, uint64_t old_entry) {
+    // Non-present entries are never cached
+    if (!(old_entry & PAGE_PRESENT)) {
+        return;
+    }
+    
+    invlpg(addr);
+    
+    if (addr >= KERNEL_HALF_BASE) {
+        __atomic_fetch_add(&xlate_epoch, 1, __ATOMIC_RELEASE);
+    }
+    
+    // Kernel-half tables are shared by every address space, but invlpg only
+    // reaches the current PCID and global entries
+    if (pcid_enabled && addr >= KERNEL_HALF_BASE && !(old_entry & PAGE_GLOBAL)) {
+        pcid_new_generation();
+    }
+    
+    // Other CPUs may be running on the same tables
+    smp_tlb_shootdown();
+}
+
+// TLB invalidations collected by a range operation and issued once it is
+// done. Up to TLB_BATCH_MAX pages are invalidated one by one; beyond that
+// a single full flush is cheaper.
+#define TLB_BATCH_MAX 32
+
+typedef struct {
+    uintptr_t addrs[TLB_BATCH_MAX];
+    size_t count;
+    bool overflow;             // Too many pages, flush everything
+    bool global;               // A global entry changed
+    bool kernel_shared;        // A non-global kernel entry changed
+} tlb_batch_t;
+
+static inline void tlb_batch_init(tlb_batch_t* batch) {
+    batch->count = 0;
+    batch->overflow = false;
+    batch->global = false;
+    batch->kernel_shared = false;
+}
+
+// Record an entry that was just changed
+static inline void tlb_batch_add(tlb_batch_t* batch, uintptr_t addr, uint64_t old_entry) {
+    // Non-present entries are never cached
+    if (!(old_entry & PAGE_PRESENT)) {
+        return;
+    }
+    
+    if (old_entry & PAGE_GLOBAL) {
+        batch->global = true;
+    } else if (addr >= KERNEL_HALF_BASE) {
+        batch->kernel_shared = true;
+    }
+    
+    if (addr >= KERNEL_HALF_BASE) {
+        __atomic_fetch_add(&xlate_epoch, 1, __ATOMIC_RELEASE);
+    }
+    
+    if (batch->count < TLB_BATCH_MAX) {
+        batch->addrs[batch->count++] = addr;
+    } else {
+        batch->overflow = true;
+    }
+}
+
+// Issue the invalidations of a batch
+static void tlb_batch_flush(tlb_batch_t* batch) {
+    bool changed = batch->count > 0 || batch->overflow;
+    
+    if (batch->overflow && batch->global) {
+        // Toggling PGE drops every entry, global or not, for all PCIDs
+        flush_tlb_all_pcids();
+        vmm_stats.tlb_full_flushes++;
+    } else {
+        if (batch->overflow) {
+            write_cr3(read_cr3() & ~CR3_NOFLUSH);
+            vmm_stats.tlb_full_flushes++;
+        } else {
+            for (size_t i = 0; i < batch->count; i++) {
+                invlpg(batch->addrs[i]);
+            }
+            vmm_stats.tlb_page_flushes += batch->count;
+        }
+        
+        // Non-global kernel entries may also be cached under other PCIDs
+        if (pcid_enabled && batch->kernel_shared) {
+            pcid_new_generation();
+        }
+    }
+    
+    if (changed) {
+        smp_tlb_shootdown();
+    }
+    
+    tlb_batch_init(batch);
+}
+
+// Find the PCID tag of an address space (NULL if it cannot have one)
+static uint64_t* pcid_tag(uintptr_t pml4_phys) {
+    if (pml4_phys == vmm_config.kernel_pml4) {
+        return &kernel_pcid_tag;
+    }
+    
+    page_t* page = pmm_get_page(pml4_phys);
+    if (page && page->owner == PMM_OWNER_PAGE_TABLE) {
+        return &page->private;
+    }
+    return NULL;
+}
+
+// Build the CR3 value that switches to an address space. Called with
+// pcid_lock held.
+static uintptr_t pcid_cr3(uintptr_t pml4_phys) {
+    uint64_t* tag = pcid_tag(pml4_phys);
+    if (!tag) {
+        return pml4_phys;
+    }
+    
+    // Still valid: keep the cached translations
+    if ((*tag >> 12) == pcid_generation) {
+        vmm_stats.switches_noflush++;
+        return pml4_phys | (*tag & 0xFFF) | CR3_NOFLUSH;
+    }
+    
+    if (pcid_next == PCID_COUNT) {
+        pcid_new_generation_locked();
+    }
+    
+    uint64_t pcid = pcid_next++;
+    *tag = (pcid_generation << 12) | pcid;
+    return pml4_phys | pcid;
+}
+
+// Forget the PCID of an address space whose tables changed while it was
+// not running; its next switch flushes
+static void pcid_invalidate(uintptr_t pml4_phys) {
+    uint64_t* tag = pcid_tag(pml4_phys);
+    if (tag) {
+        *tag = 0;
+    }
+}
+
 // Convert physical address to virtual using Limine's HHDM
 static void* phys_to_virt(uintptr_t phys) {
     if (phys == 0) return NULL;
     return (void*)(phys + hhdm_offset);
 }
 
+// Check whether an address lies in the higher half direct map
+// (the kernel heap and image live above it)
+static inline bool in_hhdm(uintptr_t addr) {
+    return addr >= hhdm_offset && addr < hhdm_end;
+}
+
 // Convert virtual address to physical
 static uintptr_t virt_to_phys(void* virt) {
     uintptr_t addr = (uintptr_t)virt;
     
     // Handle higher half direct mapping
-    if (addr >= hhdm_offset) {
+    if (in_hhdm(addr)) {
         return addr - hhdm_offset;
     }
     
-    // For other addresses, walk the page tables
+    if (addr < KERNEL_HALF_BASE) {
+        return walk_physical(addr);
+    }
+    
+    // Kernel addresses go through the translation cache; interrupts stay
+    // off so a handler cannot see a half-written entry
+    uintptr_t page = addr & PAGE_ADDR_MASK;
+    uint64_t rflags = vmm_irq_save();
+    xlate_entry_t* entry = &xlate_cache[percpu_current_id()][(page >> 12) % XLATE_CACHE_SIZE];
+    uint64_t epoch = __atomic_load_n(&xlate_epoch, __ATOMIC_ACQUIRE);
+    
+    if (entry->page == page && entry->epoch == epoch) {
+        uintptr_t frame = entry->frame;
+        vmm_irq_restore(rflags);
+        vmm_stats.xlate_hits++;
+        return frame + (addr & 0xFFF);
+    }
+    
+    uintptr_t phys = walk_physical(addr);
+    if (phys != 0) {
+        entry->page = page;
+        entry->frame = phys & PAGE_ADDR_MASK;
+        entry->epoch = epoch;
+    }
+    vmm_irq_restore(rflags);
+    
+    vmm_stats.xlate_misses++;
+    return phys;
+}
+
+// Translate an address by walking the current page tables
+static uintptr_t walk_physical(uintptr_t addr) {
     uintptr_t pml4_idx = PML4_INDEX(addr);
     uintptr_t pdpt_idx = PDPT_INDEX(addr);
     uintptr_t pd_idx = PD_INDEX(addr);
@@ -129,7 +497,7 @@ static uintptr_t virt_to_phys(void* virt) {
     
     // Check for 1GB page
     if (pdpt[pdpt_idx] & PAGE_HUGE) {
-        return (pdpt[pdpt_idx] & PAGE_ADDR_MASK) + (addr & 0x3FFFFFFF);
+        return (pdpt[pdpt_idx] & PAGE_FRAME_MASK & ~0x3FFFFFFFUL) + (addr & 0x3FFFFFFF);
     }
     
     uint64_t* pd = (uint64_t*)phys_to_virt(pdpt[pdpt_idx] & PAGE_ADDR_MASK);
@@ -139,7 +507,7 @@ static uintptr_t virt_to_phys(void* virt) {
     
     // Check for 2MB page
     if (pd[pd_idx] & PAGE_HUGE) {
-        return (pd[pd_idx] & PAGE_ADDR_MASK) + (addr & 0x1FFFFF);
+        return (pd[pd_idx] & PAGE_FRAME_MASK & ~0x1FFFFFUL) + (addr & 0x1FFFFF);
     }
     
     uint64_t* pt = (uint64_t*)phys_to_virt(pd[pd_idx] & PAGE_ADDR_MASK);
@@ -148,21 +516,189 @@ static uintptr_t virt_to_phys(void* virt) {
     }
     
     // 4KB page
-    return (pt[pt_idx] & PAGE_ADDR_MASK) + (addr & 0xFFF);
+    return (pt[pt_idx] & PAGE_FRAME_MASK) + (addr & 0xFFF);
 }
 
 // Create a new page table
 static uintptr_t create_page_table(void) {
-    uintptr_t page = pmm_alloc_page();
-    if (page == 0) {
-        return 0;
+    uintptr_t page = 0;
+    
+    uint64_t rflags = vmm_irq_save();
+    spinlock_acquire(&pt_pool_lock);
+    if (pt_pool_count > 0) {
+        page = pt_pool[--pt_pool_count];
+    }
+    spinlock_release(&pt_pool_lock);
+    vmm_irq_restore(rflags);
+    
+    if (page != 0) {
+        vmm_stats.pt_pool_hits++;
+    } else {
+        // Page tables must start out empty; take a frame from the pre-zeroed pool
+        vmm_stats.pt_pool_misses++;
+        page = pmm_alloc_page_flags(PMM_ALLOC_ZERO);
+        if (page == 0) {
+            return 0;
+        }
+        pmm_page_set_owner(page, PMM_OWNER_PAGE_TABLE);
     }
     
-    // Clear the page
-    memset(phys_to_virt(page), 0, PAGE_SIZE_4K);
+    // A recycled PML4 must not inherit its old PCID tag
+    page_t* desc = pmm_get_page(page);
+    if (desc) {
+        desc->private = 0;
+    }
     return page;
 }
 
+// Give back a table page, which the caller has cleared
+static void free_page_table(uintptr_t page) {
+    uint64_t rflags = vmm_irq_save();
+    spinlock_acquire(&pt_pool_lock);
+    bool pooled = pt_pool_count < PT_POOL_SIZE;
+    if (pooled) {
+        pt_pool[pt_pool_count++] = page;
+    }
+    spinlock_release(&pt_pool_lock);
+    vmm_irq_restore(rflags);
+    
+    if (!pooled) {
+        pmm_free_page(page);
+    }
+}
+
+// Give a non-present entry a new, empty table. Tables are created without
+// a lock, so another CPU may install one in the same entry at the same
+// time; the entry is set with a compare-and-swap and the losing table goes
+// back to the pool. Returns false if no table could be allocated.
+static bool install_table(uint64_t* entry, uintptr_t virt) {
+    uintptr_t table = create_page_table();
+    if (table == 0) {
+        return false;
+    }
+    
+    uint64_t value = table | PAGE_PRESENT | PAGE_WRITABLE;
+    if (virt < 0x8000000000000000UL) {
+        value |= PAGE_USER;
+    }
+    
+    uint64_t expected = *entry;
+    if ((expected & PAGE_PRESENT) ||
+        !__atomic_compare_exchange_n(entry, &expected, value, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free_page_table(table);
+    }
+    return true;
+}
+
+// Find the entry for virt depth levels below the PML4 (1 = PDPT entry,
+// 2 = PD entry, 3 = PT entry), optionally creating the tables above it
+// Returns NULL if a table is missing or a huge page covers the address
+static uint64_t* walk_entry(uintptr_t pml4_phys, uintptr_t virt, int depth, bool create) {
+    uint64_t* table = (uint64_t*)phys_to_virt(pml4_phys);
+    unsigned int shifts[4] = { 39, 30, 21, 12 };
+    
+    for (int level = 0; level < depth; level++) {
+        uint64_t* entry = &table[(virt >> shifts[level]) & 0x1FF];
+        
+        if (!(*entry & PAGE_PRESENT)) {
+            if (!create) {
+                return NULL;
+            }
+            
+            if (!install_table(entry, virt)) {
+                return NULL;
+            }
+        }
+        
+        if (*entry & PAGE_HUGE) {
+            return NULL;
+        }
+        
+        table = (uint64_t*)phys_to_virt(*entry & PAGE_ADDR_MASK);
+    }
+    
+    return &table[(virt >> shifts[depth]) & 0x1FF];
+}
+
+// Find the 4KB entry for virt
+static inline uint64_t* walk_pte(uintptr_t pml4_phys, uintptr_t virt, bool create) {
+    return walk_entry(pml4_phys, virt, 3, create);
+}
+
+// Split a 2MB user leaf back into 4KB entries mapping the same frames
+// Every frame of a collapsed leaf is a separately counted user frame, so the
+// entries can be released or shared one by one afterwards
+static bool split_huge_pmd(uintptr_t pml4_phys, uint64_t* pde, uintptr_t virt) {
+    uint64_t entry = *pde;
+    uintptr_t table = create_page_table();
+    if (table == 0) {
+        return false;
+    }
+    
+    uint64_t* pt = (uint64_t*)phys_to_virt(table);
+    uintptr_t frame = entry & PAGE_FRAME_MASK & ~(PAGE_SIZE_2M - 1);
+    uint64_t flags = entry & ~PAGE_FRAME_MASK & ~PAGE_HUGE;
+    for (size_t i = 0; i < PAGES_PER_2M; i++) {
+        pt[i] = (frame + i * PAGE_SIZE_4K) | flags;
+    }
+    
+    // The translations stay the same, only the leaf size changes
+    *pde = table | PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER;
+    if (pml4_phys == current_pml4_phys) {
+        invlpg(virt & ~(PAGE_SIZE_2M - 1));
+    }
+    
+    vmm_stats.thp_splits++;
+    return true;
+}
+
+// Split the 2MB user leaf covering virt, if there is one
+static bool split_user_pmd(uintptr_t pml4_phys, uintptr_t virt) {
+    if (virt >= KERNEL_HALF_BASE) {
+        return true;
+    }
+    
+    uint64_t* pde = walk_entry(pml4_phys, virt, 2, false);
+    if (!pde || (*pde & (PAGE_PRESENT | PAGE_HUGE)) != (PAGE_PRESENT | PAGE_HUGE)) {
+        return true;
+    }
+    return split_huge_pmd(pml4_phys, pde, virt);
+}
+
+// Translate VMM flags to hardware flags for a mapping at virt
+static uint64_t hw_flags_from(uint64_t flags, uintptr_t virt) {
+    uint64_t hw_flags = PAGE_PRESENT;
+    
+    // Kernel mappings are the same in every address space, so they can
+    // stay in the TLB across switches
+    if (virt >= KERNEL_HALF_BASE && pge_enabled) {
+        hw_flags |= PAGE_GLOBAL;
+    }
+    
+    if (flags & VMM_FLAG_WRITABLE)     hw_flags |= PAGE_WRITABLE;
+    if (flags & VMM_FLAG_USER)         hw_flags |= PAGE_USER;
+    // Memory type through the PAT entry selected by PWT and PCD; uncached
+    // wins over write-combining, which wins over write-through
+    if (flags & VMM_FLAG_NOCACHE) {
+        hw_flags |= PAGE_CACHE_DISABLE | PAGE_WRITETHROUGH;
+    } else if (flags & VMM_FLAG_WC) {
+        hw_flags |= vmm_config.using_pat ? PAGE_CACHE_DISABLE
+                                         : PAGE_CACHE_DISABLE | PAGE_WRITETHROUGH;
+    } else if (flags & VMM_FLAG_WRITETHROUGH) {
+        hw_flags |= PAGE_WRITETHROUGH;
+    }
+    if (flags & VMM_FLAG_GLOBAL)       hw_flags |= PAGE_GLOBAL;
+    if (flags & VMM_FLAG_HUGE)         hw_flags |= PAGE_HUGE;
+    
+    // NX bit
+    if ((flags & VMM_FLAG_NO_EXECUTE) && vmm_config.using_nx) {
+        hw_flags |= PAGE_NO_EXECUTE;
+    }
+    
+    return hw_flags;
+}
+
 // Map a page in the specified page table
 static bool map_page_internal(uintptr_t pml4_phys, uintptr_t virt, uintptr_t phys, uint64_t flags) {
     if (!pml4_phys || !virt || !phys) {
@@ -185,17 +721,8 @@ static bool map_page_internal(uintptr_t pml4_phys, uintptr_t virt, uintptr_t phy
     uintptr_t pt_idx = PT_INDEX(virt);
     
     // Ensure PDPT exists
-    if (!(pml4[pml4_idx] & PAGE_PRESENT)) {
-        uintptr_t pdpt_phys = create_page_table();
-        if (pdpt_phys == 0) {
-            return false;
-        }
-        pml4[pml4_idx] = pdpt_phys | PAGE_PRESENT | PAGE_WRITABLE;
-        
-        // Add USER flag for user pages (lower half)
-        if (virt < 0x8000000000000000UL) {
-            pml4[pml4_idx] |= PAGE_USER;
-        }
+    if (!(pml4[pml4_idx] & PAGE_PRESENT) && !install_table(&pml4[pml4_idx], virt)) {
+        return false;
     }
     
     // Get PDPT
@@ -207,23 +734,15 @@ static bool map_page_internal(uintptr_t pml4_phys, uintptr_t virt, uintptr_t phy
     // Handle 1GB pages
     if ((flags & VMM_FLAG_HUGE) && ((virt & 0x3FFFFFFF) == 0) && ((phys & 0x3FFFFFFF) == 0)) {
         // 1GB alignment
+        uint64_t old = pdpt[pdpt_idx];
         pdpt[pdpt_idx] = phys | flags | PAGE_HUGE;
-        invlpg(virt);
+        flush_entry(virt, old);
         return true;
     }
     
     // Ensure PD exists
-    if (!(pdpt[pdpt_idx] & PAGE_PRESENT)) {
-        uintptr_t pd_phys = create_page_table();
-        if (pd_phys == 0) {
-            return false;
-        }
-        pdpt[pdpt_idx] = pd_phys | PAGE_PRESENT | PAGE_WRITABLE;
-        
-        // Add USER flag for user pages
-        if (virt < 0x8000000000000000UL) {
-            pdpt[pdpt_idx] |= PAGE_USER;
-        }
+    if (!(pdpt[pdpt_idx] & PAGE_PRESENT) && !install_table(&pdpt[pdpt_idx], virt)) {
+        return false;
     }
     
     // Get PD
@@ -235,23 +754,15 @@ static bool map_page_internal(uintptr_t pml4_phys, uintptr_t virt, uintptr_t phy
     // Handle 2MB pages
     if ((flags & VMM_FLAG_HUGE) && ((virt & 0x1FFFFF) == 0) && ((phys & 0x1FFFFF) == 0)) {
         // 2MB alignment
+        uint64_t old = pd[pd_idx];
         pd[pd_idx] = phys | flags | PAGE_HUGE;
-        invlpg(virt);
+        flush_entry(virt, old);
         return true;
     }
     
     // Ensure PT exists
-    if (!(pd[pd_idx] & PAGE_PRESENT)) {
-        uintptr_t pt_phys = create_page_table();
-        if (pt_phys == 0) {
-            return false;
-        }
-        pd[pd_idx] = pt_phys | PAGE_PRESENT | PAGE_WRITABLE;
-        
-        // Add USER flag for user pages
-        if (virt < 0x8000000000000000UL) {
-            pd[pd_idx] |= PAGE_USER;
-        }
+    if (!(pd[pd_idx] & PAGE_PRESENT) && !install_table(&pd[pd_idx], virt)) {
+        return false;
     }
     
     // Get PT
@@ -260,37 +771,82 @@ static bool map_page_internal(uintptr_t pml4_phys, uintptr_t virt, uintptr_t phy
         return false;
     }
     
-    // Set the page entry
-    pt[pt_idx] = phys | flags;
+    // Set the page entry; bit 7 of a 4KB entry selects a PAT entry, not a size
+    uint64_t old = pt[pt_idx];
+    pt[pt_idx] = phys | (flags & ~PAGE_HUGE);
     
     // Invalidate TLB
-    invlpg(virt);
+    flush_entry(virt, old);
     
     return true;
 }
 
-// Register a memory area for dynamic allocation
-static void register_memory_area(memory_area_t* areas, int* count, uintptr_t base, size_t size, uint32_t flags) {
-    if (*count >= MAX_MEMORY_AREAS) {
-        printf("VMM: Too many memory areas\n");
-        return;
+// Pick the arena an address belongs to
+static vrange_arena_t* arena_for(uintptr_t virt) {
+    if (vrange_contains(&kernel_arena, virt)) {
+        return &kernel_arena;
     }
-    
-    areas[*count].base = base;
-    areas[*count].size = size;
-    areas[*count].flags = flags;
-    areas[*count].is_used = false;
-    (*count)++;
+    if (vrange_contains(&user_arena, virt)) {
+        return &user_arena;
+    }
+    return NULL;
 }
 
-// Find a free memory area of the requested size
-static memory_area_t* find_free_area(memory_area_t* areas, int count, size_t size, uint32_t flags) {
-    for (int i = 0; i < count; i++) {
-        if (!areas[i].is_used && areas[i].size >= size) {
-            return &areas[i];
+// Unmap and release the first page_count pages of an allocation
+// The first pass makes the entries non-present but keeps their frames, so
+// that no frame is released while a stale translation may still point at it
+// With user_only, frames not owned by user space are unmapped but kept
+static void release_pages(uintptr_t base, size_t page_count, bool user_only) {
+    tlb_batch_t batch;
+    tlb_batch_init(&batch);
+    
+    for (int pass = 0; pass < 2; pass++) {
+        size_t i = 0;
+        while (i < page_count) {
+            uintptr_t virt = base + i * PAGE_SIZE_4K;
+            size_t run = PAGES_PER_2M - PT_INDEX(virt);
+            if (run > page_count - i) {
+                run = page_count - i;
+            }
+            
+            // Collapsed user ranges go back to 4KB entries first
+            if (pass == 0) {
+                split_user_pmd(current_pml4_phys, virt);
+            }
+            
+            uint64_t* pte = walk_pte(current_pml4_phys, virt, false);
+            for (size_t j = 0; pte && j < run; j++) {
+                uint64_t entry = pte[j];
+                
+                if (pass == 0) {
+                    // Pages that were never touched only lose their reservation
+                    if (entry & PAGE_PRESENT) {
+                        pte[j] = entry & ~PAGE_PRESENT & ~PAGE_LAZY;
+                        tlb_batch_add(&batch, virt + j * PAGE_SIZE_4K, entry);
+                    } else {
+                        pte[j] = 0;
+                    }
+                } else if (entry) {
+                    // Drop this mapping's reference; shared frames outlive it
+                    uintptr_t frame = entry & PAGE_FRAME_MASK;
+                    pte[j] = 0;
+                    if (user_only) {
+                        page_t* page = pmm_get_page(frame);
+                        if (!page || page->owner != PMM_OWNER_USER) {
+                            continue;
+                        }
+                    }
+                    pmm_page_put(frame);
+                }
+            }
+            
+            i += run;
+        }
+        
+        if (pass == 0) {
+            tlb_batch_flush(&batch);
         }
     }
-    return NULL;
 }
 
 // Page fault handler
@@ -342,6 +898,11 @@ void vmm_init(void) {
         hhdm_offset = 0xffff800000000000UL;
     }
     
+    // The direct map covers all of physical memory and at least the low 4GB
+    pmm_config_t pmm_info;
+    pmm_get_info(&pmm_info);
+    hhdm_end = hhdm_offset + (pmm_info.kernel_end > 0x100000000UL ? pmm_info.kernel_end : 0x100000000UL);
+    
     // Get kernel address info
     if (kernel_addr_request.response) {
         kernel_phys_base = kernel_addr_request.response->physical_base;
@@ -367,26 +928,104 @@ void vmm_init(void) {
     uint32_t eax, ebx, ecx, edx;
     __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000001));
     vmm_config.using_nx = (edx & (1 << 20)) != 0;
+    huge_1g_supported = (edx & (1 << 26)) != 0;
     printf("NX bit %s\n", vmm_config.using_nx ? "supported" : "not supported");
     
+    // Tag TLB entries with PCIDs if supported; PCIDE can only be set while
+    // the current PCID is 0
+    __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+    
+    // Add a write-combining memory type; nothing cached or in the TLB may
+    // keep a type from the old layout
+    if (edx & (1 << 16)) {
+        __asm__ volatile("wbinvd" ::: "memory");
+        wrmsr(MSR_PAT, PAT_LAYOUT);
+        write_cr3(read_cr3());
+        vmm_config.using_pat = true;
+    }
+    printf("PAT %s\n", vmm_config.using_pat ? "programmed with write-combining" : "not supported");
+    
+    // Global pages keep kernel translations across address space switches
+    if (edx & (1 << 13)) {
+        write_cr4(read_cr4() | CR4_PGE);
+        pge_enabled = true;
+    }
+    
+    if ((ecx & (1 << 17)) && (read_cr3() & 0xFFF) == 0) {
+        write_cr4(read_cr4() | CR4_PCIDE);
+        pcid_enabled = true;
+    }
+    vmm_config.using_pcid = pcid_enabled;
+    printf("PCID %s\n", pcid_enabled ? "enabled" : "not supported");
+    
     // Register page fault handler
     idt_register_exception_handler(14, page_fault_handler);
     
-    // Set up memory areas for kernel
-    register_memory_area(kernel_areas, &kernel_area_count, 
-                        hhdm_offset + 0x10000000, // Start at 256MB physical
-                        0x10000000, // 256MB size
-                        VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE);
+    // The kernel heap lives in its own PML4 slot outside the direct map.
+    // Create its PDPT now so every address space copied from this one
+    // shares the heap mappings made later.
+    uint64_t* pml4 = (uint64_t*)phys_to_virt(current_pml4_phys);
+    if (!(pml4[PML4_INDEX(VMM_KERNEL_HEAP_BASE)] & PAGE_PRESENT)) {
+        uintptr_t pdpt_phys = create_page_table();
+        if (pdpt_phys) {
+            pml4[PML4_INDEX(VMM_KERNEL_HEAP_BASE)] = pdpt_phys | PAGE_PRESENT | PAGE_WRITABLE;
+        }
+    }
+    
+    // Set up virtual address ranges for kernel and user allocations
+    if (!vrange_init(&kernel_arena, "vmm_kernel", VMM_KERNEL_HEAP_BASE, VMM_KERNEL_HEAP_SIZE) ||
+        !vrange_init(&user_arena, "vmm_user", VMM_USER_HEAP_BASE, VMM_USER_HEAP_SIZE) ||
+        !vrange_init(&io_arena, "vmm_mmio", MMIO_BASE, MMIO_SIZE)) {
+        printf("VMM: Failed to set up virtual address ranges\n");
+    }
     
-    // Set up memory areas for user mode
-    register_memory_area(user_areas, &user_area_count,
-                        0x400000, // Start at 4MB
-                        0x10000000, // 256MB size
-                        VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_USER);
+    spinlock_init(&pt_pool_lock);
+    spinlock_set_name(&pt_pool_lock, "vmm_pt_pool");
+    spinlock_init(&dead_spaces_lock);
+    spinlock_set_name(&dead_spaces_lock, "vmm_dead_spaces");
+    spinlock_init(&io_lock);
+    spinlock_set_name(&io_lock, "vmm_mmio");
+    spinlock_init(&pcid_lock);
+    spinlock_set_name(&pcid_lock, "vmm_pcid");
+    io_cache = kmem_cache_create("io_mapping", sizeof(io_mapping_t), 0);
+    if (!io_cache) {
+        printf("VMM: Failed to create MMIO mapping cache\n");
+    }
+    dead_space_cache = kmem_cache_create("vmm_dead_space", sizeof(dead_space_t), 0);
+    if (!dead_space_cache) {
+        printf("VMM: Failed to create dead address space cache\n");
+    }
     
     printf("VMM initialized successfully\n");
 }
 
+// Move an application processor onto the kernel page tables, with the
+// paging features vmm_init turned on for the bootstrap processor
+void vmm_init_cpu(void) {
+    if (vmm_config.using_nx) {
+        wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_NXE);
+    }
+    
+    if (vmm_config.using_pat) {
+        __asm__ volatile("wbinvd" ::: "memory");
+        wrmsr(MSR_PAT, PAT_LAYOUT);
+    }
+    
+    if (pge_enabled) {
+        write_cr4(read_cr4() | CR4_PGE);
+    }
+    
+    // The bootloader's tables may be reclaimed; PCIDE can only be set once
+    // CR3 holds PCID 0
+    write_cr3(vmm_config.kernel_pml4);
+    if (pcid_enabled) {
+        write_cr4(read_cr4() | CR4_PCIDE);
+    }
+    
+    current_pml4_phys = vmm_config.kernel_pml4;
+    cpu_pcid_generation[percpu_current_id()] = pcid_generation;
+}
+
 // Map a virtual page to a physical page
 bool vmm_map_page(uintptr_t virt_addr, uintptr_t phys_addr, uint64_t flags) {
     if (virt_addr == 0) {
@@ -399,22 +1038,7 @@ bool vmm_map_page(uintptr_t virt_addr, uintptr_t phys_addr, uint64_t flags) {
         return false;
     }
     
-    // Translate VMM flags to hardware flags
-    uint64_t hw_flags = PAGE_PRESENT;
-    
-    if (flags & VMM_FLAG_WRITABLE)     hw_flags |= PAGE_WRITABLE;
-    if (flags & VMM_FLAG_USER)         hw_flags |= PAGE_USER;
-    if (flags & VMM_FLAG_WRITETHROUGH) hw_flags |= PAGE_WRITETHROUGH;
-    if (flags & VMM_FLAG_NOCACHE)      hw_flags |= PAGE_CACHE_DISABLE;
-    if (flags & VMM_FLAG_GLOBAL)       hw_flags |= PAGE_GLOBAL;
-    if (flags & VMM_FLAG_HUGE)         hw_flags |= PAGE_HUGE;
-    
-    // NX bit
-    if ((flags & VMM_FLAG_NO_EXECUTE) && vmm_config.using_nx) {
-        hw_flags |= PAGE_NO_EXECUTE;
-    }
-    
-    return map_page_internal(current_pml4_phys, virt_addr, phys_addr, hw_flags);
+    return map_page_internal(current_pml4_phys, virt_addr, phys_addr, hw_flags_from(flags, virt_addr));
 }
 
 // Unmap a virtual page
@@ -443,11 +1067,10 @@ bool vmm_unmap_page(uintptr_t virt_addr) {
         return false;
     }
     
-    // Handle 1GB page
+    // A single page is only part of a huge leaf
     if (pdpt[pdpt_idx] & PAGE_HUGE) {
-        pdpt[pdpt_idx] = 0;
-        invlpg(virt_addr);
-        return true;
+        printf("VMM: Cannot unmap part of a huge page at 0x%lx\n", virt_addr);
+        return false;
     }
     
     uint64_t* pd = (uint64_t*)phys_to_virt(pdpt[pdpt_idx] & PAGE_ADDR_MASK);
@@ -455,85 +1078,143 @@ bool vmm_unmap_page(uintptr_t virt_addr) {
         return false;
     }
     
-    // Handle 2MB page
+    // A collapsed user range can go back to 4KB entries
     if (pd[pd_idx] & PAGE_HUGE) {
-        pd[pd_idx] = 0;
-        invlpg(virt_addr);
-        return true;
+        if (virt_addr >= KERNEL_HALF_BASE) {
+            printf("VMM: Cannot unmap part of a huge page at 0x%lx\n", virt_addr);
+            return false;
+        }
+        if (!split_huge_pmd(current_pml4_phys, &pd[pd_idx], virt_addr)) {
+            return false;
+        }
     }
     
     uint64_t* pt = (uint64_t*)phys_to_virt(pd[pd_idx] & PAGE_ADDR_MASK);
-    if (!pt || !(pt[pt_idx] & PAGE_PRESENT)) {
+    if (!pt) {
         return false;
     }
     
+    // A reserved page that was never touched has nothing cached in the TLB
+    if (!(pt[pt_idx] & PAGE_PRESENT)) {
+        bool lazy = (pt[pt_idx] & PAGE_LAZY) != 0;
+        pt[pt_idx] = 0;
+        return lazy;
+    }
+    
     // Unmap the page
+    uint64_t old = pt[pt_idx];
     pt[pt_idx] = 0;
-    invlpg(virt_addr);
+    flush_entry(virt_addr, old);
     
     return true;
 }
 
-// Map multiple pages
-bool vmm_map_pages(uintptr_t virt_addr, uintptr_t phys_addr, size_t count, uint64_t flags) {
-    // Check if we can use huge pages
-    if ((flags & VMM_FLAG_HUGE) && 
-        (virt_addr & 0x1FFFFF) == 0 && 
-        (phys_addr & 0x1FFFFF) == 0 && 
-        count >= 512) {
-        
-        // Use 2MB pages
-        size_t huge_pages = count / 512;
-        size_t remaining = count % 512;
-        
-        // Map huge pages
-        for (size_t i = 0; i < huge_pages; i++) {
-            if (!vmm_map_page(virt_addr + i * PAGE_SIZE_2M, 
-                              phys_addr + i * PAGE_SIZE_2M, 
-                              flags)) {
-                // Clean up on failure
-                for (size_t j = 0; j < i; j++) {
-                    vmm_unmap_page(virt_addr + j * PAGE_SIZE_2M);
-                }
-                return false;
+// Map a physically contiguous range in the current address space, using
+// the largest leaves that alignment and the existing tables allow
+static bool map_range(uintptr_t virt, uintptr_t phys, size_t count, uint64_t hw_flags, bool allow_huge) {
+    hw_flags &= ~PAGE_HUGE;
+    size_t done = 0;
+    tlb_batch_t batch;
+    tlb_batch_init(&batch);
+    
+    while (done < count) {
+        uintptr_t v = virt + done * PAGE_SIZE_4K;
+        uintptr_t p = phys + done * PAGE_SIZE_4K;
+        size_t left = count - done;
+        
+        // 1GB leaf, unless a page directory is already in the way
+        if (allow_huge && huge_1g_supported && left >= PAGES_PER_1G &&
+            ((v | p) & (PAGE_SIZE_1G - 1)) == 0) {
+            uint64_t* pdpte = walk_entry(current_pml4_phys, v, 1, true);
+            if (pdpte && (!(*pdpte & PAGE_PRESENT) || (*pdpte & PAGE_HUGE))) {
+                uint64_t old = *pdpte;
+                *pdpte = p | hw_flags | PAGE_HUGE;
+                tlb_batch_add(&batch, v, old);
+                vmm_stats.leaves_1g++;
+                done += PAGES_PER_1G;
+                continue;
             }
         }
         
-        // Map remaining regular pages if any
-        if (remaining > 0) {
-            uintptr_t start_virt = virt_addr + huge_pages * PAGE_SIZE_2M;
-            uintptr_t start_phys = phys_addr + huge_pages * PAGE_SIZE_2M;
-            
-            for (size_t i = 0; i < remaining; i++) {
-                if (!vmm_map_page(start_virt + i * PAGE_SIZE_4K,
-                                 start_phys + i * PAGE_SIZE_4K,
-                                 flags & ~VMM_FLAG_HUGE)) {
-                    // Clean up on failure
-                    for (size_t j = 0; j < i; j++) {
-                        vmm_unmap_page(start_virt + j * PAGE_SIZE_4K);
-                    }
-                    for (size_t j = 0; j < huge_pages; j++) {
-                        vmm_unmap_page(virt_addr + j * PAGE_SIZE_2M);
-                    }
-                    return false;
-                }
+        // 2MB leaf, unless a page table is already in the way
+        if (allow_huge && left >= PAGES_PER_2M && ((v | p) & (PAGE_SIZE_2M - 1)) == 0) {
+            uint64_t* pde = walk_entry(current_pml4_phys, v, 2, true);
+            if (pde && (!(*pde & PAGE_PRESENT) || (*pde & PAGE_HUGE))) {
+                uint64_t old = *pde;
+                *pde = p | hw_flags | PAGE_HUGE;
+                tlb_batch_add(&batch, v, old);
+                vmm_stats.leaves_2m++;
+                done += PAGES_PER_2M;
+                continue;
             }
         }
         
-        return true;
+        // 4KB pages up to the end of this page table, with a single walk
+        uint64_t* pte = walk_pte(current_pml4_phys, v, true);
+        if (!pte) {
+            tlb_batch_flush(&batch);
+            vmm_unmap_pages(virt, done);
+            return false;
+        }
+        
+        size_t run = PAGES_PER_2M - PT_INDEX(v);
+        if (run > left) {
+            run = left;
+        }
+        
+        for (size_t i = 0; i < run; i++) {
+            uint64_t old = pte[i];
+            pte[i] = (p + i * PAGE_SIZE_4K) | hw_flags;
+            tlb_batch_add(&batch, v + i * PAGE_SIZE_4K, old);
+        }
+        vmm_stats.leaves_4k += run;
+        done += run;
+    }
+    
+    tlb_batch_flush(&batch);
+    return true;
+}
+
+// Map multiple pages
+bool vmm_map_pages(uintptr_t virt_addr, uintptr_t phys_addr, size_t count, uint64_t flags) {
+    if (virt_addr == 0 || phys_addr == 0) {
+        printf("VMM: Cannot map null address\n");
+        return false;
     }
     
-    // Use regular 4KB pages
+    virt_addr &= PAGE_ADDR_MASK;
+    phys_addr &= PAGE_ADDR_MASK;
+    
+    // Kernel ranges use huge leaves wherever alignment allows. User ranges
+    // only on request, since user frames are tracked per 4KB page.
+    bool allow_huge = virt_addr >= KERNEL_HALF_BASE || (flags & VMM_FLAG_HUGE);
+    
+    return map_range(virt_addr, phys_addr, count,
+                     hw_flags_from(flags & ~VMM_FLAG_HUGE, virt_addr), allow_huge);
+}
+
+// Reserve pages that are populated on first access
+bool vmm_map_lazy(uintptr_t virt_addr, size_t count, uint64_t flags) {
+    if (virt_addr == 0 || (virt_addr & (PAGE_SIZE_4K - 1))) {
+        return false;
+    }
+    
+    // Keep the final flags in the entry, minus the present bit
+    uint64_t entry = (hw_flags_from(flags & ~VMM_FLAG_HUGE, virt_addr) & ~PAGE_PRESENT) | PAGE_LAZY;
+    
     for (size_t i = 0; i < count; i++) {
-        if (!vmm_map_page(virt_addr + i * PAGE_SIZE_4K, 
-                         phys_addr + i * PAGE_SIZE_4K, 
-                         flags & ~VMM_FLAG_HUGE)) {
+        uintptr_t virt = virt_addr + i * PAGE_SIZE_4K;
+        uint64_t* pte = walk_pte(current_pml4_phys, virt, true);
+        
+        if (!pte || (*pte & PAGE_PRESENT)) {
             // Clean up on failure
             for (size_t j = 0; j < i; j++) {
                 vmm_unmap_page(virt_addr + j * PAGE_SIZE_4K);
             }
             return false;
         }
+        
+        *pte = entry;
     }
     
     return true;
@@ -541,10 +1222,142 @@ bool vmm_map_pages(uintptr_t virt_addr, uintptr_t phys_addr, size_t count, uint6
 
 // Unmap multiple pages
 bool vmm_unmap_pages(uintptr_t virt_addr, size_t count) {
-    // Check each page since we might have mixed page sizes
-    for (size_t i = 0; i < count; i++) {
-        vmm_unmap_page(virt_addr + i * PAGE_SIZE_4K);
+    virt_addr &= PAGE_ADDR_MASK;
+    
+    tlb_batch_t batch;
+    tlb_batch_init(&batch);
+    
+    // Walk the tables once per leaf or page table rather than per page
+    size_t i = 0;
+    while (i < count) {
+        uintptr_t virt = virt_addr + i * PAGE_SIZE_4K;
+        
+        // Huge leaves go as a whole
+        uint64_t* leaf = walk_entry(current_pml4_phys, virt, 1, false);
+        size_t leaf_pages = PAGES_PER_1G;
+        if (!leaf || !(*leaf & PAGE_PRESENT) || !(*leaf & PAGE_HUGE)) {
+            leaf = walk_entry(current_pml4_phys, virt, 2, false);
+            leaf_pages = PAGES_PER_2M;
+        }
+        bool partial = ((virt / PAGE_SIZE_4K) & (leaf_pages - 1)) != 0 || count - i < leaf_pages;
+        if (leaf && (*leaf & PAGE_PRESENT) && (*leaf & PAGE_HUGE) && partial &&
+            leaf_pages == PAGES_PER_2M && virt < KERNEL_HALF_BASE) {
+            // A collapsed user range can go back to 4KB entries
+            if (!split_huge_pmd(current_pml4_phys, leaf, virt)) {
+                tlb_batch_flush(&batch);
+                return false;
+            }
+        } else if (leaf && (*leaf & PAGE_PRESENT) && (*leaf & PAGE_HUGE)) {
+            if (partial) {
+                tlb_batch_flush(&batch);
+                printf("VMM: Cannot unmap part of a huge page at 0x%lx\n", virt);
+                return false;
+            }
+            
+            tlb_batch_add(&batch, virt, *leaf);
+            *leaf = 0;
+            i += leaf_pages;
+            continue;
+        }
+        
+        // Clear the run of entries up to the end of this page table
+        size_t run = PAGES_PER_2M - PT_INDEX(virt);
+        if (run > count - i) {
+            run = count - i;
+        }
+        
+        uint64_t* pte = walk_pte(current_pml4_phys, virt, false);
+        for (size_t j = 0; pte && j < run; j++) {
+            uint64_t old = pte[j];
+            pte[j] = 0;
+            tlb_batch_add(&batch, virt + j * PAGE_SIZE_4K, old);
+        }
+        
+        i += run;
+    }
+    
+    tlb_batch_flush(&batch);
+    return true;
+}
+
+// Unmap pages and drop the user-owned frames behind them
+void vmm_release_pages(uintptr_t virt_addr, size_t count) {
+    release_pages(virt_addr & PAGE_ADDR_MASK, count, true);
+}
+
+// Change the protection of mapped and reserved pages
+bool vmm_protect_pages(uintptr_t virt_addr, size_t count, uint64_t flags) {
+    virt_addr &= PAGE_ADDR_MASK;
+    
+    const uint64_t prot_mask = PAGE_WRITABLE | PAGE_USER | PAGE_NO_EXECUTE;
+    uint64_t prot = hw_flags_from(flags, virt_addr) & prot_mask;
+    
+    tlb_batch_t batch;
+    tlb_batch_init(&batch);
+    
+    size_t i = 0;
+    while (i < count) {
+        uintptr_t virt = virt_addr + i * PAGE_SIZE_4K;
+        
+        // Huge leaves can only change as a whole
+        uint64_t* leaf = walk_entry(current_pml4_phys, virt, 1, false);
+        size_t leaf_pages = PAGES_PER_1G;
+        if (!leaf || !(*leaf & PAGE_PRESENT) || !(*leaf & PAGE_HUGE)) {
+            leaf = walk_entry(current_pml4_phys, virt, 2, false);
+            leaf_pages = PAGES_PER_2M;
+        }
+        bool partial = ((virt / PAGE_SIZE_4K) & (leaf_pages - 1)) != 0 || count - i < leaf_pages;
+        if (leaf && (*leaf & PAGE_PRESENT) && (*leaf & PAGE_HUGE) && partial &&
+            leaf_pages == PAGES_PER_2M && virt < KERNEL_HALF_BASE) {
+            // A collapsed user range can go back to 4KB entries
+            if (!split_huge_pmd(current_pml4_phys, leaf, virt)) {
+                tlb_batch_flush(&batch);
+                return false;
+            }
+        } else if (leaf && (*leaf & PAGE_PRESENT) && (*leaf & PAGE_HUGE)) {
+            if (partial) {
+                tlb_batch_flush(&batch);
+                printf("VMM: Cannot change protection of part of a huge page at 0x%lx\n", virt);
+                return false;
+            }
+            
+            uint64_t old = *leaf;
+            *leaf = (old & ~prot_mask) | prot;
+            tlb_batch_add(&batch, virt, old);
+            i += leaf_pages;
+            continue;
+        }
+        
+        size_t run = PAGES_PER_2M - PT_INDEX(virt);
+        if (run > count - i) {
+            run = count - i;
+        }
+        
+        uint64_t* pte = walk_pte(current_pml4_phys, virt, false);
+        for (size_t j = 0; pte && j < run; j++) {
+            uint64_t old = pte[j];
+            if (old == 0) {
+                continue;
+            }
+            
+            uint64_t entry = (old & ~prot_mask) | prot;
+            if (old & PAGE_COW) {
+                entry &= ~PAGE_WRITABLE;
+            }
+            if (entry == old) {
+                continue;
+            }
+            
+            pte[j] = entry;
+            if (old & PAGE_PRESENT) {
+                tlb_batch_add(&batch, virt + j * PAGE_SIZE_4K, old);
+            }
+        }
+        
+        i += run;
     }
+    
+    tlb_batch_flush(&batch);
     return true;
 }
 
@@ -556,7 +1369,7 @@ uintptr_t vmm_get_physical_address(uintptr_t virt_addr) {
 // Check if address is mapped
 bool vmm_is_mapped(uintptr_t virt_addr) {
     // Handle direct mapping range
-    if (virt_addr >= hhdm_offset) {
+    if (in_hhdm(virt_addr)) {
         return true;
     }
     
@@ -609,68 +1422,64 @@ void* vmm_allocate(size_t size, uint64_t flags) {
     size = (size + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
     size_t page_count = size / PAGE_SIZE_4K;
     
-    // Choose appropriate areas based on flags
-    memory_area_t* areas;
-    int* area_count;
-    
-    if (flags & VMM_FLAG_USER) {
-        areas = user_areas;
-        area_count = &user_area_count;
-    } else {
-        areas = kernel_areas;
-        area_count = &kernel_area_count;
+    // Reserve a virtual range
+    vrange_arena_t* arena = (flags & VMM_FLAG_USER) ? &user_arena : &kernel_arena;
+    uintptr_t base = vrange_alloc(arena, size, 0);
+    if (base == 0) {
+        printf("VMM: No free virtual range for allocation of size %zu\n", size);
+        return NULL;
     }
     
-    // Find a free area
-    memory_area_t* area = find_free_area(areas, *area_count, size, flags);
-    if (!area) {
-        printf("VMM: No free memory area for allocation of size %zu\n", size);
-        return NULL;
+    // Lazy allocations only reserve the pages; the fault handler fills them
+    if (flags & VMM_FLAG_LAZY) {
+        if (!vmm_map_lazy(base, page_count, flags | VMM_FLAG_WRITABLE)) {
+            vrange_free(arena, base);
+            return NULL;
+        }
+        return (void*)base;
     }
     
-    // Mark the area as used
-    area->is_used = true;
+    // Allocate physical pages and map them, one table walk per page table;
+    // the range is fresh, so no stale translations need flushing
+    uint64_t hw_flags = hw_flags_from((flags & ~VMM_FLAG_HUGE) | VMM_FLAG_WRITABLE, base);
+    pmm_page_owner_t owner = (flags & VMM_FLAG_USER) ? PMM_OWNER_USER : PMM_OWNER_KERNEL;
+    uint32_t alloc_flags = PMM_ALLOC_ZERO | (owner == PMM_OWNER_USER ? PMM_ALLOC_MOVABLE : 0);
+    size_t mapped = 0;
     
-    // Allocate physical pages and map them
-    for (size_t i = 0; i < page_count; i++) {
-        uintptr_t phys = pmm_alloc_page();
-        if (phys == 0) {
-            // Out of physical memory, clean up
-            for (size_t j = 0; j < i; j++) {
-                uintptr_t addr = area->base + j * PAGE_SIZE_4K;
-                uintptr_t page_phys = vmm_get_physical_address(addr);
-                vmm_unmap_page(addr);
-                pmm_free_page(page_phys);
-            }
-            area->is_used = false;
-            return NULL;
+    while (mapped < page_count) {
+        uintptr_t virt = base + mapped * PAGE_SIZE_4K;
+        size_t run = PAGES_PER_2M - PT_INDEX(virt);
+        if (run > page_count - mapped) {
+            run = page_count - mapped;
         }
         
-        // Apply additional flags
-        uint64_t combined_flags = flags | area->flags;
-        
-        // Map the page
-        if (!vmm_map_page(area->base + i * PAGE_SIZE_4K, phys, combined_flags)) {
+        uint64_t* pte = walk_pte(current_pml4_phys, virt, true);
+        if (!pte) {
             // Failed to map, clean up
-            pmm_free_page(phys);
-            for (size_t j = 0; j < i; j++) {
-                uintptr_t addr = area->base + j * PAGE_SIZE_4K;
-                uintptr_t page_phys = vmm_get_physical_address(addr);
-                vmm_unmap_page(addr);
-                pmm_free_page(page_phys);
-            }
-            area->is_used = false;
+            release_pages(base, mapped, false);
+            vrange_free(arena, base);
             return NULL;
         }
         
-        // Zero the memory
-        memset(phys_to_virt(phys), 0, PAGE_SIZE_4K);
+        for (size_t j = 0; j < run; j++) {
+            uintptr_t phys = pmm_alloc_page_flags(alloc_flags);
+            if (phys == 0) {
+                // Out of physical memory, clean up
+                release_pages(base, mapped, false);
+                vrange_free(arena, base);
+                return NULL;
+            }
+            
+            pmm_page_set_owner(phys, owner);
+            pte[j] = phys | hw_flags;
+            mapped++;
+        }
     }
     
     // Update statistics
     vmm_stats.pages_allocated += page_count;
     
-    return (void*)area->base;
+    return (void*)base;
 }
 
 // Free allocated memory
@@ -681,75 +1490,166 @@ void vmm_free(void* addr, size_t size) {
     
     uintptr_t virt_addr = (uintptr_t)addr;
     
+    // The range records its own size; fall back to the caller's for
+    // addresses outside the arenas
+    vrange_arena_t* arena = arena_for(virt_addr);
+    size_t range_size = arena ? vrange_lookup(arena, virt_addr) : 0;
+    if (range_size) {
+        size = range_size;
+    }
+    
     // Round up to page size
     size = (size + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
     size_t page_count = size / PAGE_SIZE_4K;
     
-    // Free each page
-    for (size_t i = 0; i < page_count; i++) {
-        uintptr_t page_addr = virt_addr + i * PAGE_SIZE_4K;
-        uintptr_t phys_addr = vmm_get_physical_address(page_addr);
-        
-        if (phys_addr) {
-            vmm_unmap_page(page_addr);
-            pmm_free_page(phys_addr);
-        }
+    // Tear down the mappings before the range can be handed out again
+    release_pages(virt_addr, page_count, false);
+    if (range_size) {
+        vrange_free(arena, virt_addr);
     }
     
-    // Find and free the memory area
-    memory_area_t* areas;
-    int count;
-    
-    if (virt_addr >= hhdm_offset) {
-        areas = kernel_areas;
-        count = kernel_area_count;
-    } else {
-        areas = user_areas;
-        count = user_area_count;
+    // Update statistics
+    vmm_stats.pages_freed += page_count;
+}
+
+// Find the MMIO mapping containing virt
+static io_mapping_t* io_find_virt(uintptr_t virt) {
+    rb_node_t* node = io_by_virt.root;
+    
+    while (node) {
+        io_mapping_t* map = rb_entry(node, io_mapping_t, virt_node);
+        if (virt < map->virt) {
+            node = node->left;
+        } else if (virt >= map->virt + map->size) {
+            node = node->right;
+        } else {
+            return map;
+        }
     }
     
-    for (int i = 0; i < count; i++) {
-        if (areas[i].base == virt_addr) {
-            areas[i].is_used = false;
+    return NULL;
+}
+
+// Find a mapping of [phys, phys + size) that can be shared with flags
+// Mappings of overlapping ranges with another memory type would alias the
+// same memory with conflicting caching, so *conflict is set for those
+static io_mapping_t* io_find_phys(uintptr_t phys, size_t size, uint64_t flags, bool* conflict) {
+    io_mapping_t* match = NULL;
+    *conflict = false;
+    
+    // Ranges are few and sorted by base, so stop at the first one past the end
+    for (rb_node_t* node = rb_first(&io_by_phys); node; node = rb_next(node)) {
+        io_mapping_t* map = rb_entry(node, io_mapping_t, phys_node);
+        if (map->phys >= phys + size) {
             break;
         }
+        if (map->phys + map->size <= phys) {
+            continue;
+        }
+        
+        if ((map->flags & VMM_CACHE_MASK) != (flags & VMM_CACHE_MASK)) {
+            *conflict = true;
+            return NULL;
+        }
+        if (!match && map->flags == flags && map->phys <= phys &&
+            phys + size <= map->phys + map->size) {
+            match = map;
+        }
     }
     
-    // Update statistics
-    vmm_stats.pages_freed += page_count;
+    return match;
 }
 
-// Map physical memory to virtual address space
+static void io_insert(io_mapping_t* map) {
+    rb_node_t** link = &io_by_phys.root;
+    rb_node_t* parent = NULL;
+    while (*link) {
+        parent = *link;
+        if (map->phys < rb_entry(parent, io_mapping_t, phys_node)->phys) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+        }
+    }
+    rb_link_node(&map->phys_node, parent, link);
+    rb_insert_color(&io_by_phys, &map->phys_node);
+    
+    link = &io_by_virt.root;
+    parent = NULL;
+    while (*link) {
+        parent = *link;
+        if (map->virt < rb_entry(parent, io_mapping_t, virt_node)->virt) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+        }
+    }
+    rb_link_node(&map->virt_node, parent, link);
+    rb_insert_color(&io_by_virt, &map->virt_node);
+}
+
+// Map physical memory into the MMIO window
 void* vmm_map_physical(uintptr_t phys_addr, size_t size, uint64_t flags) {
-    // Round to page size
-    size = (size + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
+    if (size == 0 || !io_cache) {
+        return NULL;
+    }
     
-    // For high physical addresses (above 4GB), we need special handling
-    void* virt_addr;
+    // Map whole pages; the caller gets its offset into the first one
+    uintptr_t offset = phys_addr & (PAGE_SIZE_4K - 1);
+    uintptr_t phys = phys_addr - offset;
+    size = (size + offset + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
+    flags |= VMM_FLAG_PRESENT;
     
-    // Choose appropriate virtual address range based on physical address
-    if (phys_addr >= 0x100000000ULL) {
-        // For addresses above 4GB, use a dedicated high mapping area
-        // Starting at -8GB from the end of virtual address space
-        virt_addr = (void*)((0xFFFFFFFF00000000ULL - 0x200000000ULL) + 
-                           (phys_addr & 0xFFFFFFFFULL));
-    } else {
-        // Standard higher half mapping for normal physical addresses
-        virt_addr = (void*)(phys_addr + KERNEL_VIRTUAL_BASE);
+    spinlock_acquire(&io_lock);
+    
+    bool conflict;
+    io_mapping_t* map = io_find_phys(phys, size, flags, &conflict);
+    if (conflict) {
+        spinlock_release(&io_lock);
+        printf("VMM: 0x%lx is already mapped with another memory type\n", phys_addr);
+        return NULL;
+    }
+    if (map) {
+        map->refs++;
+        vmm_stats.io_reuses++;
+        spinlock_release(&io_lock);
+        return (void*)(map->virt + (phys - map->phys) + offset);
     }
     
-    // Map each page
-    for (size_t offset = 0; offset < size; offset += PAGE_SIZE_4K) {
-        if (!vmm_map_page((uintptr_t)virt_addr + offset, phys_addr + offset, flags)) {
-            // Clean up on failure
-            for (size_t i = 0; i < offset; i += PAGE_SIZE_4K) {
-                vmm_unmap_page((uintptr_t)virt_addr + i);
-            }
-            return NULL;
-        }
+    map = (io_mapping_t*)kmem_cache_alloc(io_cache);
+    if (!map) {
+        spinlock_release(&io_lock);
+        return NULL;
+    }
+    
+    // Matching the physical alignment lets the range use 2MB leaves
+    size_t align = (size >= PAGE_SIZE_2M && (phys & (PAGE_SIZE_2M - 1)) == 0) ? PAGE_SIZE_2M : 0;
+    uintptr_t virt = vrange_alloc(&io_arena, size, align);
+    if (virt == 0) {
+        spinlock_release(&io_lock);
+        kmem_cache_free(io_cache, map);
+        printf("VMM: MMIO window exhausted mapping 0x%lx (%lu bytes)\n", phys_addr, size);
+        return NULL;
     }
     
-    return virt_addr;
+    if (!vmm_map_pages(virt, phys, size / PAGE_SIZE_4K, flags)) {
+        vmm_unmap_pages(virt, size / PAGE_SIZE_4K);
+        vrange_free(&io_arena, virt);
+        spinlock_release(&io_lock);
+        kmem_cache_free(io_cache, map);
+        return NULL;
+    }
+    
+    map->phys = phys;
+    map->virt = virt;
+    map->size = size;
+    map->flags = flags;
+    map->refs = 1;
+    io_insert(map);
+    vmm_stats.io_mappings++;
+    
+    spinlock_release(&io_lock);
+    return (void*)(virt + offset);
 }
 
 // Unmap previously mapped physical memory
@@ -758,13 +1658,38 @@ void vmm_unmap_physical(void* virt_addr, size_t size) {
         return;
     }
     
-    // Round to page size
-    size = (size + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
+    uintptr_t virt = (uintptr_t)virt_addr;
+    if (!vrange_contains(&io_arena, virt)) {
+        // Not from the MMIO window; just drop the pages
+        size = ((virt & (PAGE_SIZE_4K - 1)) + size + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
+        vmm_unmap_pages(virt, size / PAGE_SIZE_4K);
+        return;
+    }
     
-    // Unmap each page
-    for (size_t offset = 0; offset < size; offset += PAGE_SIZE_4K) {
-        vmm_unmap_page((uintptr_t)virt_addr + offset);
+    spinlock_acquire(&io_lock);
+    
+    io_mapping_t* map = io_find_virt(virt);
+    if (!map) {
+        spinlock_release(&io_lock);
+        printf("VMM: Unmap of unknown MMIO address 0x%lx\n", virt);
+        return;
+    }
+    
+    // The mapping lives as long as anyone still shares it
+    if (--map->refs > 0) {
+        spinlock_release(&io_lock);
+        return;
     }
+    
+    rb_erase(&io_by_phys, &map->phys_node);
+    rb_erase(&io_by_virt, &map->virt_node);
+    vmm_stats.io_mappings--;
+    
+    vmm_unmap_pages(map->virt, map->size / PAGE_SIZE_4K);
+    vrange_free(&io_arena, map->virt);
+    
+    spinlock_release(&io_lock);
+    kmem_cache_free(io_cache, map);
 }
 
 // Create a new address space
@@ -787,49 +1712,396 @@ uintptr_t vmm_create_address_space(void) {
     return pml4_phys;
 }
 
-// Delete an address space
+// Duplicate the entries of one page table level into an empty table
+// Level 0 is a page table, level 3 the PML4 (user half only)
+static bool clone_table(uint64_t* src, uint64_t* dst, int level, bool cow) {
+    size_t limit = (level == 3) ? 256 : 512;
+    
+    for (size_t i = 0; i < limit; i++) {
+        uint64_t entry = src[i];
+        
+        if (!(entry & PAGE_PRESENT)) {
+            // Untouched reservations are reserved in the copy as well
+            if (level == 0 && (entry & PAGE_LAZY)) {
+                dst[i] = entry;
+            }
+            continue;
+        }
+        
+        // Collapsed 2MB ranges are split so their frames can be shared
+        if (level == 1 && (entry & PAGE_HUGE)) {
+            if (!split_huge_pmd(0, &src[i], 0)) {
+                return false;
+            }
+            entry = src[i];
+        } else if (level > 0 && (entry & PAGE_HUGE)) {
+            printf("VMM: Cannot clone huge user mappings\n");
+            return false;
+        }
+        
+        if (level > 0) {
+            uintptr_t table = create_page_table();
+            if (table == 0) {
+                return false;
+            }
+            dst[i] = table | (entry & ~PAGE_FRAME_MASK);
+            
+            if (!clone_table((uint64_t*)phys_to_virt(entry & PAGE_FRAME_MASK),
+                             (uint64_t*)phys_to_virt(table), level - 1, cow)) {
+                return false;
+            }
+            continue;
+        }
+        
+        // Frames not owned by the address space (device memory, kernel
+        // buffers) are shared as they are
+        uintptr_t frame = entry & PAGE_FRAME_MASK;
+        page_t* page = pmm_get_page(frame);
+        if (!page || page->owner != PMM_OWNER_USER) {
+            dst[i] = entry;
+            continue;
+        }
+        
+        if (cow) {
+            // Share the frame; writers get their own copy on the next write
+            pmm_page_get(frame);
+            if (entry & PAGE_WRITABLE) {
+                // The source may be running elsewhere; keep the dirty bit
+                // its CPUs set meanwhile
+                while (!__atomic_compare_exchange_n(&src[i], &entry, (entry & ~PAGE_WRITABLE) | PAGE_COW,
+                                                    false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                }
+                entry = (entry & ~PAGE_WRITABLE) | PAGE_COW;
+            }
+            dst[i] = entry;
+        } else {
+            uintptr_t copy = pmm_alloc_page_flags(PMM_ALLOC_MOVABLE);
+            if (copy == 0) {
+                return false;
+            }
+            pmm_page_set_owner(copy, PMM_OWNER_USER);
+            memcpy(phys_to_virt(copy), phys_to_virt(frame), PAGE_SIZE_4K);
+            dst[i] = copy | (entry & ~PAGE_FRAME_MASK);
+        }
+    }
+    
+    return true;
+}
+
+// Check whether an address space is loaded on any CPU
+static bool pml4_in_use(uintptr_t pml4_phys) {
+    for (uint32_t i = 0; i < PERCPU_MAX_CPUS; i++) {
+        if (__atomic_load_n(&cpu_pml4_phys[i], __ATOMIC_ACQUIRE) == pml4_phys) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Check whether an address space is loaded on a CPU other than this one
+static bool pml4_in_use_elsewhere(uintptr_t pml4_phys) {
+    uint32_t self = percpu_current_id();
+    for (uint32_t i = 0; i < PERCPU_MAX_CPUS; i++) {
+        if (i != self && __atomic_load_n(&cpu_pml4_phys[i], __ATOMIC_ACQUIRE) == pml4_phys) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Duplicate the user half of an address space
+uintptr_t vmm_clone_address_space(uintptr_t pml4_phys, uint32_t flags) {
+    if (pml4_phys == 0) {
+        return 0;
+    }
+    
+    uintptr_t clone_phys = vmm_create_address_space();
+    if (clone_phys == 0) {
+        return 0;
+    }
+    
+    bool cow = (flags & VMM_CLONE_COW) != 0;
+    bool ok = clone_table((uint64_t*)phys_to_virt(pml4_phys),
+                          (uint64_t*)phys_to_virt(clone_phys), 3, cow);
+    
+    // Writable entries of the source may have been write-protected
+    if (cow && pml4_phys == (read_cr3() & PAGE_ADDR_MASK)) {
+        write_cr3(read_cr3() & ~CR3_NOFLUSH);
+    } else if (cow) {
+        pcid_invalidate(pml4_phys);
+    }
+    
+    // Other CPUs running the source may still hold them writable
+    if (cow && pml4_in_use_elsewhere(pml4_phys)) {
+        smp_tlb_shootdown();
+    }
+    
+    if (!ok) {
+        // Drops every reference taken so far; the source keeps its
+        // copy-on-write entries, which resolve on the next write
+        printf("VMM: Failed to clone address space 0x%lx\n", pml4_phys);
+        vmm_delete_address_space(clone_phys);
+        return 0;
+    }
+    
+    return clone_phys;
+}
+
+// Replace a fully populated page table of private user frames with one 2MB
+// leaf; the frames are copied into a fresh 2MB frame, so the caller must
+// keep the address space from running meanwhile
+static bool collapse_pmd(uintptr_t pml4_phys, uint64_t* pde) {
+    uintptr_t pt_phys = *pde & PAGE_ADDR_MASK;
+    uint64_t* pt = (uint64_t*)phys_to_virt(pt_phys);
+    
+    // Every entry needs the same permissions and memory type; bit 7 of a
+    // 4KB entry is the PAT bit, which sits elsewhere in a 2MB leaf
+    const uint64_t ignored = PAGE_FRAME_MASK | PAGE_ACCESSED | PAGE_DIRTY;
+    uint64_t flags = pt[0] & ~ignored;
+    if (!(flags & PAGE_PRESENT) || !(flags & PAGE_USER) ||
+        (flags & (PAGE_COW | PAGE_LAZY | PAGE_HUGE | PAGE_GLOBAL))) {
+        return false;
+    }
+    
+    for (size_t i = 0; i < PAGES_PER_2M; i++) {
+        if ((pt[i] & ~ignored) != flags) {
+            return false;
+        }
+        page_t* page = pmm_get_page(pt[i] & PAGE_FRAME_MASK);
+        if (!page || page->owner != PMM_OWNER_USER || page->refcount != 1) {
+            return false;
+        }
+    }
+    
+    uintptr_t huge = pmm_alloc_huge(PMM_HUGE_ORDER_2M);
+    if (huge == 0) {
+        return false;
+    }
+    
+    uint64_t dirty = 0;
+    for (size_t i = 0; i < PAGES_PER_2M; i++) {
+        uintptr_t frame = huge + i * PAGE_SIZE_4K;
+        pmm_page_set_owner(frame, PMM_OWNER_USER);
+        memcpy(phys_to_virt(frame), phys_to_virt(pt[i] & PAGE_FRAME_MASK), PAGE_SIZE_4K);
+        dirty |= pt[i] & PAGE_DIRTY;
+    }
+    
+    // Only the swap itself must not race a switch to the address space
+    uint64_t rflags = vmm_irq_save();
+    bool idle = !pml4_in_use(pml4_phys);
+    if (idle) {
+        *pde = huge | flags | PAGE_HUGE | PAGE_ACCESSED | dirty;
+    }
+    vmm_irq_restore(rflags);
+    
+    if (!idle) {
+        pmm_free_huge(huge, PMM_HUGE_ORDER_2M);
+        return false;
+    }
+    
+    for (size_t i = 0; i < PAGES_PER_2M; i++) {
+        pmm_page_put(pt[i] & PAGE_FRAME_MASK);
+    }
+    memset(pt, 0, PAGE_SIZE_4K);
+    free_page_table(pt_phys);
+    
+    vmm_stats.thp_collapses++;
+    return true;
+}
+
+// Collapse up to budget fully populated 2MB ranges of an address space
+size_t vmm_collapse_huge_pages(uintptr_t pml4_phys, size_t budget) {
+    // Only address spaces that are not running can be copied safely
+    if (pml4_phys == 0 || pml4_phys == vmm_config.kernel_pml4 || pml4_in_use(pml4_phys)) {
+        return 0;
+    }
+    
+    uint64_t* pml4 = (uint64_t*)phys_to_virt(pml4_phys);
+    size_t collapsed = 0;
+    
+    for (size_t pml4_idx = 0; pml4_idx < 256 && collapsed < budget; pml4_idx++) {
+        if (!(pml4[pml4_idx] & PAGE_PRESENT)) {
+            continue;
+        }
+        uint64_t* pdpt = (uint64_t*)phys_to_virt(pml4[pml4_idx] & PAGE_ADDR_MASK);
+        
+        for (size_t pdpt_idx = 0; pdpt_idx < 512 && collapsed < budget; pdpt_idx++) {
+            if (!(pdpt[pdpt_idx] & PAGE_PRESENT) || (pdpt[pdpt_idx] & PAGE_HUGE)) {
+                continue;
+            }
+            uint64_t* pd = (uint64_t*)phys_to_virt(pdpt[pdpt_idx] & PAGE_ADDR_MASK);
+            
+            for (size_t pd_idx = 0; pd_idx < 512 && collapsed < budget; pd_idx++) {
+                if (!(pd[pd_idx] & PAGE_PRESENT) || (pd[pd_idx] & PAGE_HUGE)) {
+                    continue;
+                }
+                
+                if (collapse_pmd(pml4_phys, &pd[pd_idx])) {
+                    collapsed++;
+                }
+            }
+        }
+    }
+    
+    // Cached 4KB translations of the address space are stale now
+    if (collapsed > 0) {
+        pcid_invalidate(pml4_phys);
+    }
+    
+    return collapsed;
+}
+
+// Queue an address space for the reaper
 void vmm_delete_address_space(uintptr_t pml4_phys) {
-    if (pml4_phys == 0 || pml4_phys == current_pml4_phys) {
+    if (pml4_phys == 0 || pml4_phys == vmm_config.kernel_pml4) {
         return;
     }
     
-    // Get the PML4 table
-    uint64_t* pml4 = (uint64_t*)phys_to_virt(pml4_phys);
+    if (!pmm_get_page(pml4_phys)) {
+        return;
+    }
+    
+    dead_space_t* dead = dead_space_cache ? (dead_space_t*)kmem_cache_alloc(dead_space_cache) : NULL;
+    if (!dead) {
+        printf("VMM: Cannot queue address space 0x%lx for the reaper\n", pml4_phys);
+        return;
+    }
+    dead->pml4_phys = pml4_phys;
+    
+    // The PCID tag dies with the address space
+    pcid_invalidate(pml4_phys);
+    
+    uint64_t rflags = vmm_irq_save();
+    spinlock_acquire(&dead_spaces_lock);
+    dead->next = dead_spaces;
+    dead_spaces = dead;
+    spinlock_release(&dead_spaces_lock);
+    vmm_irq_restore(rflags);
+}
+
+// Free the user tables below one PML4 slot, dropping the frames faulted in
+// for the address space; returns the number of table pages released
+static size_t reap_slot_tables(uint64_t* pml4, size_t slot) {
+    if (!(pml4[slot] & PAGE_PRESENT)) {
+        return 0;
+    }
+    
+    uintptr_t pdpt_phys = pml4[slot] & PAGE_ADDR_MASK;
+    uint64_t* pdpt = (uint64_t*)phys_to_virt(pdpt_phys);
+    size_t freed = 0;
     
-    // Free user space page tables (lower half)
-    for (size_t pml4_idx = 0; pml4_idx < 256; pml4_idx++) {
-        if (pml4[pml4_idx] & PAGE_PRESENT) {
-            uint64_t pdpt_phys = pml4[pml4_idx] & PAGE_ADDR_MASK;
-            uint64_t* pdpt = (uint64_t*)phys_to_virt(pdpt_phys);
+    for (size_t pdpt_idx = 0; pdpt_idx < 512; pdpt_idx++) {
+        if (!(pdpt[pdpt_idx] & PAGE_PRESENT) || (pdpt[pdpt_idx] & PAGE_HUGE)) {
+            continue;
+        }
+        uintptr_t pd_phys = pdpt[pdpt_idx] & PAGE_ADDR_MASK;
+        uint64_t* pd = (uint64_t*)phys_to_virt(pd_phys);
+        
+        for (size_t pd_idx = 0; pd_idx < 512; pd_idx++) {
+            if (!(pd[pd_idx] & PAGE_PRESENT)) {
+                continue;
+            }
             
-            // Free PDPTs
-            for (size_t pdpt_idx = 0; pdpt_idx < 512; pdpt_idx++) {
-                if ((pdpt[pdpt_idx] & PAGE_PRESENT) && !(pdpt[pdpt_idx] & PAGE_HUGE)) {
-                    uint64_t pd_phys = pdpt[pdpt_idx] & PAGE_ADDR_MASK;
-                    uint64_t* pd = (uint64_t*)phys_to_virt(pd_phys);
-                    
-                    // Free PDs
-                    for (size_t pd_idx = 0; pd_idx < 512; pd_idx++) {
-                        if ((pd[pd_idx] & PAGE_PRESENT) && !(pd[pd_idx] & PAGE_HUGE)) {
-                            uint64_t pt_phys = pd[pd_idx] & PAGE_ADDR_MASK;
-                            
-                            // Free the page table
-                            pmm_free_page(pt_phys);
-                        }
-                    }
-                    
-                    // Free the page directory
-                    pmm_free_page(pd_phys);
+            // Collapsed ranges hold 512 separately counted frames
+            if (pd[pd_idx] & PAGE_HUGE) {
+                uintptr_t frame = pd[pd_idx] & PAGE_FRAME_MASK & ~(PAGE_SIZE_2M - 1);
+                page_t* page = pmm_get_page(frame);
+                for (size_t i = 0; page && page->owner == PMM_OWNER_USER && i < PAGES_PER_2M; i++) {
+                    pmm_page_put(frame + i * PAGE_SIZE_4K);
+                }
+                continue;
+            }
+            uintptr_t pt_phys = pd[pd_idx] & PAGE_ADDR_MASK;
+            uint64_t* pt = (uint64_t*)phys_to_virt(pt_phys);
+            
+            for (size_t pt_idx = 0; pt_idx < 512; pt_idx++) {
+                if (!(pt[pt_idx] & PAGE_PRESENT)) {
+                    continue;
+                }
+                uintptr_t frame = pt[pt_idx] & PAGE_FRAME_MASK;
+                page_t* page = pmm_get_page(frame);
+                if (page && page->owner == PMM_OWNER_USER) {
+                    pmm_page_put(frame);
                 }
             }
             
-            // Free the PDPT
-            pmm_free_page(pdpt_phys);
+            memset(pt, 0, PAGE_SIZE_4K);
+            free_page_table(pt_phys);
+            freed++;
+        }
+        
+        memset(pd, 0, PAGE_SIZE_4K);
+        free_page_table(pd_phys);
+        freed++;
+    }
+    
+    memset(pdpt, 0, PAGE_SIZE_4K);
+    free_page_table(pdpt_phys);
+    pml4[slot] = 0;
+    return freed + 1;
+}
+
+// Tear down queued address spaces and top up the page-table pool
+size_t vmm_reap_address_spaces(size_t budget) {
+    size_t freed = 0;
+    
+    while (freed < budget) {
+        if (reap_pml4 == 0) {
+            uint64_t rflags = vmm_irq_save();
+            spinlock_acquire(&dead_spaces_lock);
+            
+            // An exiting process may still be running on its tables
+            dead_space_t** link = &dead_spaces;
+            while (*link && pml4_in_use((*link)->pml4_phys)) {
+                link = &(*link)->next;
+            }
+            dead_space_t* dead = *link;
+            if (dead) {
+                reap_pml4 = dead->pml4_phys;
+                *link = dead->next;
+                reap_slot = 0;
+            }
+            
+            spinlock_release(&dead_spaces_lock);
+            vmm_irq_restore(rflags);
+            
+            if (dead) {
+                kmem_cache_free(dead_space_cache, dead);
+            }
+            
+            if (reap_pml4 == 0) {
+                break;
+            }
+        }
+        
+        // Whole PML4 slots at a time, so an exit never waits on a long walk
+        uint64_t* pml4 = (uint64_t*)phys_to_virt(reap_pml4);
+        while (reap_slot < 256 && freed < budget) {
+            freed += reap_slot_tables(pml4, reap_slot++);
+        }
+        
+        if (reap_slot == 256) {
+            // The kernel half is shared and only the pointers need clearing
+            memset(pml4, 0, PAGE_SIZE_4K);
+            free_page_table(reap_pml4);
+            reap_pml4 = 0;
+            vmm_stats.address_spaces_reaped++;
+            freed++;
+        }
+    }
+    
+    // With nothing left to reap, keep some table pages ready
+    while (freed < budget && __atomic_load_n(&pt_pool_count, __ATOMIC_RELAXED) < PT_POOL_SIZE / 2) {
+        uintptr_t page = pmm_alloc_page_flags(PMM_ALLOC_ZERO);
+        if (page == 0) {
+            break;
         }
+        pmm_page_set_owner(page, PMM_OWNER_PAGE_TABLE);
+        free_page_table(page);
+        freed++;
     }
     
-    // Free the PML4 itself
-    pmm_free_page(pml4_phys);
+    return freed;
 }
 
 // Switch to a different address space
@@ -838,11 +2110,34 @@ void vmm_switch_address_space(uintptr_t pml4_phys) {
         return;
     }
     
+    uint64_t rflags = vmm_irq_save();
+    
     // Update our tracking
     current_pml4_phys = pml4_phys;
+    vmm_stats.switches++;
     
-    // Load the new CR3
-    write_cr3(pml4_phys);
+    // Load the new CR3; without PCIDs this flushes all non-global entries
+    if (!pcid_enabled) {
+        write_cr3(pml4_phys);
+        vmm_irq_restore(rflags);
+        return;
+    }
+    
+    spinlock_acquire(&pcid_lock);
+    uintptr_t cr3 = pcid_cr3(pml4_phys);
+    
+    // PCIDs are handed out globally, so this CPU may still hold entries a
+    // previous generation's owner of the PCID left behind
+    uint64_t* seen = &cpu_pcid_generation[percpu_current_id()];
+    bool stale = *seen != pcid_generation;
+    *seen = pcid_generation;
+    spinlock_release(&pcid_lock);
+    
+    write_cr3(cr3);
+    if (stale) {
+        flush_tlb_all_pcids();
+    }
+    vmm_irq_restore(rflags);
 }
 
 // Get current address space
@@ -850,20 +2145,130 @@ uintptr_t vmm_get_current_address_space(void) {
     return current_pml4_phys;
 }
 
-// Handle page fault (minimal implementation)
+// Set the areas consulted for faults the page tables cannot resolve
+void vmm_set_vma_space(vma_space_t* space) {
+    current_vma_space = space;
+}
+
+// Give a reserved page its zeroed frame
+static bool handle_demand_zero(uint64_t* pte, uintptr_t fault_addr) {
+    uint64_t entry = *pte & ~PAGE_LAZY;
+    bool user = (entry & PAGE_USER) != 0;
+    
+    // User frames may borrow idle pages of the DMA area
+    uintptr_t phys = pmm_alloc_page_flags(PMM_ALLOC_ZERO | (user ? PMM_ALLOC_MOVABLE : 0));
+    if (phys == 0) {
+        printf("VMM: Out of memory populating 0x%lx\n", fault_addr);
+        return false;
+    }
+    
+    pmm_page_set_owner(phys, user ? PMM_OWNER_USER : PMM_OWNER_KERNEL);
+    
+    *pte = phys | entry | PAGE_PRESENT;
+    invlpg(fault_addr & PAGE_ADDR_MASK);
+    
+    vmm_stats.faults_demand_zero++;
+    return true;
+}
+
+// Resolve a write to a copy-on-write page
+static bool handle_cow(uint64_t* pte, uintptr_t fault_addr) {
+    uint64_t entry = *pte;
+    uintptr_t frame = entry & PAGE_FRAME_MASK;
+    uint64_t new_flags = ((entry & ~PAGE_FRAME_MASK) & ~PAGE_COW) | PAGE_WRITABLE;
+    
+    // The last sharer takes the frame back without copying
+    if (pmm_page_refcount(frame) == 1) {
+        *pte = frame | new_flags;
+        invlpg(fault_addr & PAGE_ADDR_MASK);
+        vmm_stats.faults_cow_reuse++;
+        return true;
+    }
+    
+    uintptr_t copy = pmm_alloc_page_flags(PMM_ALLOC_MOVABLE);
+    if (copy == 0) {
+        printf("VMM: Out of memory copying 0x%lx\n", fault_addr);
+        return false;
+    }
+    pmm_page_set_owner(copy, PMM_OWNER_USER);
+    memcpy(phys_to_virt(copy), phys_to_virt(frame), PAGE_SIZE_4K);
+    
+    // The frame changes, so no CPU may keep reading the old one
+    *pte = copy | new_flags;
+    flush_entry(fault_addr & PAGE_ADDR_MASK, entry);
+    pmm_page_put(frame);
+    
+    vmm_stats.faults_cow_copy++;
+    return true;
+}
+
+// Handle page fault
 bool vmm_handle_page_fault(uintptr_t fault_addr, uint32_t error_code) {
-    printf("PAGE FAULT!");
+    // Classify the fault
+    if (error_code & VMM_PF_PRESENT) {
+        vmm_stats.faults_protection++;
+    } else {
+        vmm_stats.faults_not_present++;
+    }
+    if (error_code & VMM_PF_WRITE)       vmm_stats.faults_write++;
+    if (error_code & VMM_PF_USER)        vmm_stats.faults_user++;
+    if (error_code & VMM_PF_INSTRUCTION) vmm_stats.faults_instruction++;
+    
+    // A reserved bit means corrupted page tables; never try to fix that up
+    if (error_code & VMM_PF_RESERVED) {
+        vmm_stats.faults_reserved++;
+        vmm_stats.faults_unhandled++;
+        return false;
+    }
+    
+    uintptr_t pml4_phys = read_cr3() & PAGE_ADDR_MASK;
+    uint64_t* pte = walk_pte(pml4_phys, fault_addr, false);
+    
+    if (!(error_code & VMM_PF_PRESENT) && pte && (*pte & PAGE_LAZY)) {
+        if (handle_demand_zero(pte, fault_addr)) {
+            return true;
+        }
+    }
+    
+    if ((error_code & VMM_PF_PRESENT) && (error_code & VMM_PF_WRITE) &&
+        pte && (*pte & PAGE_PRESENT) && (*pte & PAGE_COW)) {
+        if (handle_cow(pte, fault_addr)) {
+            return true;
+        }
+    }
+    
+    // Otherwise the running process's areas decide what the address holds
+    vma_space_t* space = current_vma_space;
+    if (space && space->pml4_phys == pml4_phys && fault_addr < KERNEL_HALF_BASE) {
+        if (vma_handle_fault(space, fault_addr, error_code)) {
+            return true;
+        }
+    }
+    
+    vmm_stats.faults_unhandled++;
     return false;
 }
 
 // Flush TLB for a specific address
 void vmm_flush_tlb_page(uintptr_t virt_addr) {
-    invlpg(virt_addr);
+    flush_entry(virt_addr, PAGE_PRESENT);
 }
 
 // Flush entire TLB
 void vmm_flush_tlb_full(void) {
-    write_cr3(read_cr3());
+    __atomic_fetch_add(&xlate_epoch, 1, __ATOMIC_RELEASE);
+    
+    // Reloading CR3 only flushes the current PCID; retire the others
+    if (pcid_enabled) {
+        pcid_new_generation();
+    }
+    write_cr3(read_cr3() & ~CR3_NOFLUSH);
+    smp_tlb_shootdown();
+}
+
+// Drop every TLB entry of the calling CPU, answering a shootdown
+void vmm_flush_tlb_local(void) {
+    flush_tlb_all_pcids();
 }
 
 // Get VMM configuration
@@ -873,6 +2278,27 @@ void vmm_get_config(vmm_config_t *config) {
     }
 }
 
+// Get virtual memory statistics
+void vmm_get_stats(vmm_stats_t *stats) {
+    if (stats) {
+        *stats = vmm_stats;
+    }
+}
+
+// Get the higher half direct map offset
+uint64_t vmm_get_hhdm_offset(void) {
+    if (hhdm_offset) {
+        return hhdm_offset;
+    }
+    
+    // The PMM runs before vmm_init, so read the bootloader response directly
+    if (hhdm_request.response) {
+        return hhdm_request.response->offset;
+    }
+    
+    return 0xffff800000000000UL;
+}
+
 // Dump page tables for debugging
 void vmm_dump_page_tables(uintptr_t virt_addr) {
     printf("Page table info for address 0x%lx:\n", virt_addr);
@@ -5,6 +5,8 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+struct vma_space;
+
 // Page attributes and flags for x86_64
 #define VMM_FLAG_PRESENT       (1UL << 0)  // Page is present
 #define VMM_FLAG_WRITABLE      (1UL << 1)  // Page is writable
@@ -15,6 +17,8 @@
 #define VMM_FLAG_DIRTY         (1UL << 6)  // Page has been written to
 #define VMM_FLAG_HUGE          (1UL << 7)  // Huge page (2MB or 1GB)
 #define VMM_FLAG_GLOBAL        (1UL << 8)  // Page is global (not flushed from TLB)
+#define VMM_FLAG_LAZY          (1UL << 9)  // Populate with zero pages on first access
+#define VMM_FLAG_WC            (1UL << 10) // Write-combining (uncached if PAT is missing)
 #define VMM_FLAG_NO_EXECUTE    (1UL << 63) // NX bit - prevent execution
 
 // Special virtual memory addresses
@@ -22,12 +26,67 @@
 #define USER_STACK_TOP         0x00007FFFFFFFFFFFULL // Top of user stack
 #define KERNEL_STACK_TOP       0xFFFFFFFFFFFFEFFFULL // Top of kernel stack
 #define MMIO_BASE              0xFFFFFFFF40000000UL  // MMIO mapping region
+#define MMIO_SIZE              0x0000000040000000UL  // 1GB, up to the kernel image
+#define VMM_KERNEL_HEAP_BASE   0xFFFFC90000000000UL  // vmm_allocate kernel window
+#define VMM_KERNEL_HEAP_SIZE   0x0000001000000000UL  // 64GB
+#define VMM_USER_HEAP_BASE     0x0000000000400000UL  // vmm_allocate user window
+#define VMM_USER_HEAP_SIZE     0x0000000010000000UL  // 256MB
 
 // Page size definitions
 #define PAGE_SIZE_4K           4096UL
 #define PAGE_SIZE_2M           (PAGE_SIZE_4K * 512UL)
 #define PAGE_SIZE_1G           (PAGE_SIZE_2M * 512UL)
 
+// Address space clone flags
+#define VMM_CLONE_COW          (1U << 0)   // Share user frames copy-on-write
+
+// Table pages the idle loop reaps per iteration
+#define VMM_REAP_BATCH         32
+
+// 2MB ranges the idle loop promotes per iteration
+#define VMM_COLLAPSE_BATCH     1
+
+// Page fault error code bits
+#define VMM_PF_PRESENT         (1U << 0)   // Fault on a present entry
+#define VMM_PF_WRITE           (1U << 1)   // Faulting access was a write
+#define VMM_PF_USER            (1U << 2)   // Fault raised in user mode
+#define VMM_PF_RESERVED        (1U << 3)   // Reserved bit set in an entry
+#define VMM_PF_INSTRUCTION     (1U << 4)   // Fault on an instruction fetch
+
+// Virtual memory statistics
+typedef struct {
+    size_t pages_allocated;      // Pages mapped by vmm_allocate
+    size_t pages_freed;          // Pages released by vmm_free
+    size_t page_faults_handled;  // Faults resolved without panicking
+    size_t faults_not_present;   // Faults on non-present entries
+    size_t faults_protection;    // Faults on present entries
+    size_t faults_write;         // Faults on writes
+    size_t faults_user;          // Faults raised in user mode
+    size_t faults_instruction;   // Faults on instruction fetches
+    size_t faults_reserved;      // Faults on reserved bits
+    size_t faults_demand_zero;   // Faults resolved with a fresh zero page
+    size_t faults_cow_copy;      // Copy-on-write faults that copied a frame
+    size_t faults_cow_reuse;     // Copy-on-write faults on a no longer shared frame
+    size_t switches;             // Address space switches
+    size_t switches_noflush;     // Switches that kept the TLB contents (PCID)
+    size_t pcid_generations;     // Times every PCID was retired
+    size_t leaves_4k;            // 4KB leaves written by range mappings
+    size_t leaves_2m;            // 2MB leaves written by range mappings
+    size_t leaves_1g;            // 1GB leaves written by range mappings
+    size_t tlb_page_flushes;     // Single pages invalidated by range operations
+    size_t tlb_full_flushes;     // Range operations that flushed the whole TLB
+    size_t io_mappings;          // Live physical mappings in the MMIO window
+    size_t io_reuses;            // Physical mappings satisfied by an existing one
+    size_t pt_pool_hits;         // Table pages taken from the zeroed pool
+    size_t pt_pool_misses;       // Table pages allocated from the PMM
+    size_t address_spaces_reaped; // Dead address spaces torn down
+    size_t thp_collapses;        // 2MB user ranges promoted to a single leaf
+    size_t thp_splits;           // Promoted ranges demoted back to 4KB entries
+    size_t xlate_hits;           // Kernel translations served from the cache
+    size_t xlate_misses;         // Kernel translations that walked the tables
+    size_t faults_unhandled;     // Faults nothing could resolve
+} vmm_stats_t;
+
 // Virtual memory manager configuration
 typedef struct {
     uintptr_t kernel_pml4;        // Physical address of kernel page tables
@@ -35,11 +94,16 @@ typedef struct {
     size_t    kernel_virtual_size; // Size of kernel virtual address space
     bool      using_pae;           // Is PAE enabled?
     bool      using_nx;            // Is NX bit supported?
+    bool      using_pcid;          // Are address spaces tagged with PCIDs?
+    bool      using_pat;           // Is the PAT programmed with a WC entry?
 } vmm_config_t;
 
 // Initialize the virtual memory manager
 void vmm_init(void);
 
+// Load the kernel page tables and paging features on an application processor
+void vmm_init_cpu(void);
+
 // Map virtual address to physical address
 bool vmm_map_page(uintptr_t virt_addr, uintptr_t phys_addr, uint64_t flags);
 
@@ -49,10 +113,22 @@ bool vmm_unmap_page(uintptr_t virt_addr);
 // Map multiple consecutive pages
 bool vmm_map_pages(uintptr_t virt_addr, uintptr_t phys_addr, size_t count, uint64_t flags);
 
+// Reserve pages that are populated with zeroed frames on first access
+bool vmm_map_lazy(uintptr_t virt_addr, size_t count, uint64_t flags);
+
 // Unmap multiple consecutive pages
 bool vmm_unmap_pages(uintptr_t virt_addr, size_t count);
 
-// Get physical address from virtual address
+// Unmap pages and drop the user-owned frames behind them
+void vmm_release_pages(uintptr_t virt_addr, size_t count);
+
+// Change the protection of mapped and reserved pages; copy-on-write pages
+// stay read-only until their next write fault
+bool vmm_protect_pages(uintptr_t virt_addr, size_t count, uint64_t flags);
+
+// Get physical address from virtual address (0 if unmapped); direct-map
+// addresses are translated arithmetically and other kernel addresses
+// through a translation cache, so the common cases never walk the tables
 uintptr_t vmm_get_physical_address(uintptr_t virt_addr);
 
 // Check if address is mapped
@@ -61,22 +137,41 @@ bool vmm_is_mapped(uintptr_t virt_addr);
 // Create a new address space (page table)
 uintptr_t vmm_create_address_space(void);
 
-// Delete an address space
+// Duplicate the user half of an address space; with VMM_CLONE_COW the user
+// frames are shared read-only and split on the first write, otherwise they
+// are copied
+uintptr_t vmm_clone_address_space(uintptr_t pml4_phys, uint32_t flags);
+
+// Delete an address space; the tables are torn down later by the reaper,
+// so the caller may still be running on them
 void vmm_delete_address_space(uintptr_t pml4_phys);
 
+// Promote fully populated 2MB ranges of private user frames in an address
+// space that is not running to single 2MB leaves; returns the number promoted
+size_t vmm_collapse_huge_pages(uintptr_t pml4_phys, size_t budget);
+
+// Tear down deleted address spaces and top up the page-table pool, freeing
+// about budget table pages; meant for idle context
+size_t vmm_reap_address_spaces(size_t budget);
+
 // Switch to a different address space
 void vmm_switch_address_space(uintptr_t pml4_phys);
 
 // Get current address space
 uintptr_t vmm_get_current_address_space(void);
 
+// Set the areas consulted for faults the page tables cannot resolve
+void vmm_set_vma_space(struct vma_space* space);
+
 // Allocate virtual memory (returns virtual address)
+// With VMM_FLAG_LAZY only the range is reserved; pages fault in on first use
 void* vmm_allocate(size_t size, uint64_t flags);
 
 // Free virtual memory
 void vmm_free(void* addr, size_t size);
 
-// Map physical memory to virtual address space
+// Map physical memory into the MMIO window; a range already mapped with the
+// same flags is shared, and a conflicting cache type is refused
 void* vmm_map_physical(uintptr_t phys_addr, size_t size, uint64_t flags);
 
 // Unmap previously mapped physical memory
@@ -91,9 +186,18 @@ void vmm_flush_tlb_page(uintptr_t virt_addr);
 // Flush entire TLB
 void vmm_flush_tlb_full(void);
 
+// Flush every TLB entry of the calling CPU only
+void vmm_flush_tlb_local(void);
+
 // Get VMM configuration
 void vmm_get_config(vmm_config_t *config);
 
+// Get virtual memory statistics
+void vmm_get_stats(vmm_stats_t *stats);
+
+// Get the higher half direct map offset (valid before vmm_init)
+uint64_t vmm_get_hhdm_offset(void);
+
 // Debug function to dump page tables
 void vmm_dump_page_tables(uintptr_t virt_addr);
 void dump_page_flags(uint64_t entry);
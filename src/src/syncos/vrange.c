@@ -0,0 +1,341 @@
+#include <syncos/vrange.h>
+#include <syncos/slab.h>
+#include <kstd/stdio.h>
+#include <kstd/string.h>
+
+// A free or allocated range; free ranges live in both free trees,
+// allocated ranges only in the allocated tree (through addr_node)
+typedef struct {
+    rb_node_t addr_node;
+    rb_node_t size_node;
+    uintptr_t base;
+    size_t size;
+} vrange_t;
+
+static kmem_cache_t* vrange_cache = NULL;
+
+static inline vrange_t* addr_entry(rb_node_t* node) {
+    return node ? rb_entry(node, vrange_t, addr_node) : NULL;
+}
+
+static inline vrange_t* size_entry(rb_node_t* node) {
+    return node ? rb_entry(node, vrange_t, size_node) : NULL;
+}
+
+// Insert a range into a tree keyed by base address
+static void addr_insert(rb_root_t* root, vrange_t* range) {
+    rb_node_t** link = &root->root;
+    rb_node_t* parent = NULL;
+    
+    while (*link) {
+        parent = *link;
+        if (range->base < addr_entry(parent)->base) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+        }
+    }
+    
+    rb_link_node(&range->addr_node, parent, link);
+    rb_insert_color(root, &range->addr_node);
+}
+
+// Insert a free range into the size tree, ties broken by address
+static void size_insert(rb_root_t* root, vrange_t* range) {
+    rb_node_t** link = &root->root;
+    rb_node_t* parent = NULL;
+    
+    while (*link) {
+        parent = *link;
+        vrange_t* other = size_entry(parent);
+        if (range->size < other->size ||
+            (range->size == other->size && range->base < other->base)) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+        }
+    }
+    
+    rb_link_node(&range->size_node, parent, link);
+    rb_insert_color(root, &range->size_node);
+}
+
+// Find the range starting exactly at addr
+static vrange_t* addr_find(rb_root_t* root, uintptr_t addr) {
+    rb_node_t* node = root->root;
+    
+    while (node) {
+        vrange_t* range = addr_entry(node);
+        if (addr < range->base) {
+            node = node->left;
+        } else if (addr > range->base) {
+            node = node->right;
+        } else {
+            return range;
+        }
+    }
+    
+    return NULL;
+}
+
+// Find the free neighbours below and above addr
+static void addr_neighbours(rb_root_t* root, uintptr_t addr, vrange_t** below, vrange_t** above) {
+    rb_node_t* node = root->root;
+    *below = NULL;
+    *above = NULL;
+    
+    while (node) {
+        vrange_t* range = addr_entry(node);
+        if (addr < range->base) {
+            *above = range;
+            node = node->left;
+        } else {
+            *below = range;
+            node = node->right;
+        }
+    }
+}
+
+// Find the smallest free range of at least size bytes
+static vrange_t* size_best_fit(rb_root_t* root, size_t size) {
+    rb_node_t* node = root->root;
+    vrange_t* best = NULL;
+    
+    while (node) {
+        vrange_t* range = size_entry(node);
+        if (range->size >= size) {
+            best = range;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+    
+    return best;
+}
+
+static void free_insert(vrange_arena_t* arena, vrange_t* range) {
+    addr_insert(&arena->free_by_addr, range);
+    size_insert(&arena->free_by_size, range);
+    arena->free_ranges++;
+}
+
+static void free_remove(vrange_arena_t* arena, vrange_t* range) {
+    rb_erase(&arena->free_by_addr, &range->addr_node);
+    rb_erase(&arena->free_by_size, &range->size_node);
+    arena->free_ranges--;
+}
+
+// Change the extent of a free range in place; its address order relative
+// to the other free ranges never changes, so only the size tree is updated
+static void free_resize(vrange_arena_t* arena, vrange_t* range, uintptr_t base, size_t size) {
+    rb_erase(&arena->free_by_size, &range->size_node);
+    range->base = base;
+    range->size = size;
+    size_insert(&arena->free_by_size, range);
+}
+
+static vrange_t* vrange_node_alloc(void) {
+    return (vrange_t*)kmem_cache_alloc(vrange_cache);
+}
+
+// Initialize an arena covering [base, base + size)
+bool vrange_init(vrange_arena_t* arena, const char* name, uintptr_t base, size_t size) {
+    if (!arena || size < VRANGE_PAGE_SIZE || (base & (VRANGE_PAGE_SIZE - 1))) {
+        return false;
+    }
+    
+    if (!vrange_cache) {
+        vrange_cache = kmem_cache_create("vrange", sizeof(vrange_t), 0);
+        if (!vrange_cache) {
+            printf("VRANGE: Failed to create node cache\n");
+            return false;
+        }
+    }
+    
+    memset(arena, 0, sizeof(*arena));
+    arena->name = name;
+    arena->base = base;
+    arena->size = size & ~(VRANGE_PAGE_SIZE - 1);
+    spinlock_init(&arena->lock);
+    spinlock_set_name(&arena->lock, name);
+    
+    vrange_t* range = vrange_node_alloc();
+    if (!range) {
+        return false;
+    }
+    range->base = arena->base;
+    range->size = arena->size;
+    free_insert(arena, range);
+    arena->free_bytes = arena->size;
+    
+    return true;
+}
+
+// Allocate a range; align must be a power of two (0 for page alignment)
+uintptr_t vrange_alloc(vrange_arena_t* arena, size_t size, size_t align) {
+    if (!arena || size == 0 || (align & (align - 1)) != 0) {
+        return 0;
+    }
+    
+    size = (size + VRANGE_PAGE_SIZE - 1) & ~(VRANGE_PAGE_SIZE - 1);
+    if (align < VRANGE_PAGE_SIZE) {
+        align = VRANGE_PAGE_SIZE;
+    }
+    
+    // Any free range this large can hold an aligned block
+    size_t search = size + (align - VRANGE_PAGE_SIZE);
+    if (search < size) {
+        return 0;
+    }
+    
+    // Nodes for the split are taken up front so the tree update cannot fail
+    vrange_t* spare[2];
+    spare[0] = vrange_node_alloc();
+    spare[1] = vrange_node_alloc();
+    if (!spare[0] || !spare[1]) {
+        if (spare[0]) kmem_cache_free(vrange_cache, spare[0]);
+        if (spare[1]) kmem_cache_free(vrange_cache, spare[1]);
+        return 0;
+    }
+    int spare_used = 0;
+    
+    spinlock_acquire(&arena->lock);
+    
+    vrange_t* range = size_best_fit(&arena->free_by_size, search);
+    if (!range) {
+        spinlock_release(&arena->lock);
+        kmem_cache_free(vrange_cache, spare[0]);
+        kmem_cache_free(vrange_cache, spare[1]);
+        return 0;
+    }
+    
+    uintptr_t start = (range->base + align - 1) & ~(align - 1);
+    uintptr_t end = start + size;
+    uintptr_t range_end = range->base + range->size;
+    vrange_t* used;
+    
+    if (start == range->base && end == range_end) {
+        // Exact fit: the free node becomes the allocation
+        free_remove(arena, range);
+        used = range;
+    } else if (start == range->base) {
+        // Carve from the front, the remainder stays free
+        free_resize(arena, range, end, range_end - end);
+        used = spare[spare_used++];
+    } else {
+        // Keep the unaligned head free, and the tail if any
+        free_resize(arena, range, range->base, start - range->base);
+        if (end < range_end) {
+            vrange_t* tail = spare[spare_used++];
+            tail->base = end;
+            tail->size = range_end - end;
+            free_insert(arena, tail);
+        }
+        used = spare[spare_used++];
+    }
+    
+    used->base = start;
+    used->size = size;
+    addr_insert(&arena->allocated, used);
+    arena->allocated_ranges++;
+    arena->free_bytes -= size;
+    
+    spinlock_release(&arena->lock);
+    
+    while (spare_used < 2) {
+        kmem_cache_free(vrange_cache, spare[spare_used++]);
+    }
+    
+    return start;
+}
+
+// Free a range by its start address, returning its size (0 if unknown)
+size_t vrange_free(vrange_arena_t* arena, uintptr_t addr) {
+    if (!arena || !vrange_contains(arena, addr)) {
+        return 0;
+    }
+    
+    vrange_t* dead[2] = { NULL, NULL };
+    
+    spinlock_acquire(&arena->lock);
+    
+    vrange_t* range = addr_find(&arena->allocated, addr);
+    if (!range) {
+        spinlock_release(&arena->lock);
+        printf("VRANGE: %s: free of unallocated address 0x%lx\n", arena->name, addr);
+        return 0;
+    }
+    
+    size_t size = range->size;
+    rb_erase(&arena->allocated, &range->addr_node);
+    arena->allocated_ranges--;
+    arena->free_bytes += size;
+    
+    vrange_t* below;
+    vrange_t* above;
+    addr_neighbours(&arena->free_by_addr, addr, &below, &above);
+    
+    bool merge_below = below && below->base + below->size == addr;
+    bool merge_above = above && addr + size == above->base;
+    
+    if (merge_below && merge_above) {
+        // Bridge two free ranges: keep the lower one
+        free_remove(arena, above);
+        free_resize(arena, below, below->base, below->size + size + above->size);
+        dead[0] = range;
+        dead[1] = above;
+    } else if (merge_below) {
+        free_resize(arena, below, below->base, below->size + size);
+        dead[0] = range;
+    } else if (merge_above) {
+        free_resize(arena, above, addr, size + above->size);
+        dead[0] = range;
+    } else {
+        free_insert(arena, range);
+    }
+    
+    spinlock_release(&arena->lock);
+    
+    for (int i = 0; i < 2; i++) {
+        if (dead[i]) {
+            kmem_cache_free(vrange_cache, dead[i]);
+        }
+    }
+    
+    return size;
+}
+
+// Get the size of the allocated range starting at addr (0 if unknown)
+size_t vrange_lookup(vrange_arena_t* arena, uintptr_t addr) {
+    if (!arena) {
+        return 0;
+    }
+    
+    spinlock_acquire(&arena->lock);
+    vrange_t* range = addr_find(&arena->allocated, addr);
+    size_t size = range ? range->size : 0;
+    spinlock_release(&arena->lock);
+    
+    return size;
+}
+
+// Get arena statistics
+void vrange_get_stats(vrange_arena_t* arena, vrange_stats_t* stats) {
+    if (!arena || !stats) {
+        return;
+    }
+    
+    spinlock_acquire(&arena->lock);
+    
+    stats->base = arena->base;
+    stats->size = arena->size;
+    stats->free_bytes = arena->free_bytes;
+    stats->free_ranges = arena->free_ranges;
+    stats->allocated_ranges = arena->allocated_ranges;
+    
+    vrange_t* largest = size_entry(rb_last(&arena->free_by_size));
+    stats->largest_free = largest ? largest->size : 0;
+    
+    spinlock_release(&arena->lock);
+}
@@ -0,0 +1,67 @@
+#ifndef _SYNCOS_VRANGE_H
+#define _SYNCOS_VRANGE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <syncos/spinlock.h>
+#include <kstd/rbtree.h>
+
+// Virtual address range allocator
+//
+// An arena hands out page-granular ranges of a fixed virtual window. Free
+// ranges are indexed twice, by address (for coalescing on free) and by
+// size (for best-fit allocation), and allocated ranges are indexed by
+// address so a free only needs the start address. Every operation is
+// O(log n) in the number of ranges.
+
+#define VRANGE_PAGE_SIZE 4096UL
+
+// Allocator arena; fields are private to vrange.c
+typedef struct {
+    const char* name;
+    uintptr_t base;
+    size_t size;
+
+    spinlock_t lock;
+    rb_root_t free_by_addr;    // Free ranges ordered by base
+    rb_root_t free_by_size;    // Free ranges ordered by (size, base)
+    rb_root_t allocated;       // Allocated ranges ordered by base
+
+    size_t free_bytes;
+    size_t free_ranges;
+    size_t allocated_ranges;
+} vrange_arena_t;
+
+// Arena statistics
+typedef struct {
+    uintptr_t base;            // Start of the managed window
+    size_t size;               // Size of the managed window
+    size_t free_bytes;         // Bytes not handed out
+    size_t free_ranges;        // Number of free fragments
+    size_t largest_free;       // Largest free fragment
+    size_t allocated_ranges;   // Live allocations
+} vrange_stats_t;
+
+// Initialize an arena covering [base, base + size)
+bool vrange_init(vrange_arena_t* arena, const char* name, uintptr_t base, size_t size);
+
+// Allocate a range; align must be a power of two (0 for page alignment)
+// Returns 0 if no free range is large enough
+uintptr_t vrange_alloc(vrange_arena_t* arena, size_t size, size_t align);
+
+// Free a range by its start address, returning its size (0 if unknown)
+size_t vrange_free(vrange_arena_t* arena, uintptr_t addr);
+
+// Get the size of the allocated range starting at addr (0 if unknown)
+size_t vrange_lookup(vrange_arena_t* arena, uintptr_t addr);
+
+// Check whether an address lies inside the arena's window
+static inline bool vrange_contains(const vrange_arena_t* arena, uintptr_t addr) {
+    return addr >= arena->base && addr - arena->base < arena->size;
+}
+
+// Get arena statistics
+void vrange_get_stats(vrange_arena_t* arena, vrange_stats_t* stats);
+
+#endif // _SYNCOS_VRANGE_H